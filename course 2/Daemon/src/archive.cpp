@@ -0,0 +1,467 @@
+#include "archive.h"
+
+#include "cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <system_error>
+
+namespace
+{
+    const char magic[4] = {'B', 'K', 'A', '1'};
+    const size_t recordSize = 3 * sizeof(uint64_t) + 2 * sizeof(uint32_t) + sizeof(uint64_t);
+    const size_t trailerSize = 3 * sizeof(uint64_t) + sizeof(magic);
+    const size_t bufferSize = 1 << 20;
+
+    // Files up to this size are read by the workers, larger ones are streamed
+    const uint64_t smallSize = 1 << 20;
+    const size_t batchFiles = 256;
+    const uint64_t batchBytes = 32 << 20;
+
+    // Written data is dropped from the page cache in pieces of this size
+    const uint64_t releaseSize = 64 << 20;
+
+    [[noreturn]] void fail(const std::string& message, const std::filesystem::path& path)
+    {
+        throw std::filesystem::filesystem_error(message, path, std::error_code(errno, std::generic_category()));
+    }
+
+    template <class T>
+    void append(std::vector<char>& buffer, const T& value)
+    {
+        const char* bytes = reinterpret_cast<const char*>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    template <class T>
+    T extract(const char*& data)
+    {
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        data += sizeof(T);
+        return value;
+    }
+
+    // Data of one entry read ahead by a worker
+    struct Item
+    {
+        Entry entry;
+        std::string data;
+        bool stream = false;
+        std::string error;
+    };
+
+    void readItem(Item& item, const std::filesystem::path& source, CopyEngine& engine)
+    {
+        try
+        {
+            if (S_ISLNK(item.entry.mode))
+            {
+                item.data = std::filesystem::read_symlink(source).string();
+                return;
+            }
+            if (!S_ISREG(item.entry.mode) || item.stream)
+            {
+                return;
+            }
+            FileDescriptor fd(open(source.c_str(), O_RDONLY | O_CLOEXEC));
+            if (fd == -1)
+            {
+                fail("Failed to open", source);
+            }
+            PageCacheGuard cache(fd, engine.cacheNeutral());
+            // Read until the end, the file may have grown since the scan
+            item.data.resize(item.entry.size + 1);
+            size_t total = 0;
+            while (true)
+            {
+                if (total == item.data.size())
+                {
+                    item.data.resize(total * 2);
+                }
+                ssize_t count = read(fd, &item.data[total], item.data.size() - total);
+                if (count < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    fail("Failed to read", source);
+                }
+                if (count == 0)
+                {
+                    break;
+                }
+                total += count;
+                engine.throttle().consume(count);
+            }
+            item.data.resize(total);
+        }
+        catch (const std::exception& error)
+        {
+            item.error = error.what();
+        }
+    }
+}
+
+ArchiveWriter::ArchiveWriter(const std::filesystem::path& path, Throttle* throttle, bool cacheNeutral):
+path(path),
+temporary(path.parent_path() / ("." + path.filename().string() + ".partial")),
+throttle(throttle),
+cacheNeutral(cacheNeutral),
+fd(open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644))
+{
+    if (fd == -1)
+    {
+        fail("Failed to create", temporary);
+    }
+    buffer.reserve(bufferSize);
+    write(magic, sizeof(magic));
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+    if (!finished)
+    {
+        unlink(temporary.c_str());
+    }
+}
+
+void ArchiveWriter::flush()
+{
+    const char* data = buffer.data();
+    size_t size = buffer.size();
+    while (size > 0)
+    {
+        ssize_t count = ::write(fd, data, size);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fail("Failed to write", temporary);
+        }
+        data += count;
+        size -= count;
+    }
+    buffer.clear();
+    release(false);
+}
+
+void ArchiveWriter::release(bool all)
+{
+    uint64_t end = offset - buffer.size();
+    if (cacheNeutral && (end - released >= releaseSize || (all && end > released)))
+    {
+        dropCache(fd, true, released, end - released);
+        released = end;
+    }
+}
+
+void ArchiveWriter::write(const char* data, size_t size)
+{
+    if (buffer.size() + size > bufferSize)
+    {
+        flush();
+    }
+    if (size >= bufferSize)
+    {
+        buffer.assign(data, data + size);
+        flush();
+    }
+    else
+    {
+        buffer.insert(buffer.end(), data, data + size);
+    }
+    offset += size;
+}
+
+void ArchiveWriter::record(const Entry& entry, uint64_t offset, uint64_t size)
+{
+    append(records, offset);
+    append(records, size);
+    append(records, entry.mtime);
+    append(records, entry.mode);
+    append(records, static_cast<uint32_t>(entry.path.size()));
+    append(records, static_cast<uint64_t>(paths.size()));
+    paths += entry.path;
+}
+
+void ArchiveWriter::add(const Entry& entry, const char* data, size_t size)
+{
+    record(entry, offset, size);
+    write(data, size);
+}
+
+uint64_t ArchiveWriter::add(const Entry& entry, int in, const std::filesystem::path& source)
+{
+    // The kernel moves the data, user space copies only if it can not
+    flush();
+    uint64_t start = offset;
+    bool kernel = true;
+    size_t chunk = throttle != nullptr ? throttle->chunkSize(1 << 30) : 1 << 30;
+    std::vector<char> data;
+    while (true)
+    {
+        ssize_t count = kernel ? copy_file_range(in, nullptr, fd, nullptr, chunk, 0) : -1;
+        if (count < 0 && kernel && offset == start && (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOSYS))
+        {
+            kernel = false;
+            data.resize(std::min(bufferSize, chunk));
+        }
+        if (!kernel)
+        {
+            count = read(in, data.data(), data.size());
+            if (count > 0)
+            {
+                write(data.data(), count);
+                flush();
+                if (throttle != nullptr)
+                {
+                    throttle->consume(count, 2);
+                }
+                continue;
+            }
+        }
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fail("Failed to copy", source);
+        }
+        if (count == 0)
+        {
+            break;
+        }
+        offset += count;
+        if (throttle != nullptr)
+        {
+            throttle->consume(count);
+        }
+    }
+    record(entry, start, offset - start);
+    release(false);
+    return offset - start;
+}
+
+void ArchiveWriter::finish()
+{
+    uint64_t recordsOffset = offset;
+    uint64_t count = records.size() / recordSize;
+    write(records.data(), records.size());
+    uint64_t pathsOffset = offset;
+    write(paths.data(), paths.size());
+
+    std::vector<char> trailer;
+    append(trailer, recordsOffset);
+    append(trailer, count);
+    append(trailer, pathsOffset);
+    trailer.insert(trailer.end(), magic, magic + sizeof(magic));
+    write(trailer.data(), trailer.size());
+    flush();
+
+    if (fsync(fd) != 0)
+    {
+        fail("Failed to sync", temporary);
+    }
+    release(true);
+    std::filesystem::rename(temporary, path);
+    finished = true;
+}
+
+Archive::Archive(const std::filesystem::path& path)
+{
+    FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat status;
+    if (fd == -1 || fstat(fd, &status) != 0)
+    {
+        fail("Failed to open", path);
+    }
+    length = status.st_size;
+    if (length < sizeof(magic) + trailerSize)
+    {
+        throw std::runtime_error("Not an archive " + path.string());
+    }
+    void* address = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED)
+    {
+        fail("Failed to map", path);
+    }
+    memory = static_cast<const char*>(address);
+
+    const char* trailer = memory + length - trailerSize;
+    uint64_t recordsOffset = extract<uint64_t>(trailer);
+    count = extract<uint64_t>(trailer);
+    uint64_t pathsOffset = extract<uint64_t>(trailer);
+    if (std::memcmp(memory, magic, sizeof(magic)) != 0 || std::memcmp(trailer, magic, sizeof(magic)) != 0
+        || recordsOffset + count * recordSize != pathsOffset || pathsOffset > length - trailerSize)
+    {
+        munmap(address, length);
+        throw std::runtime_error("Corrupted archive " + path.string());
+    }
+    records = memory + recordsOffset;
+    paths = memory + pathsOffset;
+}
+
+Archive::~Archive()
+{
+    munmap(const_cast<char*>(memory), length);
+}
+
+ArchiveEntry Archive::entry(size_t index) const
+{
+    const char* data = records + index * recordSize;
+    ArchiveEntry entry;
+    entry.offset = extract<uint64_t>(data);
+    entry.size = extract<uint64_t>(data);
+    entry.mtime = extract<int64_t>(data);
+    entry.mode = extract<uint32_t>(data);
+    uint32_t pathLength = extract<uint32_t>(data);
+    uint64_t pathOffset = extract<uint64_t>(data);
+    entry.path = std::string_view(paths + pathOffset, pathLength);
+    return entry;
+}
+
+bool Archive::find(const std::string& path, ArchiveEntry& entry) const
+{
+    size_t first = 0;
+    size_t last = count;
+    while (first < last)
+    {
+        size_t middle = first + (last - first) / 2;
+        ArchiveEntry current = this->entry(middle);
+        int order = current.path.compare(path);
+        if (order == 0)
+        {
+            entry = current;
+            return true;
+        }
+        if (order < 0)
+        {
+            first = middle + 1;
+        }
+        else
+        {
+            last = middle;
+        }
+    }
+    return false;
+}
+
+bool Archive::isArchive(const std::filesystem::path& path)
+{
+    FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    char header[sizeof(magic)];
+    return fd != -1 && pread(fd, header, sizeof(header), 0) == sizeof(header)
+        && std::memcmp(header, magic, sizeof(magic)) == 0;
+}
+
+void archiveBackup(ChangeTracker& tracker, CopyEngine& engine, const std::string& dst, const std::string& dateTime,
+    CycleMetrics& metrics)
+{
+    auto start = std::chrono::steady_clock::now();
+    const std::string& src = tracker.source();
+    std::filesystem::path outputPath = std::filesystem::path(dst) / dateTime;
+    Manifest entries;
+    Entry root;
+    {
+        PhaseTimer timer(metrics, Phase::Scan);
+        root = statRoot(src);
+        entries = tracker.scan();
+    }
+    metrics.scanned = entries.size();
+    PhaseTimer copyTimer(metrics, Phase::Copy);
+    ArchiveWriter writer(outputPath, &engine.throttle(), engine.cacheNeutral());
+    // The empty path sorts before everything else
+    writer.add(root, nullptr, 0);
+
+    // Workers read a batch of small files ahead while the archive is written
+    // strictly sequentially in path order
+    uint64_t bytes = 0;
+    size_t failed = 0;
+    for (size_t first = 0; first < entries.size();)
+    {
+        std::vector<Item> items;
+        uint64_t size = 0;
+        for (; first < entries.size() && items.size() < batchFiles && size < batchBytes; ++first)
+        {
+            Item item;
+            item.entry = std::move(entries[first]);
+            item.stream = S_ISREG(item.entry.mode) && item.entry.size > smallSize;
+            size += item.stream ? 0 : item.entry.size;
+            items.push_back(std::move(item));
+        }
+
+        TaskGroup group(engine.pool());
+        for (Item& item : items)
+        {
+            group.run([&item, &src, &engine, &metrics]
+            {
+                auto start = std::chrono::steady_clock::now();
+                readItem(item, std::filesystem::path(src) / item.entry.path, engine);
+                if (!item.stream && (S_ISREG(item.entry.mode) || S_ISLNK(item.entry.mode)))
+                {
+                    metrics.latency.observe(std::chrono::steady_clock::now() - start);
+                }
+            });
+        }
+        group.wait();
+
+        for (Item& item : items)
+        {
+            std::filesystem::path source = std::filesystem::path(src) / item.entry.path;
+            try
+            {
+                if (!item.error.empty())
+                {
+                    throw std::runtime_error(item.error);
+                }
+                if (item.stream)
+                {
+                    FileDescriptor fd(open(source.c_str(), O_RDONLY | O_CLOEXEC));
+                    if (fd == -1)
+                    {
+                        fail("Failed to open", source);
+                    }
+                    PageCacheGuard cache(fd, engine.cacheNeutral());
+                    auto start = std::chrono::steady_clock::now();
+                    bytes += writer.add(item.entry, fd, source);
+                    metrics.latency.observe(std::chrono::steady_clock::now() - start);
+                }
+                else
+                {
+                    writer.add(item.entry, item.data.data(), item.data.size());
+                    bytes += item.data.size();
+                }
+            }
+            catch (const std::exception& error)
+            {
+                // Leave the entry out, so the next cycle retries it
+                syslog(LOG_WARNING, "%s", error.what());
+                tracker.markDirty(item.entry.path);
+                ++failed;
+            }
+        }
+    }
+    copyTimer.stop();
+    {
+        PhaseTimer timer(metrics, Phase::Fsync);
+        writer.finish();
+    }
+    metrics.copied = entries.size() - failed;
+    metrics.failed = failed;
+    metrics.bytes = bytes;
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    syslog(LOG_INFO, "Archived %zu entries, %zu failed, %.1f MiB from %s to %s in %.2f s",
+        entries.size() - failed, failed, bytes / 1048576.0, src.c_str(), outputPath.c_str(), seconds);
+}
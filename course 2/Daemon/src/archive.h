@@ -0,0 +1,106 @@
+#ifndef BACKUP_ARCHIVE_H
+#define BACKUP_ARCHIVE_H
+
+#include "copier.h"
+#include "file_copy.h"
+#include "manifest.h"
+#include "throttle.h"
+#include "tracker.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Archive layout, numbers in host byte order like in the store:
+//   header  "BKA1"
+//   data    file contents and symlink targets one after another
+//   records one per entry in path order: u64 offset, u64 size, i64 mtime,
+//           u32 mode, u32 path length, u64 path offset
+//   paths   all paths one after another
+//   trailer u64 records offset, u64 count, u64 paths offset, "BKA1"
+// The index is at the end, so the archive is written in one sequential pass.
+struct ArchiveEntry
+{
+    std::string_view path;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    uint32_t mode = 0;
+};
+
+// Appends entries in path order, the archive appears under its name only
+// after finish(), an interrupted one is removed
+class ArchiveWriter
+{
+public:
+    // With `cacheNeutral` the written data is dropped from the page cache as it goes
+    explicit ArchiveWriter(const std::filesystem::path& path, Throttle* throttle = nullptr, bool cacheNeutral = false);
+    ~ArchiveWriter();
+
+    ArchiveWriter(const ArchiveWriter&) = delete;
+    ArchiveWriter& operator=(const ArchiveWriter&) = delete;
+
+    // The data is already in memory
+    void add(const Entry& entry, const char* data, size_t size);
+
+    // Streams the file from the descriptor, returns the number of bytes copied
+    uint64_t add(const Entry& entry, int fd, const std::filesystem::path& source);
+
+    void finish();
+
+private:
+    void write(const char* data, size_t size);
+    void flush();
+    void record(const Entry& entry, uint64_t offset, uint64_t size);
+    void release(bool all);
+
+    std::filesystem::path path;
+    std::filesystem::path temporary;
+    Throttle* throttle;
+    bool cacheNeutral;
+    FileDescriptor fd;
+    uint64_t offset = 0;
+    uint64_t released = 0;
+    std::vector<char> buffer;
+    std::vector<char> records;
+    std::string paths;
+    bool finished = false;
+};
+
+// Read-only view of an archive through mmap, listing and lookups touch the
+// index pages only
+class Archive
+{
+public:
+    explicit Archive(const std::filesystem::path& path);
+    ~Archive();
+
+    Archive(const Archive&) = delete;
+    Archive& operator=(const Archive&) = delete;
+
+    size_t size() const { return count; }
+    ArchiveEntry entry(size_t index) const;
+
+    // Binary search by the relative path
+    bool find(const std::string& path, ArchiveEntry& entry) const;
+
+    const char* data(const ArchiveEntry& entry) const { return memory + entry.offset; }
+
+    // True if the file starts with the archive magic
+    static bool isArchive(const std::filesystem::path& path);
+
+private:
+    const char* memory = nullptr;
+    size_t length = 0;
+    const char* records = nullptr;
+    const char* paths = nullptr;
+    size_t count = 0;
+};
+
+// Writes the whole source tree into the single file dst/dateTime
+void archiveBackup(ChangeTracker& tracker, CopyEngine& engine, const std::string& dst, const std::string& dateTime,
+    CycleMetrics& metrics);
+
+#endif
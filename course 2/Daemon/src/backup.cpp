@@ -0,0 +1,622 @@
+#include "backup.h"
+
+#include "archive.h"
+#include "copier.h"
+#include "dedup.h"
+#include "fanout.h"
+#include "manifest.h"
+#include "pipeline.h"
+#include "scan_index.h"
+#include "snapshot.h"
+#include "staging.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    // Block signatures of the newest copy of every large file, see DeltaCopier
+    const std::string signaturesName = ".signatures";
+
+    // Entries decided on at once, they are copied as one batch
+    const size_t batchEntries = 1024;
+    // Batches copied but not yet written to the manifest, they bound the memory of a cycle
+    const size_t batchesInFlight = 8;
+
+    std::filesystem::path signaturePath(const std::string& dst, const std::string& path)
+    {
+        Digest name = computeDigest(reinterpret_cast<const unsigned char*>(path.data()), path.size());
+        return std::filesystem::path(dst) / signaturesName / toHex(name);
+    }
+
+    // Entries of the new manifest decided on together and the copies they need
+    struct SnapshotBatch
+    {
+        Manifest entries;
+        // Per job the entry it recreates and whether that one changed, the others are linked
+        std::vector<size_t> jobEntries;
+        std::vector<char> jobChanged;
+        std::vector<std::string> deleted;
+        CopyStream::Batch copies;
+    };
+
+    // One [dst] path of a cycle: its newest snapshot, the staging directory and
+    // the writer thread which waits for the copies of its batches in order
+    struct Destination
+    {
+        explicit Destination(const std::string& dst):
+        dst(dst),
+        batches(batchesInFlight)
+        {
+        }
+
+        std::string dst;
+        std::string previousName;
+        std::unique_ptr<ScanIndex> previous;
+        bool hasPrevious = false;
+        std::unique_ptr<ScanIndex::Cursor> cursor;
+
+        std::unique_ptr<Staging> staging;
+        std::unique_ptr<CopyStream> copies;
+        std::ofstream manifest;
+        std::ofstream deletedList;
+        std::unique_ptr<ScanIndex::Writer> index;
+
+        // The batch being decided on and the ones waiting for the writer
+        std::unique_ptr<SnapshotBatch> batch = std::make_unique<SnapshotBatch>();
+        BoundedQueue<std::unique_ptr<SnapshotBatch>> batches;
+        std::thread writer;
+        std::exception_ptr error;
+        // False once the writer failed, the destination gets no more entries then
+        bool open = true;
+
+        size_t changed = 0;
+        size_t written = 0;
+        size_t deleted = 0;
+        std::vector<std::string> failed;
+    };
+
+    // Visits the union of the source tree and the previous manifests in path
+    // order, a merge join of the sorted streams. `visit` gets the entry of the
+    // source and one of every manifest, nullptr on each side which lacks the
+    // path, and returns false to stop. A manifest without a cursor lacks all.
+    void mergeJoin(EntryStream& current, const std::vector<ScanIndex::Cursor*>& previous,
+        const std::function<bool(Entry*, const std::vector<Entry*>&)>& visit)
+    {
+        std::vector<Entry> olds(previous.size());
+        std::vector<char> more(previous.size());
+        for (size_t i = 0; i < previous.size(); ++i)
+        {
+            more[i] = previous[i] != nullptr && previous[i]->next(olds[i]);
+        }
+        std::vector<Entry*> matched(previous.size());
+        while (true)
+        {
+            Entry* entry = current.peek();
+            const std::string* path = entry != nullptr ? &entry->path : nullptr;
+            for (size_t i = 0; i < previous.size(); ++i)
+            {
+                if (more[i] && (path == nullptr || olds[i].path < *path))
+                {
+                    path = &olds[i].path;
+                }
+            }
+            if (path == nullptr)
+            {
+                return;
+            }
+            for (size_t i = 0; i < previous.size(); ++i)
+            {
+                matched[i] = more[i] && olds[i].path == *path ? &olds[i] : nullptr;
+            }
+            if (entry != nullptr && entry->path != *path)
+            {
+                entry = nullptr;
+            }
+            bool proceed = visit(entry, matched);
+            if (entry != nullptr)
+            {
+                current.take();
+            }
+            for (size_t i = 0; i < previous.size(); ++i)
+            {
+                if (matched[i] != nullptr)
+                {
+                    more[i] = previous[i]->next(olds[i]);
+                }
+            }
+            if (!proceed)
+            {
+                return;
+            }
+        }
+    }
+
+    // Which of the manifests differ from the source tree. The walk stops when
+    // all of them do, so only a tree unchanged for one of them is walked to its end.
+    std::vector<char> changedSince(ChangeTracker& tracker, const std::vector<ScanIndex::Cursor*>& previous)
+    {
+        EntryStream current([&tracker](const EntryStream::Emit& emit) { tracker.scan(emit); });
+        std::vector<char> changed(previous.size(), 0);
+        size_t count = 0;
+        mergeJoin(current, previous, [&changed, &count](Entry* entry, const std::vector<Entry*>& olds)
+        {
+            for (size_t i = 0; i < olds.size(); ++i)
+            {
+                bool differs = entry == nullptr || olds[i] == nullptr ? entry != olds[i] : isChanged(*entry, *olds[i]);
+                if (differs && !changed[i])
+                {
+                    changed[i] = 1;
+                    ++count;
+                }
+            }
+            return count < changed.size();
+        });
+        return changed;
+    }
+
+    // Every path in the subtree of `directory` sorts before its name followed by '0'
+    bool pastSubtree(const std::string& path, const std::string& directory)
+    {
+        return path.compare(directory + '0') >= 0;
+    }
+
+    // The writer thread of a destination: waits for the copies of every batch
+    // in order and writes what they left to the manifest, the index and .deleted
+    void writeBatches(Destination& destination, bool full)
+    {
+        const std::filesystem::path& outputPath = destination.staging->path();
+        // Directories are created with the default mode, a full snapshot keeps the
+        // one of the source. It is set once the whole subtree is copied.
+        std::vector<Entry> directories;
+        std::unique_ptr<SnapshotBatch> batch;
+        try
+        {
+            while (destination.batches.pop(batch))
+            {
+                destination.copies->wait(batch->copies);
+                const CopyStream::Batch& copied = batch->copies;
+                for (size_t i = 0; i < copied.jobs.size(); ++i)
+                {
+                    Entry& entry = batch->entries[batch->jobEntries[i]];
+                    if (copied.failed[i])
+                    {
+                        // Forget the entry, so the next cycle treats it as new and retries
+                        destination.failed.push_back(entry.path);
+                        entry.path.clear();
+                    }
+                    else if (batch->jobChanged[i] && !copied.checksums.empty())
+                    {
+                        // Its data was hashed while it was copied
+                        entry.checksum = copied.checksums[i];
+                    }
+                }
+                for (const Entry& entry : batch->entries)
+                {
+                    if (full)
+                    {
+                        while (!directories.empty() && !entry.path.empty()
+                            && pastSubtree(entry.path, directories.back().path))
+                        {
+                            chmod((outputPath / directories.back().path).c_str(), directories.back().mode & 07777);
+                            directories.pop_back();
+                        }
+                        if (S_ISDIR(entry.mode) && !entry.path.empty())
+                        {
+                            directories.push_back(entry);
+                        }
+                    }
+                    else if (!entry.path.empty())
+                    {
+                        destination.manifest << formatEntry(entry);
+                        destination.index->add(entry);
+                    }
+                    destination.written += entry.path.empty() ? 0 : 1;
+                }
+                for (const std::string& path : batch->deleted)
+                {
+                    destination.deletedList << escapePath(path) << '\n';
+                    std::error_code ignored;
+                    std::filesystem::remove(signaturePath(destination.dst, path), ignored);
+                }
+                destination.deleted += batch->deleted.size();
+            }
+            for (; !directories.empty(); directories.pop_back())
+            {
+                chmod((outputPath / directories.back().path).c_str(), directories.back().mode & 07777);
+            }
+        }
+        catch (...)
+        {
+            // No more batches are queued, the copies of the queued ones still have to finish
+            destination.error = std::current_exception();
+            destination.batches.close();
+            while (destination.batches.pop(batch))
+            {
+                destination.copies->wait(batch->copies);
+            }
+        }
+    }
+
+    // Incremental, hardlink and full snapshots into every destination.
+    // Incremental and hardlink ones are built from the difference between the
+    // source tree and the manifest of the newest snapshot. The walk, the
+    // comparison, the copies and the writing of the new manifests run as a
+    // pipeline with bounded queues in between, so the memory does not grow
+    // with the tree. The source is walked once for all destinations and a file
+    // copied into several of them is read once, see FanOut.
+    void snapshotBackup(ChangeTracker& tracker, CopyEngine& engine, const std::vector<std::string>& dsts,
+        const std::string& dateTime, const std::string& mode, CycleMetrics& metrics)
+    {
+        const std::string& src = tracker.source();
+        bool full = mode == "full";
+        bool linkUnchanged = mode == "hardlink";
+        EntryStream::Produce scan = [&tracker](const EntryStream::Emit& emit) { tracker.scan(emit); };
+        // Taken before the walk like the metadata of the entries, see Staging::commit()
+        Entry root = statRoot(src);
+
+        std::vector<std::unique_ptr<Destination>> destinations;
+        {
+            PhaseTimer timer(metrics, Phase::Scan);
+            std::vector<Destination*> probed;
+            std::vector<ScanIndex::Cursor*> cursors;
+            for (const std::string& dst : dsts)
+            {
+                // The newest manifest describes the whole tree, older ones are not needed. It is
+                // read through the index of dst, the manifest is parsed only if the index is
+                // missing or was not written for the newest snapshot, e.g. by an older version
+                auto destination = std::make_unique<Destination>(dst);
+                const std::string& previousName = destination->previousName = full ? std::string() : latestSnapshot(dst);
+                std::filesystem::path indexPath = std::filesystem::path(dst) / indexName;
+                std::filesystem::path manifestPath = std::filesystem::path(dst) / previousName / manifestName;
+                destination->previous = std::make_unique<ScanIndex>(indexPath);
+                if (!previousName.empty() && destination->previous->snapshot() != previousName
+                    && std::filesystem::exists(manifestPath))
+                {
+                    ScanIndex::write(indexPath, readManifest(manifestPath), previousName);
+                    destination->previous = std::make_unique<ScanIndex>(indexPath);
+                }
+                destination->hasPrevious = !previousName.empty() && destination->previous->snapshot() == previousName;
+                destination->cursor = std::make_unique<ScanIndex::Cursor>(*destination->previous);
+                if (destination->hasPrevious)
+                {
+                    probed.push_back(destination.get());
+                    cursors.push_back(destination->cursor.get());
+                }
+                destinations.push_back(std::move(destination));
+            }
+
+            // Compare metadata only, the data is read just for new or changed files
+            std::vector<char> changed = cursors.empty() ? std::vector<char>() : changedSince(tracker, cursors);
+            for (size_t i = 0; i < probed.size(); ++i)
+            {
+                probed[i]->cursor = std::make_unique<ScanIndex::Cursor>(*probed[i]->previous);
+                if (!changed[i])
+                {
+                    syslog(LOG_INFO, "No changes in %s since %s", src.c_str(),
+                        (std::filesystem::path(probed[i]->dst) / probed[i]->previousName).c_str());
+                    probed[i]->open = false;
+                }
+            }
+            destinations.erase(std::remove_if(destinations.begin(), destinations.end(),
+                [](const std::unique_ptr<Destination>& destination) { return !destination->open; }), destinations.end());
+        }
+        if (destinations.empty())
+        {
+            return;
+        }
+
+        std::vector<ScanIndex::Cursor*> cursors;
+        for (const auto& destination : destinations)
+        {
+            // The snapshot appears under its name only when it is complete
+            destination->staging = std::make_unique<Staging>(destination->dst, mode, destination->previousName);
+            destination->staging->prune(scan);
+            std::filesystem::path outputPath = destination->staging->path();
+            if (!full)
+            {
+                destination->manifest.open(outputPath / manifestName);
+                destination->deletedList.open(outputPath / deletedName);
+                destination->index = std::make_unique<ScanIndex::Writer>(std::filesystem::path(destination->dst) / indexName);
+            }
+            destination->copies = std::make_unique<CopyStream>(engine, nullptr, &destination->staging->journal());
+            cursors.push_back(destination->hasPrevious ? destination->cursor.get() : nullptr);
+        }
+
+        PhaseTimer timer(metrics, Phase::Copy);
+        // Destroyed first, its writers still call back into the streams
+        std::unique_ptr<FanOut> fanOut;
+        if (destinations.size() > 1)
+        {
+            fanOut = std::make_unique<FanOut>(destinations.size(), &engine.throttle());
+        }
+        for (const auto& destination : destinations)
+        {
+            destination->writer = std::thread(writeBatches, std::ref(*destination), full);
+        }
+
+        // The batches of all destinations are submitted together, so a file
+        // which several of them copy is read once
+        auto submit = [&destinations, &fanOut]
+        {
+            if (fanOut)
+            {
+                std::vector<CopyStream*> streams;
+                std::vector<CopyStream::Batch*> batches;
+                for (const auto& destination : destinations)
+                {
+                    streams.push_back(destination->copies.get());
+                    batches.push_back(&destination->batch->copies);
+                }
+                CopyStream::submit(*fanOut, streams, batches);
+            }
+            else
+            {
+                destinations.front()->copies->submit(destinations.front()->batch->copies);
+            }
+            bool open = false;
+            for (const auto& destination : destinations)
+            {
+                if (destination->open && !destination->batches.push(destination->batch))
+                {
+                    destination->copies->wait(destination->batch->copies);
+                    destination->open = false;
+                }
+                destination->batch = std::make_unique<SnapshotBatch>();
+                open = open || destination->open;
+            }
+            return open;
+        };
+
+        // What one destination needs of one entry of the source, true if it changed there
+        auto decide = [&src, &dateTime, full, linkUnchanged](Destination& destination, Entry entry, const Entry* old)
+        {
+            SnapshotBatch& batch = *destination.batch;
+            const std::string& dst = destination.dst;
+            std::filesystem::path from = std::filesystem::path(src) / entry.path;
+            std::filesystem::path to = destination.staging->path() / entry.path;
+            if (old != nullptr && !isChanged(entry, *old))
+            {
+                entry.origin = old->origin;
+                entry.checksum = old->checksum;
+                if (linkUnchanged)
+                {
+                    // Directories, symlinks and files which can not be linked are copied. A
+                    // hardlink snapshot is complete, so it becomes the origin of every entry.
+                    batch.copies.jobs.push_back({entry, from, to, std::filesystem::path(dst) / entry.origin / entry.path, {}, {}});
+                    batch.jobEntries.push_back(batch.entries.size());
+                    batch.jobChanged.push_back(0);
+                    entry.origin = dateTime;
+                }
+                batch.entries.push_back(std::move(entry));
+                return false;
+            }
+            // Previous copy of a changed file which was a regular file before, if any
+            ++destination.changed;
+            bool wasFile = !full && old != nullptr && S_ISREG(old->mode) && S_ISREG(entry.mode);
+            std::filesystem::path base = wasFile ? std::filesystem::path(dst) / old->origin / entry.path
+                : std::filesystem::path();
+            entry.origin = dateTime;
+            batch.copies.jobs.push_back({entry, from, to, {}, base,
+                wasFile ? signaturePath(dst, entry.path) : std::filesystem::path()});
+            batch.jobEntries.push_back(batch.entries.size());
+            batch.jobChanged.push_back(1);
+            batch.entries.push_back(std::move(entry));
+            return true;
+        };
+
+        size_t scanned = 0;
+        // Entries which changed in at least one destination, the others were skipped
+        size_t changed = 0;
+        auto stop = [&destinations]
+        {
+            for (const auto& destination : destinations)
+            {
+                destination->copies->wait(destination->batch->copies);
+                destination->batches.close();
+            }
+            for (const auto& destination : destinations)
+            {
+                destination->writer.join();
+            }
+        };
+        try
+        {
+            EntryStream current(scan);
+            bool proceed = true;
+            mergeJoin(current, cursors, [&](Entry* entry, const std::vector<Entry*>& olds)
+            {
+                scanned += entry != nullptr ? 1 : 0;
+                bool changedAnywhere = false;
+                size_t size = 0;
+                for (size_t i = 0; i < destinations.size(); ++i)
+                {
+                    Destination& destination = *destinations[i];
+                    if (!destination.open)
+                    {
+                        continue;
+                    }
+                    if (entry != nullptr)
+                    {
+                        changedAnywhere = decide(destination, *entry, olds[i]) || changedAnywhere;
+                    }
+                    else if (olds[i] != nullptr)
+                    {
+                        destination.batch->deleted.push_back(olds[i]->path);
+                    }
+                    size = std::max(size, destination.batch->entries.size() + destination.batch->deleted.size());
+                }
+                changed += changedAnywhere ? 1 : 0;
+                proceed = size < batchEntries || submit();
+                return proceed;
+            });
+            bool pending = false;
+            for (const auto& destination : destinations)
+            {
+                pending = pending || !destination->batch->entries.empty() || !destination->batch->deleted.empty();
+            }
+            if (proceed && pending)
+            {
+                submit();
+            }
+        }
+        catch (...)
+        {
+            stop();
+            throw;
+        }
+        stop();
+        timer.stop();
+
+        // Every destination is finished on its own, one which failed does not keep the others from their snapshot
+        std::exception_ptr firstError;
+        for (const auto& destination : destinations)
+        {
+            const std::string& dst = destination->dst;
+            std::filesystem::path snapshotPath = std::filesystem::path(dst) / dateTime;
+            try
+            {
+                if (destination->error)
+                {
+                    std::rethrow_exception(destination->error);
+                }
+                for (const std::string& path : destination->failed)
+                {
+                    tracker.markDirty(path);
+                }
+                size_t failed = destination->failed.size();
+                size_t copiedCount = destination->changed - std::min(destination->changed, failed);
+                CopyResult copied = destination->copies->result();
+                metrics.copied += copiedCount;
+                metrics.failed += failed;
+                metrics.bytes += copied.stats.bytes;
+                metrics.latency.add(copied.stats.latency);
+                if (!full)
+                {
+                    destination->manifest.close();
+                    destination->deletedList.close();
+                    if (!destination->manifest || !destination->deletedList)
+                    {
+                        throw std::runtime_error("Failed to write manifest "
+                            + (destination->staging->path() / manifestName).string());
+                    }
+                }
+                {
+                    PhaseTimer timer(metrics, Phase::Fsync);
+                    destination->staging->commit(dateTime, root);
+                }
+
+                if (full)
+                {
+                    syslog(LOG_INFO, "Copied %s to %s, %zu failed: %s", src.c_str(), snapshotPath.c_str(),
+                        failed, copied.stats.summary().c_str());
+                    continue;
+                }
+                // The snapshot is complete, the next cycle compares against it
+                destination->index->finish(dateTime);
+
+                syslog(LOG_INFO, "Copied %zu changed of %zu entries, %zu deleted, %zu failed from %s to %s: %s",
+                    copiedCount, destination->written, destination->deleted, failed,
+                    src.c_str(), snapshotPath.c_str(), copied.stats.summary().c_str());
+            }
+            catch (const std::exception& error)
+            {
+                if (firstError)
+                {
+                    syslog(LOG_ERR, "Failed to back up %s to %s: %s", src.c_str(), dst.c_str(), error.what());
+                    continue;
+                }
+                firstError = std::current_exception();
+            }
+        }
+        metrics.scanned = scanned;
+        metrics.skipped += scanned - changed;
+        if (firstError)
+        {
+            std::rethrow_exception(firstError);
+        }
+    }
+
+    // One cycle of [mode] type
+    void takeSnapshot(const mINI::INIStructure& ini, ChangeTracker& tracker, CopyEngine& engine, CycleMetrics& metrics)
+    {
+        const std::vector<std::string> dsts = destinations(ini);
+        const std::string& mode = ini.get("mode").get("type");
+        if (dsts.empty())
+        {
+            throw std::runtime_error("No backup destination in [dst]");
+        }
+
+        // Create backup directories
+        for (const std::string& dst : dsts)
+        {
+            if (!std::filesystem::exists(dst))
+            {
+                std::filesystem::create_directory(dst);
+            }
+        }
+
+        // Copy files
+        std::string dateTime = currentDatetime();
+        if (mode == "incremental" || mode == "hardlink")
+        {
+            snapshotBackup(tracker, engine, dsts, dateTime, mode, metrics);
+            return;
+        }
+        if (mode == "archive" || mode == "dedup")
+        {
+            // A store of its own in every destination, they are written one after the other
+            for (const std::string& dst : dsts)
+            {
+                CycleMetrics part;
+                if (mode == "archive")
+                {
+                    archiveBackup(tracker, engine, dst, dateTime, part);
+                }
+                else
+                {
+                    dedupBackup(tracker, dst, dateTime, ini, engine, part);
+                }
+                // The source is the same for all of them
+                uint64_t scanned = std::max(metrics.scanned, part.scanned);
+                metrics.add(part);
+                metrics.scanned = scanned;
+            }
+            return;
+        }
+        if (!mode.empty() && mode != "full")
+        {
+            throw std::runtime_error("Unknown backup mode " + mode);
+        }
+        snapshotBackup(tracker, engine, dsts, dateTime, "full", metrics);
+    }
+}
+
+void backup(const mINI::INIStructure& ini, ChangeTracker& tracker, CopyEngine& engine, CycleMetrics& metrics)
+{
+    Throttle& throttle = engine.throttle();
+    Throttle::Usage before = throttle.usage();
+    auto start = std::chrono::steady_clock::now();
+
+    takeSnapshot(ini, tracker, engine, metrics);
+    metrics.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // What the limits left of the cycle, the time includes the scan
+    if (throttle.enabled())
+    {
+        Throttle::Usage after = throttle.usage();
+        double seconds = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-6);
+        syslog(LOG_INFO, "Throttled to %s: %.1f MiB/s, %.0f IOPS effective, waited %.2f s",
+            throttle.limits().c_str(), (after.bytes - before.bytes) / 1048576.0 / seconds,
+            (after.operations - before.operations) / seconds, after.waited - before.waited);
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef BACKUP_BACKUP_H
+#define BACKUP_BACKUP_H
+
+#include "copier.h"
+#include "metrics.h"
+#include "tracker.h"
+
+#include <mini/ini.h>
+
+// Takes one snapshot of [src] path into [dst] path using [mode] type. The
+// counters and phase times of the cycle are added to `metrics`.
+void backup(const mINI::INIStructure& ini, ChangeTracker& tracker, CopyEngine& engine, CycleMetrics& metrics);
+
+#endif
@@ -0,0 +1,509 @@
+#include "backup.h"
+#include "walker.h"
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <sys/utsname.h>
+#include <thread>
+#include <unistd.h>
+
+namespace
+{
+    const size_t filesPerDirectory = 1000;
+    const uint64_t KiB = 1024;
+    const uint64_t MiB = 1024 * KiB;
+    const uint64_t GiB = 1024 * MiB;
+
+    // Writes files with different content, so the copies can not be shared
+    class TreeWriter
+    {
+    public:
+        explicit TreeWriter(const std::filesystem::path& root): root(root), data(MiB, 'x') {}
+
+        // `size` bytes, or only the 1 MiB pieces at `extents` of a sparse file
+        void file(const std::filesystem::path& path, uint64_t size, const std::vector<uint64_t>& extents = {})
+        {
+            std::filesystem::path full = root / path;
+            if (path.has_parent_path() && directories.insert(path.parent_path().string()).second)
+            {
+                std::filesystem::create_directories(full.parent_path());
+            }
+            int fd = open(full.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd == -1)
+            {
+                fail(full);
+            }
+            std::string name = std::to_string(count++);
+            data.replace(0, name.size(), name);
+            if (extents.empty())
+            {
+                for (uint64_t offset = 0; offset < size; offset += data.size())
+                {
+                    size_t length = std::min<uint64_t>(data.size(), size - offset);
+                    if (write(fd, data.data(), length) != static_cast<ssize_t>(length))
+                    {
+                        fail(full);
+                    }
+                }
+            }
+            else
+            {
+                for (uint64_t offset : extents)
+                {
+                    if (pwrite(fd, data.data(), data.size(), offset) != static_cast<ssize_t>(data.size()))
+                    {
+                        fail(full);
+                    }
+                }
+                if (ftruncate(fd, size) != 0)
+                {
+                    fail(full);
+                }
+            }
+            close(fd);
+        }
+
+    private:
+        [[noreturn]] static void fail(const std::filesystem::path& path)
+        {
+            throw std::filesystem::filesystem_error("Failed to create", path, std::error_code(errno, std::generic_category()));
+        }
+
+        std::filesystem::path root;
+        std::string data;
+        std::set<std::string> directories;
+        size_t count = 0;
+    };
+
+    std::filesystem::path flatPath(size_t i)
+    {
+        return std::filesystem::path(std::to_string(i / filesPerDirectory)) / std::to_string(i);
+    }
+
+    // The trees of the request: the counts are multiplied by the scale
+    struct Profile
+    {
+        const char* name;
+        const char* description;
+        std::function<void(TreeWriter&, double)> generate;
+    };
+
+    const Profile profiles[] = {
+        {"small", "1M files of 4 KiB", [](TreeWriter& writer, double scale)
+        {
+            size_t files = std::max<size_t>(1, 1000000 * scale);
+            for (size_t i = 0; i < files; ++i)
+            {
+                writer.file(flatPath(i), 4 * KiB);
+            }
+        }},
+        {"large", "1000 files of 1 GiB", [](TreeWriter& writer, double scale)
+        {
+            size_t files = std::max<size_t>(1, 1000 * scale);
+            for (size_t i = 0; i < files; ++i)
+            {
+                writer.file(flatPath(i), GiB);
+            }
+        }},
+        {"mixed", "100k files, 80% up to 16 KiB, 18% up to 1 MiB, 2% up to 64 MiB", [](TreeWriter& writer, double scale)
+        {
+            // A fixed seed, every run gets the same tree
+            std::mt19937_64 random(42);
+            size_t files = std::max<size_t>(1, 100000 * scale);
+            for (size_t i = 0; i < files; ++i)
+            {
+                unsigned percentile = random() % 100;
+                uint64_t limit = percentile < 80 ? 16 * KiB : percentile < 98 ? MiB : 64 * MiB;
+                writer.file(flatPath(i), random() % limit + 1);
+            }
+        }},
+        {"sparse", "1000 files of 1 GiB with 4 MiB of data", [](TreeWriter& writer, double scale)
+        {
+            size_t files = std::max<size_t>(1, 1000 * scale);
+            for (size_t i = 0; i < files; ++i)
+            {
+                writer.file(flatPath(i), GiB, {0, 256 * MiB, 512 * MiB, GiB - MiB});
+            }
+        }},
+        {"deep", "100k files of 1 KiB in directories nested 100 levels deep", [](TreeWriter& writer, double scale)
+        {
+            // Chains of 100 directories with 10 files on every level
+            const size_t depth = 100;
+            const size_t filesPerLevel = 10;
+            size_t files = std::max<size_t>(1, 100000 * scale);
+            for (size_t i = 0; i < files; ++i)
+            {
+                size_t chain = i / (depth * filesPerLevel);
+                size_t level = i / filesPerLevel % depth;
+                std::filesystem::path path = "chain" + std::to_string(chain);
+                for (size_t j = 0; j < level; ++j)
+                {
+                    path /= "d";
+                }
+                writer.file(path / std::to_string(i), KiB);
+            }
+        }},
+    };
+
+    // The tree is reused by the next runs with the same scale
+    std::filesystem::path generateTree(const std::filesystem::path& root, const Profile& profile, double scale)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "%s-%g", profile.name, scale);
+        std::filesystem::path tree = root / name;
+        std::filesystem::path done = tree.string() + ".done";
+        if (!std::filesystem::exists(done))
+        {
+            std::cout << "Generating " << profile.name << ": " << profile.description << " x " << scale << std::endl;
+            std::filesystem::remove_all(tree);
+            TreeWriter writer(tree / "src");
+            profile.generate(writer, scale);
+            std::ofstream{done};
+        }
+        return tree;
+    }
+
+    // Cold cache for every run, silently does nothing without root
+    void dropCaches()
+    {
+        sync();
+        std::ofstream("/proc/sys/vm/drop_caches") << "3\n";
+    }
+
+    // Snapshot names have a resolution of one second
+    void waitForNextSecond()
+    {
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        std::this_thread::sleep_for(std::chrono::seconds(1) - now % std::chrono::seconds(1));
+    }
+
+    // Sum of the counters of /proc/self/io with the given keys, over all threads
+    uint64_t ioCounters(std::initializer_list<const char*> keys)
+    {
+        std::ifstream io("/proc/self/io");
+        std::string key;
+        uint64_t value = 0;
+        uint64_t total = 0;
+        while (io >> key >> value)
+        {
+            for (const char* wanted : keys)
+            {
+                total += key == wanted ? value : 0;
+            }
+        }
+        return total;
+    }
+
+    // Read and write-like syscalls of all threads (read, write, pread, sendfile,
+    // copy_file_range, ...). There is no counter of all syscalls without tracing.
+    uint64_t ioSyscalls()
+    {
+        return ioCounters({"syscr:", "syscw:"});
+    }
+
+    // Bytes the read-like syscalls returned, copy_file_range and sendfile included
+    uint64_t bytesRead()
+    {
+        return ioCounters({"rchar:"});
+    }
+
+    // Peak RSS since the last resetPeakRss() in KiB
+    uint64_t peakRss()
+    {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line))
+        {
+            if (line.compare(0, 6, "VmHWM:") == 0)
+            {
+                return std::stoull(line.substr(6));
+            }
+        }
+        return 0;
+    }
+
+    void resetPeakRss()
+    {
+        std::ofstream("/proc/self/clear_refs") << "5\n";
+    }
+
+    // Every 100th file gets one more byte, so 1% of the tree has changed
+    std::vector<std::filesystem::path> modifyTree(const std::filesystem::path& src)
+    {
+        std::vector<std::filesystem::path> files;
+        for (const auto& item : std::filesystem::recursive_directory_iterator(src))
+        {
+            if (item.is_regular_file())
+            {
+                files.push_back(item.path());
+            }
+        }
+        std::sort(files.begin(), files.end());
+        std::vector<std::filesystem::path> modified;
+        for (size_t i = 0; i < files.size(); i += 100)
+        {
+            std::ofstream(files[i], std::ios::app) << 'y';
+            modified.push_back(files[i]);
+        }
+        return modified;
+    }
+
+    struct Options
+    {
+        std::string profile = "all";
+        double scale = 1;
+        std::string results = "benchmark.jsonl";
+        size_t threads = std::thread::hardware_concurrency();
+        std::string copyMethod = "auto";
+        bool uring = false;
+        bool cacheNeutral = false;
+        bool compression = false;
+    };
+
+    class Benchmark
+    {
+    public:
+        Benchmark(const std::filesystem::path& root, const Options& options):
+        root(root),
+        options(options),
+        results(options.results, std::ios::app)
+        {
+            if (!results)
+            {
+                throw std::runtime_error("Failed to open " + options.results);
+            }
+        }
+
+        void run(const Profile& profile)
+        {
+            std::filesystem::path tree = generateTree(root, profile, options.scale);
+            std::filesystem::path src = tree / "src";
+            std::filesystem::path dst = tree / "dst";
+
+            scans(profile, src);
+            std::filesystem::remove_all(dst);
+            cycle(profile, "full", src, dst, "full");
+            std::filesystem::remove_all(dst);
+            // The source is read once however many destinations there are
+            std::filesystem::path mirror = tree / "mirror";
+            cycle(profile, "full-2-destinations", src, dst, "full", mirror);
+            std::filesystem::remove_all(dst);
+            std::filesystem::remove_all(mirror);
+            cycle(profile, "incremental-initial", src, dst, "incremental");
+            cycle(profile, "incremental-unchanged", src, dst, "incremental");
+            std::vector<std::filesystem::path> modified = modifyTree(src);
+            cycle(profile, "incremental-1%", src, dst, "incremental");
+            std::filesystem::remove_all(dst);
+            // The next run starts from the same data
+            for (const std::filesystem::path& path : modified)
+            {
+                std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+            }
+        }
+
+    private:
+        // The walk of the old scanTree() against walkTree(), alone and on the pool
+        void scans(const Profile& profile, const std::filesystem::path& src)
+        {
+            ThreadPool pool(options.threads);
+            auto iterator = [&src]
+            {
+                Manifest manifest;
+                auto iteratorOptions = std::filesystem::directory_options::skip_permission_denied;
+                for (const auto& item : std::filesystem::recursive_directory_iterator(src, iteratorOptions))
+                {
+                    Entry entry;
+                    if (statEntry(item.path(), item.path().lexically_relative(src).string(), entry))
+                    {
+                        manifest.push_back(std::move(entry));
+                    }
+                }
+                std::sort(manifest.begin(), manifest.end(), [](const Entry& a, const Entry& b)
+                {
+                    return a.path < b.path;
+                });
+                return manifest;
+            };
+            auto getdents = [&src]
+            {
+                return walkTree(src.string());
+            };
+            auto parallel = [&src, &pool]
+            {
+                return walkTree(src.string(), &pool);
+            };
+            for (bool cold : {true, false})
+            {
+                scan(profile, cold ? "scan-iterator-cold" : "scan-iterator-warm", cold, iterator);
+                scan(profile, cold ? "scan-getdents-cold" : "scan-getdents-warm", cold, getdents);
+                scan(profile, cold ? "scan-parallel-cold" : "scan-parallel-warm", cold, parallel);
+            }
+        }
+
+        void scan(const Profile& profile, const char* name, bool cold, const std::function<Manifest()>& walk)
+        {
+            if (cold)
+            {
+                dropCaches();
+            }
+            else
+            {
+                // Fills the caches
+                walk();
+            }
+            auto start = std::chrono::steady_clock::now();
+            size_t entries = walk().size();
+            double seconds = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-6);
+
+            char line[1024];
+            snprintf(line, sizeof(line), "%s %s: %zu entries, %.0f files/s\n", profile.name, name, entries,
+                entries / seconds);
+            std::cout << line << std::flush;
+            snprintf(line, sizeof(line), "{\"time\": %lld, \"kernel\": \"%s\", \"profile\": \"%s\", \"scale\": %g, "
+                "\"cycle\": \"%s\", \"threads\": %zu, \"entries\": %zu, \"seconds\": %.6f, "
+                "\"files_per_second\": %.1f}\n",
+                static_cast<long long>(std::time(nullptr)), kernel().c_str(), profile.name, options.scale, name,
+                options.threads, entries, seconds, entries / seconds);
+            results << line << std::flush;
+        }
+
+        void cycle(const Profile& profile, const char* name, const std::filesystem::path& src,
+            const std::filesystem::path& dst, const char* mode, const std::filesystem::path& mirror = {})
+        {
+            mINI::INIStructure ini;
+            ini["src"]["path"] = src.string();
+            ini["dst"]["path"] = mirror.empty() ? dst.string() : dst.string() + ", " + mirror.string();
+            ini["mode"]["type"] = mode;
+
+            // A new engine every cycle, so the probed copy methods are not reused
+            CopyEngine engine(options.threads, parseMethod(options.copyMethod), options.uring);
+            if (options.cacheNeutral)
+            {
+                engine.enableCacheNeutral();
+            }
+            if (options.compression)
+            {
+                engine.enableCompression(6, MiB);
+            }
+            ChangeTracker tracker(src.string(), "", &engine.pool());
+            CycleMetrics metrics;
+
+            waitForNextSecond();
+            dropCaches();
+            resetPeakRss();
+            uint64_t syscalls = ioSyscalls();
+            uint64_t read = bytesRead();
+            auto start = std::chrono::steady_clock::now();
+            backup(ini, tracker, engine, metrics);
+            double seconds = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-6);
+            syscalls = ioSyscalls() - syscalls;
+            read = bytesRead() - read;
+            uint64_t rss = peakRss();
+
+            double files = std::max<uint64_t>(metrics.scanned, 1);
+            char line[1024];
+            snprintf(line, sizeof(line), "%s %s: %llu entries, %llu copied, %.0f files/s, %.1f MiB/s, "
+                "%.2f I/O syscalls per file, %.1f MiB read, %llu KiB peak RSS\n", profile.name, name,
+                static_cast<unsigned long long>(metrics.scanned), static_cast<unsigned long long>(metrics.copied),
+                metrics.scanned / seconds, metrics.bytes / double(MiB) / seconds, syscalls / files,
+                read / double(MiB), static_cast<unsigned long long>(rss));
+            std::cout << line << std::flush;
+
+            // One JSON object per line, runs of several builds and options can be concatenated
+            snprintf(line, sizeof(line), "{\"time\": %lld, \"kernel\": \"%s\", \"profile\": \"%s\", \"scale\": %g, "
+                "\"cycle\": \"%s\", \"threads\": %zu, \"copy_method\": \"%s\", \"io_uring\": %s, "
+                "\"cache_neutral\": %s, \"compression\": %s, \"entries\": %llu, \"copied\": %llu, "
+                "\"bytes\": %llu, \"seconds\": %.6f, \"files_per_second\": %.1f, \"mib_per_second\": %.3f, "
+                "\"io_syscalls_per_file\": %.3f, \"read_bytes\": %llu, \"peak_rss_kib\": %llu, \"scan_seconds\": %.6f, "
+                "\"copy_seconds\": %.6f}\n",
+                static_cast<long long>(std::time(nullptr)), kernel().c_str(), profile.name, options.scale, name,
+                options.threads, options.copyMethod.c_str(), options.uring ? "true" : "false",
+                options.cacheNeutral ? "true" : "false", options.compression ? "true" : "false",
+                static_cast<unsigned long long>(metrics.scanned), static_cast<unsigned long long>(metrics.copied),
+                static_cast<unsigned long long>(metrics.bytes), seconds, metrics.scanned / seconds,
+                metrics.bytes / double(MiB) / seconds, syscalls / files, static_cast<unsigned long long>(read),
+                static_cast<unsigned long long>(rss),
+                metrics.phases[static_cast<size_t>(Phase::Scan)], metrics.phases[static_cast<size_t>(Phase::Copy)]);
+            results << line << std::flush;
+        }
+
+        static std::string kernel()
+        {
+            utsname name;
+            uname(&name);
+            return name.release;
+        }
+
+        std::filesystem::path root;
+        Options options;
+        std::ofstream results;
+    };
+
+    bool parseBool(const std::string& value)
+    {
+        return value == "yes" || value == "true" || value == "1";
+    }
+}
+
+// Usage: BackupBenchmark <directory> [profile=all] [scale=1] [results=benchmark.jsonl] [threads=N]
+//     [copy_method=auto] [io_uring=no] [cache_neutral=no] [compression=no]
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <directory> [profile=small|large|mixed|sparse|deep|all] [scale=1]"
+            " [results=benchmark.jsonl] [threads=N] [copy_method=auto] [io_uring=no] [cache_neutral=no] [compression=no]\n";
+        return EXIT_FAILURE;
+    }
+
+    Options options;
+    std::map<std::string, std::function<void(const std::string&)>> setters = {
+        {"profile", [&](const std::string& value) { options.profile = value; }},
+        {"scale", [&](const std::string& value) { options.scale = std::stod(value); }},
+        {"results", [&](const std::string& value) { options.results = value; }},
+        {"threads", [&](const std::string& value) { options.threads = std::stoul(value); }},
+        {"copy_method", [&](const std::string& value) { options.copyMethod = value; }},
+        {"io_uring", [&](const std::string& value) { options.uring = parseBool(value); }},
+        {"cache_neutral", [&](const std::string& value) { options.cacheNeutral = parseBool(value); }},
+        {"compression", [&](const std::string& value) { options.compression = parseBool(value); }},
+    };
+    for (int i = 2; i < argc; ++i)
+    {
+        std::string argument = argv[i];
+        size_t equals = argument.find('=');
+        auto setter = equals == std::string::npos ? setters.end() : setters.find(argument.substr(0, equals));
+        if (setter == setters.end())
+        {
+            std::cerr << "Unknown option " << argument << "\n";
+            return EXIT_FAILURE;
+        }
+        setter->second(argument.substr(equals + 1));
+    }
+
+    Benchmark benchmark(argv[1], options);
+    bool found = false;
+    for (const Profile& profile : profiles)
+    {
+        if (options.profile == "all" || options.profile == profile.name)
+        {
+            benchmark.run(profile);
+            found = true;
+        }
+    }
+    if (!found)
+    {
+        std::cerr << "Unknown profile " << options.profile << "\n";
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
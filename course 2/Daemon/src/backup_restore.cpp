@@ -0,0 +1,139 @@
+#include "restore.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <getopt.h>
+#include <iostream>
+#include <mutex>
+#include <syslog.h>
+#include <thread>
+#include <unistd.h>
+
+namespace
+{
+    const char* usage = "Usage: backup-restore [--snapshot NAME] [--path PATH]... [--verify] [--threads N]\n"
+        "    [--copy-method reflink|copy_file_range|sendfile|readwrite] [--io-uring] <dst> <target>\n";
+
+    // Prints the restored files and bytes once a second until it is stopped
+    class ProgressReport
+    {
+    public:
+        explicit ProgressReport(const CopyProgress& progress):
+        progress(progress),
+        terminal(isatty(STDERR_FILENO)),
+        thread([this] { run(); })
+        {
+        }
+
+        ~ProgressReport()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopped = true;
+            }
+            condition.notify_one();
+            thread.join();
+        }
+
+    private:
+        void run()
+        {
+            auto start = std::chrono::steady_clock::now();
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!condition.wait_for(lock, std::chrono::seconds(1), [this] { return stopped; }))
+            {
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                double megabytes = progress.bytes / 1048576.0;
+                fprintf(stderr, "%zu/%zu files, %.1f/%.1f MiB, %.1f MiB/s%s", progress.files.load(),
+                    progress.totalFiles.load(), megabytes, progress.totalBytes / 1048576.0, megabytes / seconds,
+                    terminal ? "\r" : "\n");
+            }
+            if (terminal)
+            {
+                fprintf(stderr, "\n");
+            }
+        }
+
+        const CopyProgress& progress;
+        bool terminal;
+        std::mutex mutex;
+        std::condition_variable condition;
+        bool stopped = false;
+        std::thread thread;
+    };
+}
+
+// Usage: backup-restore [--snapshot NAME] [--path PATH]... [--verify] <dst> <target>
+int main(int argc, char* argv[])
+{
+    RestoreOptions options;
+    size_t threads = std::thread::hardware_concurrency();
+    std::string copyMethod;
+    bool uring = false;
+    const option longOptions[] = {
+        {"snapshot", required_argument, nullptr, 's'},
+        {"path", required_argument, nullptr, 'p'},
+        {"verify", no_argument, nullptr, 'v'},
+        {"threads", required_argument, nullptr, 't'},
+        {"copy-method", required_argument, nullptr, 'm'},
+        {"io-uring", no_argument, nullptr, 'u'},
+        {nullptr, 0, nullptr, 0}
+    };
+    int code;
+    while ((code = getopt_long(argc, argv, "s:p:vt:m:u", longOptions, nullptr)) != -1)
+    {
+        switch (code)
+        {
+            case 's': options.snapshot = optarg; break;
+            case 'p': options.paths.push_back(optarg); break;
+            case 'v': options.verify = true; break;
+            case 't': threads = std::stoul(optarg); break;
+            case 'm': copyMethod = optarg; break;
+            case 'u': uring = true; break;
+            default: std::cerr << usage; return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 2)
+    {
+        std::cerr << usage;
+        return EXIT_FAILURE;
+    }
+    std::string dst = argv[optind];
+    std::string target = argv[optind + 1];
+
+    // Warnings of the copy engine go to the terminal as well
+    openlog("backup-restore", LOG_PID | LOG_PERROR, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_WARNING));
+
+    RestoreResult result;
+    try
+    {
+        CopyEngine engine(threads, parseMethod(copyMethod), uring);
+        CopyProgress progress;
+        ProgressReport report(progress);
+        result = restoreSnapshot(dst, target, options, engine, &progress);
+    }
+    catch (const std::exception& error)
+    {
+        std::cerr << error.what() << "\n";
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "Restored " << result.entries - result.failed.size() << " of " << result.entries << " entries of "
+        << result.snapshot << " into " << target << ": " << result.stats.summary() << "\n";
+    for (const std::string& path : result.failed)
+    {
+        std::cout << "Failed: " << path << "\n";
+    }
+    if (options.verify)
+    {
+        std::cout << "Verified " << result.entries - result.failed.size() << " entries, "
+            << result.mismatched.size() << " differ from the snapshot\n";
+        for (const std::string& path : result.mismatched)
+        {
+            std::cout << "Differs: " << path << "\n";
+        }
+    }
+    return result.failed.empty() && result.mismatched.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
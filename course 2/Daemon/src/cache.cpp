@@ -0,0 +1,105 @@
+#include "cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+    // From linux/mman.h of 6.5, older headers do not have them
+    const long cachestatNumber = 451;
+
+    struct CachestatRange
+    {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    struct Cachestat
+    {
+        uint64_t cached;
+        uint64_t dirty;
+        uint64_t writeback;
+        uint64_t evicted;
+        uint64_t recentlyEvicted;
+    };
+
+    // Bytes mapped at once, a byte per page of it for mincore()
+    const off_t probeWindow = off_t(1) << 30;
+
+    bool isMapped(int fd)
+    {
+        struct stat status;
+        if (fstat(fd, &status) != 0)
+        {
+            return false;
+        }
+        size_t page = sysconf(_SC_PAGESIZE);
+        thread_local std::vector<unsigned char> pages;
+        pages.resize(probeWindow / page);
+        // Stops at the first resident page, a large file is mapped a window at a time
+        for (off_t offset = 0; offset < status.st_size; offset += probeWindow)
+        {
+            size_t length = std::min(probeWindow, status.st_size - offset);
+            void* address = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, offset);
+            if (address == MAP_FAILED)
+            {
+                return false;
+            }
+            bool cached = false;
+            if (mincore(address, length, pages.data()) == 0)
+            {
+                size_t count = (length + page - 1) / page;
+                cached = std::any_of(pages.begin(), pages.begin() + count,
+                    [](unsigned char resident) { return (resident & 1) != 0; });
+            }
+            munmap(address, length);
+            if (cached)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+}
+
+bool isCached(int fd)
+{
+    // The whole file
+    CachestatRange range = {0, 0};
+    Cachestat stat;
+    if (syscall(cachestatNumber, fd, &range, &stat, 0) == 0)
+    {
+        return stat.cached != 0;
+    }
+    return errno == ENOSYS && isMapped(fd);
+}
+
+void dropCache(int fd, bool written, uint64_t offset, uint64_t length)
+{
+    if (written)
+    {
+        sync_file_range(fd, offset, length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+    posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+}
+
+PageCacheGuard::PageCacheGuard(int fd, bool enabled, bool written):
+fd(fd),
+drop(enabled && fd != -1 && (written || !isCached(fd))),
+written(written)
+{
+}
+
+PageCacheGuard::~PageCacheGuard()
+{
+    if (drop)
+    {
+        dropCache(fd, written);
+    }
+}
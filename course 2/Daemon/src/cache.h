@@ -0,0 +1,32 @@
+#ifndef BACKUP_CACHE_H
+#define BACKUP_CACHE_H
+
+#include <cstdint>
+
+// True if any page of the file is in the page cache. Uses cachestat() and
+// falls back to mincore() on kernels older than 6.5.
+bool isCached(int fd);
+
+// Removes the pages of the file from the page cache. Dirty pages of
+// `written` files are written back first, otherwise they would stay.
+void dropCache(int fd, bool written, uint64_t offset = 0, uint64_t length = 0);
+
+// Cache-neutral copying: the pages a copy brought into the page cache are
+// dropped when the guard goes out of scope, unless the file was cached
+// before, i.e. somebody else uses it
+class PageCacheGuard
+{
+public:
+    PageCacheGuard(int fd, bool enabled, bool written = false);
+    ~PageCacheGuard();
+
+    PageCacheGuard(const PageCacheGuard&) = delete;
+    PageCacheGuard& operator=(const PageCacheGuard&) = delete;
+
+private:
+    int fd;
+    bool drop;
+    bool written;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#include "chunker.h"
+
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+
+namespace
+{
+    // The table is fixed forever: other values would move every chunk boundary
+    std::array<uint64_t, 256> makeGearTable()
+    {
+        std::array<uint64_t, 256> table;
+        uint64_t state = 0x9e3779b97f4a7c15ULL;
+        for (uint64_t& value : table)
+        {
+            // splitmix64
+            state += 0x9e3779b97f4a7c15ULL;
+            uint64_t z = state;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            value = z ^ (z >> 31);
+        }
+        return table;
+    }
+
+    const std::array<uint64_t, 256> gear = makeGearTable();
+
+    // The oldest bytes are shifted out of the top, so the top bits depend on the whole window
+    uint64_t topBits(int count)
+    {
+        return count <= 0 ? 0 : ~0ULL << (64 - count);
+    }
+}
+
+Chunker::Chunker(size_t averageSize)
+{
+    int bits = 0;
+    while ((size_t(1) << (bits + 1)) <= averageSize)
+    {
+        ++bits;
+    }
+    if (bits < 8 || bits > 26)
+    {
+        throw std::runtime_error("Chunk size must be between 256 bytes and 64 MiB");
+    }
+
+    average = size_t(1) << bits;
+    minimum = average / 4;
+    maximum = average * 4;
+    maskSmall = topBits(bits + 2);
+    maskLarge = topBits(bits - 2);
+}
+
+size_t Chunker::next(const unsigned char* data, size_t size) const
+{
+    if (size <= minimum)
+    {
+        return size;
+    }
+
+    size_t end = std::min(size, maximum);
+    size_t normal = std::min(end, average);
+    uint64_t hash = 0;
+    size_t i = minimum;
+    for (; i < normal; ++i)
+    {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & maskSmall) == 0)
+        {
+            return i + 1;
+        }
+    }
+    for (; i < end; ++i)
+    {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & maskLarge) == 0)
+        {
+            return i + 1;
+        }
+    }
+    return end;
+}
@@ -0,0 +1,29 @@
+#ifndef BACKUP_CHUNKER_H
+#define BACKUP_CHUNKER_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Content-defined chunking with the Gear rolling hash (FastCDC).
+// Boundaries depend only on the nearby bytes, so an insertion in the middle
+// of a file moves a few chunks instead of all the following ones.
+class Chunker
+{
+public:
+    explicit Chunker(size_t averageSize = 64 * 1024);
+
+    // Length of the chunk which starts at data, at most maximumSize()
+    size_t next(const unsigned char* data, size_t size) const;
+
+    size_t maximumSize() const { return maximum; }
+
+private:
+    size_t minimum;
+    size_t average;
+    size_t maximum;
+    // Normalized chunking: a harder mask before the average size, an easier one after it
+    uint64_t maskSmall;
+    uint64_t maskLarge;
+};
+
+#endif
@@ -0,0 +1,414 @@
+#include "compress.h"
+
+#include "cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unordered_set>
+#include <zlib.h>
+
+namespace
+{
+    const char magic[4] = {'B', 'K', 'Z', '1'};
+    const size_t headerSize = sizeof(magic) + sizeof(uint32_t) + sizeof(uint64_t);
+    const size_t indexRecordSize = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+    const size_t trailerSize = 2 * sizeof(uint64_t) + sizeof(magic);
+
+    // Entropy of the first bytes decides for files without a known extension
+    const size_t sampleSize = 64 * 1024;
+    const double entropyLimit = 7.5;
+
+    const std::unordered_set<std::string> compressedExtensions = {
+        ".7z", ".apk", ".avi", ".br", ".bz2", ".docx", ".flac", ".gif", ".gz", ".heic", ".jar",
+        ".jpeg", ".jpg", ".lz4", ".lzma", ".mkv", ".mov", ".mp3", ".mp4", ".odt", ".ogg", ".png",
+        ".pptx", ".rar", ".tgz", ".webm", ".webp", ".xlsx", ".xz", ".zip", ".zst"
+    };
+
+    [[noreturn]] void fail(const std::string& message, const std::filesystem::path& path)
+    {
+        throw std::filesystem::filesystem_error(message, path, std::error_code(errno, std::generic_category()));
+    }
+
+    // Reads until the buffer is full or the file ends
+    size_t readFull(int fd, char* data, size_t size, const std::filesystem::path& path)
+    {
+        size_t total = 0;
+        while (total < size)
+        {
+            ssize_t count = read(fd, data + total, size - total);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                fail("Failed to read", path);
+            }
+            if (count == 0)
+            {
+                break;
+            }
+            total += count;
+        }
+        return total;
+    }
+
+    void writeFull(int fd, const char* data, size_t size, const std::filesystem::path& path)
+    {
+        while (size > 0)
+        {
+            ssize_t count = write(fd, data, size);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                fail("Failed to write", path);
+            }
+            data += count;
+            size -= count;
+        }
+    }
+
+    template <class T>
+    void append(std::vector<char>& buffer, const T& value)
+    {
+        const char* bytes = reinterpret_cast<const char*>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    template <class T>
+    T extract(const char*& data)
+    {
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        data += sizeof(T);
+        return value;
+    }
+
+    // Shannon entropy in bits per byte
+    double entropy(const unsigned char* data, size_t size)
+    {
+        size_t counts[256] = {};
+        for (size_t i = 0; i < size; ++i)
+        {
+            ++counts[data[i]];
+        }
+        double bits = 0;
+        for (size_t count : counts)
+        {
+            if (count != 0)
+            {
+                double p = static_cast<double>(count) / size;
+                bits -= p * std::log2(p);
+            }
+        }
+        return bits;
+    }
+
+    struct Block
+    {
+        std::vector<char> data;
+        size_t size = 0;
+        std::vector<char> packed;
+        bool stored = false;
+    };
+}
+
+Compressor::Compressor(ThreadPool& pool, int level, size_t blockSize, Throttle* throttle):
+pool(pool),
+level(level),
+blockSize(blockSize),
+throttle(throttle),
+freeBlocks(std::max<size_t>(pool.size(), 1) * 2)
+{
+}
+
+size_t Compressor::acquireBlocks(size_t wanted)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    ptrdiff_t count = std::max<ptrdiff_t>(std::min<ptrdiff_t>(wanted, freeBlocks), 1);
+    freeBlocks -= count;
+    return count;
+}
+
+void Compressor::releaseBlocks(size_t count)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    freeBlocks += count;
+}
+
+bool Compressor::worthCompressing(const std::filesystem::path& path) const
+{
+    FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    unsigned char sample[sampleSize];
+    ssize_t count = fd == -1 ? -1 : pread(fd, sample, sizeof(sample), 0);
+    if (count < 0)
+    {
+        // Let compress() report the error
+        return true;
+    }
+
+    // A plain copy must never look like a compressed file
+    if (count >= static_cast<ssize_t>(sizeof(magic)) && std::memcmp(sample, magic, sizeof(magic)) == 0)
+    {
+        return true;
+    }
+
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if (compressedExtensions.count(extension) != 0)
+    {
+        return false;
+    }
+    // Too short for a meaningful sample, the header would outweigh the gain anyway
+    if (count < 512)
+    {
+        return count > static_cast<ssize_t>(headerSize + trailerSize);
+    }
+    return entropy(sample, count) < entropyLimit;
+}
+
+uint64_t Compressor::compress(const std::filesystem::path& from, const std::filesystem::path& to, Digest* checksum)
+{
+    FileDescriptor in(open(from.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat source;
+    if (in == -1 || fstat(in, &source) != 0)
+    {
+        fail("Failed to open", from);
+    }
+    FileDescriptor out(open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    if (out == -1)
+    {
+        fail("Failed to create", to);
+    }
+    PageCacheGuard inCache(in, cacheNeutral);
+    PageCacheGuard outCache(out, cacheNeutral, true);
+
+    // The size is patched into the header at the end, the source may change meanwhile
+    std::vector<char> buffer(magic, magic + sizeof(magic));
+    append(buffer, static_cast<uint32_t>(blockSize));
+    append(buffer, static_cast<uint64_t>(0));
+    writeFull(out, buffer.data(), buffer.size(), to);
+
+    // Blocks are read sequentially and compressed in rounds of what the budget
+    // shared by all files allows, so memory stays bounded however large the
+    // file is and however many files are compressed at once
+    const size_t roundBlocks = std::max<size_t>(pool.size(), 1) * 2;
+    std::vector<char> index;
+    uint64_t offset = headerSize;
+    uint64_t total = 0;
+    DigestBuilder digest;
+    bool end = false;
+    while (!end)
+    {
+        // The buffers live only while the blocks are granted
+        size_t granted = acquireBlocks(roundBlocks);
+        try
+        {
+            std::vector<Block> blocks(granted);
+            size_t used = 0;
+            for (; used < blocks.size() && !end; ++used)
+            {
+                Block& block = blocks[used];
+                block.data.resize(blockSize);
+                block.size = readFull(in, block.data.data(), blockSize, from);
+                if (throttle != nullptr)
+                {
+                    throttle->consume(block.size);
+                }
+                end = block.size < blockSize;
+                if (block.size == 0)
+                {
+                    break;
+                }
+                if (checksum != nullptr)
+                {
+                    digest.put(block.data.data(), block.size);
+                }
+            }
+
+            TaskGroup group(pool);
+            for (size_t i = 0; i < used; ++i)
+            {
+                Block& block = blocks[i];
+                group.run([&block, this]
+                {
+                    uLongf length = compressBound(block.size);
+                    block.packed.resize(length);
+                    int result = compress2(reinterpret_cast<Bytef*>(block.packed.data()), &length,
+                        reinterpret_cast<const Bytef*>(block.data.data()), block.size, level);
+                    block.stored = result != Z_OK || length >= block.size;
+                    block.packed.resize(block.stored ? 0 : length);
+                });
+            }
+            group.wait();
+
+            for (size_t i = 0; i < used; ++i)
+            {
+                Block& block = blocks[i];
+                const std::vector<char>& data = block.stored ? block.data : block.packed;
+                size_t length = block.stored ? block.size : block.packed.size();
+                writeFull(out, data.data(), length, to);
+                append(index, offset);
+                append(index, static_cast<uint32_t>(length));
+                append(index, static_cast<uint32_t>(block.stored));
+                offset += length;
+                total += block.size;
+            }
+        }
+        catch (...)
+        {
+            releaseBlocks(granted);
+            throw;
+        }
+        releaseBlocks(granted);
+    }
+
+    uint64_t count = index.size() / indexRecordSize;
+    append(index, offset);
+    append(index, count);
+    index.insert(index.end(), magic, magic + sizeof(magic));
+    writeFull(out, index.data(), index.size(), to);
+    if (pwrite(out, &total, sizeof(total), sizeof(magic) + sizeof(uint32_t)) != sizeof(total))
+    {
+        fail("Failed to write", to);
+    }
+
+    // open() applies the umask, the original permissions are restored here
+    if (fchmod(out, source.st_mode & 07777) != 0)
+    {
+        fail("Failed to set permissions", to);
+    }
+    if (checksum != nullptr)
+    {
+        *checksum = digest.finish();
+    }
+    return total;
+}
+
+CompressedFile::CompressedFile(const std::filesystem::path& path):
+path(path),
+fd(open(path.c_str(), O_RDONLY | O_CLOEXEC))
+{
+    struct stat status;
+    if (fd == -1 || fstat(fd, &status) != 0)
+    {
+        fail("Failed to open", path);
+    }
+
+    char header[headerSize];
+    char trailer[trailerSize];
+    if (status.st_size < static_cast<off_t>(headerSize + trailerSize)
+        || pread(fd, header, headerSize, 0) != static_cast<ssize_t>(headerSize)
+        || pread(fd, trailer, trailerSize, status.st_size - trailerSize) != static_cast<ssize_t>(trailerSize)
+        || std::memcmp(header, magic, sizeof(magic)) != 0
+        || std::memcmp(trailer + trailerSize - sizeof(magic), magic, sizeof(magic)) != 0)
+    {
+        throw std::runtime_error("Not a compressed file " + path.string());
+    }
+    const char* data = header + sizeof(magic);
+    blockSize = extract<uint32_t>(data);
+    originalSize = extract<uint64_t>(data);
+    data = trailer;
+    uint64_t indexOffset = extract<uint64_t>(data);
+    uint64_t count = extract<uint64_t>(data);
+
+    if (indexOffset + count * indexRecordSize + trailerSize != static_cast<uint64_t>(status.st_size))
+    {
+        throw std::runtime_error("Corrupted index in " + path.string());
+    }
+    std::vector<char> records(count * indexRecordSize);
+    if (pread(fd, records.data(), records.size(), indexOffset) != static_cast<ssize_t>(records.size()))
+    {
+        fail("Failed to read", path);
+    }
+    data = records.data();
+    blocks.resize(count);
+    for (Block& block : blocks)
+    {
+        block.offset = extract<uint64_t>(data);
+        block.length = extract<uint32_t>(data);
+        block.stored = extract<uint32_t>(data);
+    }
+}
+
+void CompressedFile::load(size_t block)
+{
+    if (loaded == block)
+    {
+        return;
+    }
+    const Block& location = blocks[block];
+    uLongf size = std::min<uint64_t>(blockSize, originalSize - block * blockSize);
+    data.resize(size);
+    packed.resize(location.stored ? 0 : location.length);
+    char* target = location.stored ? data.data() : packed.data();
+    if (pread(fd, target, location.length, location.offset) != static_cast<ssize_t>(location.length))
+    {
+        fail("Failed to read", path);
+    }
+    if (!location.stored)
+    {
+        uLongf length = size;
+        if (uncompress(reinterpret_cast<Bytef*>(data.data()), &length,
+            reinterpret_cast<const Bytef*>(packed.data()), location.length) != Z_OK || length != size)
+        {
+            throw std::runtime_error("Corrupted block " + std::to_string(block) + " in " + path.string());
+        }
+    }
+    loaded = block;
+}
+
+size_t CompressedFile::read(uint64_t offset, char* buffer, size_t size)
+{
+    size_t total = 0;
+    while (total < size && offset < originalSize)
+    {
+        size_t block = offset / blockSize;
+        load(block);
+        size_t start = offset - block * blockSize;
+        size_t count = std::min(size - total, data.size() - start);
+        std::memcpy(buffer + total, data.data() + start, count);
+        total += count;
+        offset += count;
+    }
+    return total;
+}
+
+bool CompressedFile::isCompressed(const std::filesystem::path& path)
+{
+    FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    char header[sizeof(magic)];
+    return fd != -1 && pread(fd, header, sizeof(header), 0) == sizeof(header)
+        && std::memcmp(header, magic, sizeof(magic)) == 0;
+}
+
+uint64_t decompressFile(const std::filesystem::path& from, const std::filesystem::path& to)
+{
+    CompressedFile file(from);
+    FileDescriptor out(open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    if (out == -1)
+    {
+        fail("Failed to create", to);
+    }
+    std::vector<char> buffer(1 << 20);
+    uint64_t offset = 0;
+    while (size_t count = file.read(offset, buffer.data(), buffer.size()))
+    {
+        writeFull(out, buffer.data(), count, to);
+        offset += count;
+    }
+    struct stat source;
+    if (stat(from.c_str(), &source) != 0 || fchmod(out, source.st_mode & 07777) != 0)
+    {
+        fail("Failed to set permissions", to);
+    }
+    return offset;
+}
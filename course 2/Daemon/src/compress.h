@@ -0,0 +1,95 @@
+#ifndef BACKUP_COMPRESS_H
+#define BACKUP_COMPRESS_H
+
+#include "digest.h"
+#include "file_copy.h"
+#include "thread_pool.h"
+#include "throttle.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Compressed file layout, numbers in host byte order like in the store:
+//   header  "BKZ1", u32 block size, u64 original size
+//   blocks  independent zlib streams (or raw data if it did not shrink)
+//   index   u64 offset, u32 length, u32 stored raw - one per block
+//   trailer u64 index offset, u64 block count, "BKZ1"
+// Every block can be read back alone, see CompressedFile.
+class Compressor
+{
+public:
+    Compressor(ThreadPool& pool, int level = 6, size_t blockSize = 1 << 20, Throttle* throttle = nullptr);
+
+    // False for files which are already compressed (by extension or by the
+    // entropy of their first bytes), they are copied as they are
+    bool worthCompressing(const std::filesystem::path& path) const;
+
+    // Compresses the blocks on the pool, returns the number of bytes read.
+    // With `checksum` the original data is hashed block by block as it is read.
+    uint64_t compress(const std::filesystem::path& from, const std::filesystem::path& to, Digest* checksum = nullptr);
+
+    void setCacheNeutral(bool enabled) { cacheNeutral = enabled; }
+
+private:
+    // At most `wanted` blocks of the budget, one even if it is used up
+    size_t acquireBlocks(size_t wanted);
+    void releaseBlocks(size_t count);
+
+    ThreadPool& pool;
+    int level;
+    size_t blockSize;
+    Throttle* throttle;
+    bool cacheNeutral = false;
+
+    // Blocks in flight of all files compressed at once, two per worker. Every
+    // worker may be compressing a file, a budget per file would grow with the
+    // square of the threads. Nothing waits for the budget: a worker which
+    // holds blocks helps with the tasks of other files while it waits for its
+    // own, so it could wait for itself. A file always gets one block instead,
+    // which bounds the blocks by the budget plus one per file.
+    std::mutex mutex;
+    ptrdiff_t freeBlocks;
+};
+
+// Random access to a compressed file, only the touched blocks are inflated
+class CompressedFile
+{
+public:
+    explicit CompressedFile(const std::filesystem::path& path);
+
+    uint64_t size() const { return originalSize; }
+
+    // Returns the number of bytes read, less than `size` only at the end
+    size_t read(uint64_t offset, char* buffer, size_t size);
+
+    // True if the file starts with the compressed file magic
+    static bool isCompressed(const std::filesystem::path& path);
+
+private:
+    struct Block
+    {
+        uint64_t offset;
+        uint32_t length;
+        uint32_t stored;
+    };
+
+    void load(size_t block);
+
+    std::filesystem::path path;
+    FileDescriptor fd;
+    uint32_t blockSize = 0;
+    uint64_t originalSize = 0;
+    std::vector<Block> blocks;
+    size_t loaded = SIZE_MAX;
+    std::vector<char> packed;
+    std::vector<char> data;
+};
+
+// Restores the original file, returns the number of bytes written
+uint64_t decompressFile(const std::filesystem::path& from, const std::filesystem::path& to);
+
+#endif
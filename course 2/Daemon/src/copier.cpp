@@ -0,0 +1,754 @@
+#include "copier.h"
+
+#include "fanout.h"
+#include "staging.h"
+#include "uring.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <unordered_set>
+
+namespace
+{
+    // Small files are handed to the workers in batches to keep the queues short
+    const size_t batchFiles = 64;
+    const uint64_t batchBytes = 16 << 20;
+}
+
+// Shared by all tasks of one copyTree() or copyEntries() call or of a CopyStream
+struct CopyState
+{
+    CopyState(ThreadPool& pool, FileCopier& copier, Throttle& throttle, std::atomic<bool>& uring, Compressor* compressor,
+        bool decompress, bool checksums):
+    group(pool),
+    copier(copier),
+    throttle(throttle),
+    uring(uring),
+    compressor(compressor),
+    decompress(decompress),
+    checksums(checksums)
+    {
+    }
+
+    TaskGroup group;
+    FileCopier& copier;
+    Throttle& throttle;
+    std::atomic<bool>& uring;
+    Compressor* compressor;
+    bool decompress;
+    bool checksums;
+    CopyProgress* progress = nullptr;
+    CopyJournal* journal = nullptr;
+    DeltaCopier* delta = nullptr;
+    uint64_t deltaMinSize = 0;
+    std::atomic<size_t> files{0};
+    std::atomic<size_t> linked{0};
+    std::atomic<size_t> directories{0};
+    std::atomic<uint64_t> bytes{0};
+    LatencyHistogram latency;
+    std::mutex mutex;
+    std::vector<std::string> failed;
+
+    // One regular file or symlink is done
+    void copied(uint64_t count, std::chrono::steady_clock::duration time)
+    {
+        bytes += count;
+        ++files;
+        latency.observe(time);
+        if (progress != nullptr)
+        {
+            progress->bytes += count;
+            ++progress->files;
+        }
+    }
+
+    void fail(const std::string& path, const std::exception& error)
+    {
+        syslog(LOG_WARNING, "%s", error.what());
+        std::lock_guard<std::mutex> lock(mutex);
+        failed.push_back(path);
+    }
+
+    CopyResult result(std::chrono::steady_clock::time_point start)
+    {
+        CopyResult result;
+        result.stats.files = files;
+        result.stats.linked = linked;
+        result.stats.directories = directories;
+        result.stats.bytes = bytes;
+        result.stats.latency = latency;
+        result.stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::sort(failed.begin(), failed.end());
+        result.failed = std::move(failed);
+        return result;
+    }
+};
+
+namespace
+{
+    // A compressed basis would have to be expanded first, such files are copied as usual
+    bool deltaCopied(CopyState& state, const CopyJob& job, Digest& checksum)
+    {
+        if (state.delta == nullptr || job.deltaFrom.empty() || job.entry.size < state.deltaMinSize
+            || state.compressor != nullptr || state.decompress || !std::filesystem::is_regular_file(job.deltaFrom)
+            || CompressedFile::isCompressed(job.deltaFrom))
+        {
+            return false;
+        }
+        auto start = std::chrono::steady_clock::now();
+        DeltaCopier::Result result = state.delta->copy(job.from, job.to, job.deltaFrom, job.signature,
+            state.checksums ? &checksum : nullptr);
+        state.copied(result.literal, std::chrono::steady_clock::now() - start);
+        syslog(LOG_INFO, "Delta copy of %s: %.1f of %.1f MiB changed", job.from.c_str(), result.literal / 1048576.0,
+            (result.literal + result.matched) / 1048576.0);
+        return true;
+    }
+
+    void copyEntry(CopyState& state, const std::filesystem::path& from, const std::filesystem::path& to, uint32_t mode,
+        Digest* checksum = nullptr)
+    {
+        auto start = std::chrono::steady_clock::now();
+        if (S_ISLNK(mode))
+        {
+            std::filesystem::copy_symlink(from, to);
+            state.copied(0, std::chrono::steady_clock::now() - start);
+        }
+        else if (S_ISREG(mode))
+        {
+            uint64_t count;
+            if (state.decompress && CompressedFile::isCompressed(from))
+            {
+                count = decompressFile(from, to);
+            }
+            else if (state.compressor != nullptr && state.compressor->worthCompressing(from))
+            {
+                count = state.compressor->compress(from, to, checksum);
+            }
+            else
+            {
+                count = state.copier.copy(from, to, checksum);
+            }
+            state.copied(count, std::chrono::steady_clock::now() - start);
+        }
+        else if (!S_ISDIR(mode))
+        {
+            syslog(LOG_WARNING, "Skipped special file %s", from.c_str());
+        }
+    }
+
+    // Every worker has its own ring, nullptr when io_uring is off or unusable
+    UringCopier* workerRing(std::atomic<bool>& enabled)
+    {
+        if (!enabled)
+        {
+            return nullptr;
+        }
+        thread_local std::unique_ptr<UringCopier> ring;
+        if (!ring)
+        {
+            ring = std::make_unique<UringCopier>();
+        }
+        if (!ring->available())
+        {
+            if (enabled.exchange(false))
+            {
+                syslog(LOG_WARNING, "%s", "io_uring is not available, copying files one by one");
+            }
+            return nullptr;
+        }
+        return ring.get();
+    }
+
+    // Small files go through io_uring, the rest and the failed ones through the
+    // copier. With checksums every file gets its digest in UringFile::checksum.
+    // `done` is called for every file as soon as it is copied.
+    template <typename Name, typename Done>
+    void copyFiles(CopyState& state, std::vector<UringFile>& files, Name name, Done done)
+    {
+        UringCopier* ring = state.compressor == nullptr && !state.decompress ? workerRing(state.uring) : nullptr;
+        // The files of a ring are in flight together, each one gets its share of the batch
+        std::chrono::steady_clock::duration share{};
+        if (ring != nullptr)
+        {
+            auto start = std::chrono::steady_clock::now();
+            ring->setChecksums(state.checksums);
+            ring->copy(files);
+            share = (std::chrono::steady_clock::now() - start) / std::max<size_t>(files.size(), 1);
+            // Four requests per file which went through the ring
+            uint64_t bytes = 0;
+            uint64_t operations = 0;
+            for (const UringFile& file : files)
+            {
+                if (file.result >= 0)
+                {
+                    bytes += file.result;
+                    operations += 4;
+                }
+            }
+            state.throttle.consume(bytes, operations);
+        }
+        for (UringFile& file : files)
+        {
+            if (ring != nullptr && file.result >= 0)
+            {
+                state.copied(file.result, share);
+                done(file);
+                continue;
+            }
+            try
+            {
+                copyEntry(state, file.from, file.to, S_IFREG, state.checksums ? &file.checksum : nullptr);
+                done(file);
+            }
+            catch (const std::exception& error)
+            {
+                state.fail(name(file), error);
+            }
+        }
+    }
+
+    void copyBatch(CopyState& state, const std::filesystem::path& root, std::vector<UringFile>& batch)
+    {
+        copyFiles(state, batch, [&root](const UringFile& file)
+        {
+            return file.from.lexically_relative(root).string();
+        }, [](const UringFile&) {});
+    }
+
+    void copyDirectory(CopyState& state, const std::filesystem::path& root,
+        const std::filesystem::path& from, const std::filesystem::path& to)
+    {
+        // The directory exists before any of its children is queued
+        std::error_code error;
+        std::filesystem::create_directory(to, from, error);
+        if (error)
+        {
+            state.fail(from.lexically_relative(root).string(), std::filesystem::filesystem_error("Failed to create", to, error));
+            return;
+        }
+        ++state.directories;
+
+        std::vector<UringFile> batch;
+        uint64_t size = 0;
+        auto options = std::filesystem::directory_options::skip_permission_denied;
+        for (const auto& item : std::filesystem::directory_iterator(from, options, error))
+        {
+            std::filesystem::path target = to / item.path().filename();
+            std::filesystem::file_status status = item.symlink_status(error);
+            if (std::filesystem::is_directory(status))
+            {
+                std::filesystem::path child = item.path();
+                state.group.run([&state, &root, child, target]
+                {
+                    copyDirectory(state, root, child, target);
+                });
+            }
+            else if (std::filesystem::is_regular_file(status))
+            {
+                UringFile file;
+                file.from = item.path();
+                file.to = target;
+                file.size = item.file_size(error);
+                file.mode = static_cast<uint32_t>(status.permissions()) & 07777;
+                batch.push_back(std::move(file));
+                size += batch.back().size;
+                if (batch.size() >= batchFiles || size >= batchBytes)
+                {
+                    state.group.run([&state, &root, batch]() mutable
+                    {
+                        copyBatch(state, root, batch);
+                    });
+                    batch.clear();
+                    size = 0;
+                }
+            }
+            else
+            {
+                try
+                {
+                    copyEntry(state, item.path(), target, std::filesystem::is_symlink(status) ? S_IFLNK : 0);
+                }
+                catch (const std::exception& exception)
+                {
+                    state.fail(item.path().lexically_relative(root).string(), exception);
+                }
+            }
+        }
+        if (error)
+        {
+            state.fail(from.lexically_relative(root).string(), std::filesystem::filesystem_error("Failed to list", from, error));
+        }
+        copyBatch(state, root, batch);
+    }
+
+    // A job which needs no copy of its own: finished by the interrupted cycle,
+    // linked or delta-copied. `checksum` is the one of the data if it is known.
+    bool settled(CopyState& state, const CopyJob& job, Digest& checksum)
+    {
+        if (state.journal != nullptr && state.journal->finished(job.entry, checksum))
+        {
+            return true;
+        }
+        // An interrupted copy may have left anything there, a link is not written through
+        if (state.journal != nullptr && !state.journal->resumed().empty())
+        {
+            std::error_code ignored;
+            std::filesystem::remove_all(job.to, ignored);
+        }
+        if (!job.linkFrom.empty() && S_ISREG(job.entry.mode) && link(job.linkFrom.c_str(), job.to.c_str()) == 0)
+        {
+            ++state.linked;
+            if (state.journal != nullptr)
+            {
+                state.journal->record(job.entry);
+            }
+            return true;
+        }
+        if (S_ISREG(job.entry.mode) && deltaCopied(state, job, checksum))
+        {
+            if (state.journal != nullptr)
+            {
+                state.journal->record(job.entry, checksum);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Copies jobs[first, last) on the calling thread. With `failed` the flag of
+    // every job which could not be copied is set.
+    void copyJobs(CopyState& state, const std::vector<CopyJob>& jobs, size_t first, size_t last,
+        std::vector<Digest>& digests, std::vector<char>* failed)
+    {
+        std::vector<UringFile> files;
+        std::vector<const CopyJob*> copied;
+        for (size_t i = first; i < last; ++i)
+        {
+            const CopyJob& job = jobs[i];
+            if (S_ISDIR(job.entry.mode))
+            {
+                continue;
+            }
+            try
+            {
+                Digest checksum{};
+                if (settled(state, job, checksum))
+                {
+                    if (!digests.empty())
+                    {
+                        digests[i] = checksum;
+                    }
+                    continue;
+                }
+                if (S_ISREG(job.entry.mode))
+                {
+                    UringFile file;
+                    file.from = job.from;
+                    file.to = job.to;
+                    file.size = job.entry.size;
+                    file.mode = job.entry.mode;
+                    files.push_back(std::move(file));
+                    copied.push_back(&job);
+                    continue;
+                }
+                copyEntry(state, job.from, job.to, job.entry.mode);
+                if (state.journal != nullptr)
+                {
+                    state.journal->record(job.entry);
+                }
+            }
+            catch (const std::exception& error)
+            {
+                state.fail(job.entry.path, error);
+                if (failed != nullptr)
+                {
+                    (*failed)[i] = 1;
+                }
+            }
+        }
+        // The name is asked for only when a file failed
+        copyFiles(state, files, [&jobs, &files, &copied, failed](const UringFile& file)
+        {
+            const CopyJob* job = copied[&file - files.data()];
+            if (failed != nullptr)
+            {
+                (*failed)[job - jobs.data()] = 1;
+            }
+            return job->entry.path;
+        }, [&state, &files, &copied](const UringFile& file)
+        {
+            if (state.journal != nullptr)
+            {
+                state.journal->record(copied[&file - files.data()]->entry, file.checksum);
+            }
+        });
+        for (size_t i = 0; i < files.size() && !digests.empty(); ++i)
+        {
+            digests[copied[i] - jobs.data()] = files[i].checksum;
+        }
+    }
+}
+
+std::string CopyStats::summary() const
+{
+    double megabytes = bytes / 1048576.0;
+    double time = std::max(seconds, 1e-6);
+    char text[256];
+    snprintf(text, sizeof(text), "%zu files, %zu linked, %.1f MiB in %.2f s (%.0f files/s, %.1f MiB/s)",
+        files, linked, megabytes, seconds, (files + linked) / time, megabytes / time);
+    return text;
+}
+
+CopyEngine::CopyEngine(size_t threads, CopyMethod method, bool uring):
+copier(method, &limiter),
+workers(threads),
+uring(uring)
+{
+}
+
+void CopyEngine::enableCompression(int level, size_t blockSize)
+{
+    compressor = std::make_unique<Compressor>(workers, level, blockSize, &limiter);
+    compressor->setCacheNeutral(dropPages);
+}
+
+void CopyEngine::enableDelta(uint64_t minSize, size_t blockSize)
+{
+    delta = std::make_unique<DeltaCopier>(blockSize, &limiter);
+    deltaMinSize = minSize;
+}
+
+void CopyEngine::enableCacheNeutral()
+{
+    // io_uring copies are not followed by fadvise, so small files go one by one too
+    dropPages = true;
+    uring = false;
+    copier.setCacheNeutral(true);
+    if (compressor)
+    {
+        compressor->setCacheNeutral(true);
+    }
+}
+
+CopyResult CopyEngine::copyTree(const std::filesystem::path& from, const std::filesystem::path& to)
+{
+    auto start = std::chrono::steady_clock::now();
+    CopyState state(workers, copier, limiter, uring, compressor.get(), decompress, false);
+    std::filesystem::create_directories(to.parent_path());
+    copyDirectory(state, from, from, to);
+    state.group.wait();
+    return state.result(start);
+}
+
+CopyResult CopyEngine::copyEntries(const std::vector<CopyJob>& jobs, CopyProgress* progress, CopyJournal* journal)
+{
+    auto start = std::chrono::steady_clock::now();
+    CopyState state(workers, copier, limiter, uring, compressor.get(), decompress, checksums);
+    state.progress = progress;
+    state.journal = journal;
+    state.delta = delta.get();
+    state.deltaMinSize = deltaMinSize;
+    std::vector<Digest> digests(checksums ? jobs.size() : 0);
+
+    // Directories go first in path order, so parents precede children
+    std::vector<std::filesystem::path> directories;
+    std::unordered_set<std::string> seen;
+    for (const CopyJob& job : jobs)
+    {
+        const std::filesystem::path& directory = S_ISDIR(job.entry.mode) ? job.to : job.to.parent_path();
+        if (seen.insert(directory.string()).second)
+        {
+            directories.push_back(directory);
+        }
+    }
+    std::sort(directories.begin(), directories.end());
+    for (const auto& directory : directories)
+    {
+        std::error_code error;
+        if (std::filesystem::create_directories(directory, error))
+        {
+            ++state.directories;
+        }
+    }
+
+    const size_t batch = batchFiles;
+    for (size_t first = 0; first < jobs.size(); first += batch)
+    {
+        size_t last = std::min(first + batch, jobs.size());
+        state.group.run([&state, &jobs, &digests, first, last]
+        {
+            copyJobs(state, jobs, first, last, digests, nullptr);
+        });
+    }
+    state.group.wait();
+    CopyResult result = state.result(start);
+    result.checksums = std::move(digests);
+    return result;
+}
+
+CopyStream::CopyStream(CopyEngine& engine, CopyProgress* progress, CopyJournal* journal):
+engine(engine),
+state(std::make_unique<CopyState>(engine.workers, engine.copier, engine.limiter, engine.uring, engine.compressor.get(),
+    engine.decompress, engine.checksums)),
+start(std::chrono::steady_clock::now())
+{
+    state->progress = progress;
+    state->journal = journal;
+    state->delta = engine.delta.get();
+    state->deltaMinSize = engine.deltaMinSize;
+}
+
+CopyStream::~CopyStream() = default;
+
+void CopyStream::submit(Batch& batch)
+{
+    prepare(batch);
+    batch.group = std::make_shared<TaskGroup>(engine.workers);
+    for (size_t first = 0; first < batch.jobs.size(); first += batchFiles)
+    {
+        size_t last = std::min(first + batchFiles, batch.jobs.size());
+        batch.group->run([this, &batch, first, last]
+        {
+            copyJobs(*state, batch.jobs, first, last, batch.checksums, &batch.failed);
+        });
+    }
+}
+
+void CopyStream::submit(FanOut& fanOut, const std::vector<CopyStream*>& streams, const std::vector<Batch*>& batches)
+{
+    for (size_t i = 0; i < streams.size(); ++i)
+    {
+        streams[i]->prepare(*batches[i]);
+    }
+
+    // The jobs of one path in all batches are a unit, units[u] is the first of unit u in `parts`
+    auto parts = std::make_shared<std::vector<std::pair<size_t, size_t>>>();
+    auto units = std::make_shared<std::vector<size_t>>();
+    std::vector<size_t> next(batches.size(), 0);
+    while (true)
+    {
+        const std::string* path = nullptr;
+        for (size_t i = 0; i < batches.size(); ++i)
+        {
+            if (next[i] < batches[i]->jobs.size() && (path == nullptr || batches[i]->jobs[next[i]].entry.path < *path))
+            {
+                path = &batches[i]->jobs[next[i]].entry.path;
+            }
+        }
+        if (path == nullptr)
+        {
+            break;
+        }
+        units->push_back(parts->size());
+        for (size_t i = 0; i < batches.size(); ++i)
+        {
+            if (next[i] < batches[i]->jobs.size() && batches[i]->jobs[next[i]].entry.path == *path)
+            {
+                parts->emplace_back(i, next[i]++);
+            }
+        }
+    }
+    units->push_back(parts->size());
+
+    // The batches are waited for one by one, each of them for the whole group
+    auto group = std::make_shared<TaskGroup>(streams.front()->engine.workers);
+    for (Batch* batch : batches)
+    {
+        batch->group = group;
+    }
+    for (size_t first = 0; first + 1 < units->size(); first += batchFiles)
+    {
+        size_t last = std::min(first + batchFiles, units->size() - 1);
+        group->run([&fanOut, streams, batches, parts, units, first, last]
+        {
+            for (size_t unit = first; unit < last; ++unit)
+            {
+                copyUnit(fanOut, streams, batches, *parts, (*units)[unit], (*units)[unit + 1]);
+            }
+        });
+    }
+}
+
+void CopyStream::copyUnit(FanOut& fanOut, const std::vector<CopyStream*>& streams, const std::vector<Batch*>& batches,
+    const std::vector<std::pair<size_t, size_t>>& parts, size_t first, size_t last)
+{
+    auto start = std::chrono::steady_clock::now();
+    // Regular files which are left to copy, read once if there are several
+    std::vector<std::pair<size_t, size_t>> reads;
+    for (size_t part = first; part < last; ++part)
+    {
+        CopyStream& stream = *streams[parts[part].first];
+        Batch& batch = *batches[parts[part].first];
+        size_t i = parts[part].second;
+        const CopyJob& job = batch.jobs[i];
+        if (S_ISDIR(job.entry.mode))
+        {
+            continue;
+        }
+        try
+        {
+            Digest checksum{};
+            if (settled(*stream.state, job, checksum))
+            {
+                if (!batch.checksums.empty())
+                {
+                    batch.checksums[i] = checksum;
+                }
+                continue;
+            }
+            // A compressed copy is written by the Compressor, it reads the source itself
+            if (S_ISREG(job.entry.mode) && stream.state->compressor == nullptr && !stream.state->decompress)
+            {
+                reads.push_back(parts[part]);
+                continue;
+            }
+            stream.copyOne(batch, i);
+        }
+        catch (const std::exception& error)
+        {
+            stream.state->fail(job.entry.path, error);
+            batch.failed[i] = 1;
+        }
+    }
+
+    // A single copy goes the cheapest way, see FileCopier
+    if (reads.size() == 1)
+    {
+        CopyStream& stream = *streams[reads.front().first];
+        Batch& batch = *batches[reads.front().first];
+        size_t i = reads.front().second;
+        try
+        {
+            stream.copyOne(batch, i);
+        }
+        catch (const std::exception& error)
+        {
+            stream.state->fail(batch.jobs[i].entry.path, error);
+            batch.failed[i] = 1;
+        }
+        return;
+    }
+    if (reads.empty())
+    {
+        return;
+    }
+    std::vector<FanOut::Target> targets;
+    for (const auto& read : reads)
+    {
+        CopyStream* stream = streams[read.first];
+        Batch* batch = batches[read.first];
+        size_t i = read.second;
+        {
+            std::lock_guard<std::mutex> lock(stream->mutex);
+            ++batch->writing;
+        }
+        targets.push_back({read.first, batch->jobs[i].to,
+            [stream, batch, i, start](uint64_t bytes, const Digest& checksum, std::exception_ptr error)
+            {
+                stream->written(*batch, i, bytes, checksum, error, start);
+            }});
+    }
+    fanOut.copy(batches[reads.front().first]->jobs[reads.front().second].from, std::move(targets),
+        streams.front()->engine.checksums);
+}
+
+void CopyStream::copyOne(Batch& batch, size_t i)
+{
+    const CopyJob& job = batch.jobs[i];
+    Digest checksum{};
+    copyEntry(*state, job.from, job.to, job.entry.mode, engine.checksums && S_ISREG(job.entry.mode) ? &checksum : nullptr);
+    if (state->journal != nullptr)
+    {
+        state->journal->record(job.entry, checksum);
+    }
+    if (!batch.checksums.empty())
+    {
+        batch.checksums[i] = checksum;
+    }
+}
+
+void CopyStream::written(Batch& batch, size_t i, uint64_t bytes, const Digest& checksum, std::exception_ptr error,
+    std::chrono::steady_clock::time_point started)
+{
+    const CopyJob& job = batch.jobs[i];
+    if (error)
+    {
+        try
+        {
+            std::rethrow_exception(error);
+        }
+        catch (const std::exception& exception)
+        {
+            state->fail(job.entry.path, exception);
+        }
+        batch.failed[i] = 1;
+    }
+    else
+    {
+        state->copied(bytes, std::chrono::steady_clock::now() - started);
+        if (state->journal != nullptr)
+        {
+            state->journal->record(job.entry, checksum);
+        }
+        if (!batch.checksums.empty())
+        {
+            batch.checksums[i] = checksum;
+        }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    --batch.writing;
+    writes.notify_all();
+}
+
+void CopyStream::prepare(Batch& batch)
+{
+    batch.checksums.assign(engine.checksums ? batch.jobs.size() : 0, Digest{});
+    batch.failed.assign(batch.jobs.size(), 0);
+    batch.writing = 0;
+
+    // In path order a directory precedes its entries, mostly they share the last one
+    bool resumed = state->journal != nullptr && !state->journal->resumed().empty();
+    for (const CopyJob& job : batch.jobs)
+    {
+        const std::filesystem::path& parent = S_ISDIR(job.entry.mode) ? job.to : job.to.parent_path();
+        if (parent == directory)
+        {
+            continue;
+        }
+        std::error_code error;
+        if (std::filesystem::create_directories(parent, error))
+        {
+            ++state->directories;
+        }
+        else if (error && resumed)
+        {
+            // An interrupted copy may have left a file where the directory goes now
+            std::filesystem::remove(parent, error);
+            if (std::filesystem::create_directories(parent, error))
+            {
+                ++state->directories;
+            }
+        }
+        directory = parent;
+    }
+}
+
+void CopyStream::wait(Batch& batch)
+{
+    if (batch.group)
+    {
+        batch.group->wait();
+        batch.group.reset();
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    writes.wait(lock, [&batch] { return batch.writing == 0; });
+}
+
+CopyResult CopyStream::result()
+{
+    return state->result(start);
+}
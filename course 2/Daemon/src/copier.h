@@ -0,0 +1,186 @@
+#ifndef BACKUP_COPIER_H
+#define BACKUP_COPIER_H
+
+#include "compress.h"
+#include "delta.h"
+#include "digest.h"
+#include "file_copy.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+class CopyJournal;
+class FanOut;
+struct CopyState;
+
+struct CopyStats
+{
+    size_t files = 0;
+    size_t linked = 0;
+    size_t directories = 0;
+    uint64_t bytes = 0;
+    double seconds = 0;
+    LatencyHistogram latency;  // Per regular file and symlink
+
+    // "N files, X MiB in T s (F files/s, M MiB/s)"
+    std::string summary() const;
+};
+
+// Counters of a running copy, read by another thread to report progress.
+// The totals are set by the caller when it knows them.
+struct CopyProgress
+{
+    std::atomic<size_t> files{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<size_t> totalFiles{0};
+    std::atomic<uint64_t> totalBytes{0};
+};
+
+// One entry to recreate in a snapshot. Unchanged files are hard-linked
+// from linkFrom when it is set and copied from `from` if that fails. A large
+// changed file is delta-copied against its previous copy deltaFrom when it
+// is set and delta copies are enabled, `signature` is its cache file.
+struct CopyJob
+{
+    Entry entry;
+    std::filesystem::path from;
+    std::filesystem::path to;
+    std::filesystem::path linkFrom;
+    std::filesystem::path deltaFrom;
+    std::filesystem::path signature;
+};
+
+struct CopyResult
+{
+    CopyStats stats;
+    // Relative paths of the entries which could not be copied
+    std::vector<std::string> failed;
+    // One per job of copyEntries() with checksums enabled, all zero for the
+    // entries which were not copied as regular files
+    std::vector<Digest> checksums;
+};
+
+// Copies files on a pool of [performance] threads workers. Directories are
+// always created before anything is copied into them. With `uring` small
+// files are copied by a ring of linked io_uring requests on every worker.
+class CopyEngine
+{
+public:
+    CopyEngine(size_t threads, CopyMethod method = CopyMethod::Reflink, bool uring = false);
+
+    // Parallel replacement of std::filesystem::copy(from, to, recursive)
+    CopyResult copyTree(const std::filesystem::path& from, const std::filesystem::path& to);
+
+    // Regular files and symlinks done so far are added to `progress`. Every
+    // copied file and symlink is recorded in `journal`, the ones it has from an
+    // interrupted copy into the same directory are skipped.
+    CopyResult copyEntries(const std::vector<CopyJob>& jobs, CopyProgress* progress = nullptr,
+        CopyJournal* journal = nullptr);
+
+    // Regular files are written compressed from now on, see Compressor
+    void enableCompression(int level, size_t blockSize);
+
+    // Compressed regular files are written back with their original data, see
+    // decompressFile(). The magic of every file is checked, so io_uring is not used.
+    void enableDecompression() { decompress = true; }
+
+    // Every regular file copied by copyEntries() is hashed on the way, see
+    // CopyResult::checksums
+    void enableChecksums() { checksums = true; }
+
+    // Regular files of at least `minSize` bytes with a deltaFrom are written
+    // by a DeltaCopier with `blockSize` blocks
+    void enableDelta(uint64_t minSize, size_t blockSize);
+
+    // Copies do not displace the page cache, see PageCacheGuard
+    void enableCacheNeutral();
+    bool cacheNeutral() const { return dropPages; }
+
+    ThreadPool& pool() { return workers; }
+
+    // Limits every copy of this engine, see [throttle]
+    Throttle& throttle() { return limiter; }
+
+private:
+    friend class CopyStream;
+
+    Throttle limiter;
+    FileCopier copier;
+    ThreadPool workers;
+    std::atomic<bool> uring;
+    std::unique_ptr<Compressor> compressor;
+    std::unique_ptr<DeltaCopier> delta;
+    uint64_t deltaMinSize = 0;
+    bool dropPages = false;
+    bool decompress = false;
+    bool checksums = false;
+};
+
+// copyEntries() for jobs which arrive in batches while the tree is still
+// being walked. A batch is queued on the pool as soon as it is submitted and
+// waited for on its own, so the caller decides how many are in flight.
+// Batches are expected in path order.
+class CopyStream
+{
+public:
+    struct Batch
+    {
+        std::vector<CopyJob> jobs;
+        // Set by wait(): one checksum per job with checksums enabled and a
+        // flag for every job which could not be copied
+        std::vector<Digest> checksums;
+        std::vector<char> failed;
+        std::shared_ptr<TaskGroup> group;
+        // Copies still queued at a FanOut, guarded by the mutex of the stream
+        size_t writing = 0;
+    };
+
+    CopyStream(CopyEngine& engine, CopyProgress* progress = nullptr, CopyJournal* journal = nullptr);
+    ~CopyStream();
+
+    // Creates the directories of the jobs and queues the copies. The batch
+    // has to stay in place until wait() returns.
+    void submit(Batch& batch);
+
+    // The batches of one part of the walk for the streams of several
+    // destinations, batches[i] for streams[i]. A regular file which more than
+    // one of them copies from the same source is read once and written to all
+    // of them by `fanOut`, whose destination i is the one of streams[i].
+    static void submit(FanOut& fanOut, const std::vector<CopyStream*>& streams, const std::vector<Batch*>& batches);
+
+    void wait(Batch& batch);
+
+    // Totals of all batches, called once when they are done
+    CopyResult result();
+
+private:
+    static void copyUnit(FanOut& fanOut, const std::vector<CopyStream*>& streams, const std::vector<Batch*>& batches,
+        const std::vector<std::pair<size_t, size_t>>& parts, size_t first, size_t last);
+    void prepare(Batch& batch);
+    void copyOne(Batch& batch, size_t i);
+    // Called by the FanOut when the copy of jobs[i] is written
+    void written(Batch& batch, size_t i, uint64_t bytes, const Digest& checksum, std::exception_ptr error,
+        std::chrono::steady_clock::time_point started);
+
+    CopyEngine& engine;
+    std::unique_ptr<CopyState> state;
+    std::chrono::steady_clock::time_point start;
+    // Created by the last submit()
+    std::filesystem::path directory;
+    std::mutex mutex;
+    std::condition_variable writes;
+};
+
+#endif
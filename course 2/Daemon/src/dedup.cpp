@@ -0,0 +1,198 @@
+#include "dedup.h"
+
+#include "cache.h"
+#include "chunker.h"
+#include "store.h"
+
+#include <chrono>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace
+{
+    struct DedupStats
+    {
+        uint64_t bytes = 0;
+        size_t newChunks = 0;
+        uint64_t newBytes = 0;
+    };
+
+    void putChunk(Store& store, std::vector<Digest>& chunks, DedupStats& stats,
+        const unsigned char* data, size_t size)
+    {
+        Digest digest = computeDigest(data, size);
+        if (store.put(digest, data, size))
+        {
+            ++stats.newChunks;
+            stats.newBytes += size;
+        }
+        chunks.push_back(digest);
+    }
+
+    // Splits the file into chunks and writes the ones the store does not have yet
+    std::vector<Digest> storeFile(Store& store, const Chunker& chunker, const std::string& path, DedupStats& stats,
+        CopyEngine& engine)
+    {
+        FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (fd == -1)
+        {
+            throw std::system_error(errno, std::generic_category(), "Failed to open " + path);
+        }
+        PageCacheGuard cache(fd, engine.cacheNeutral());
+
+        // Keep at least one maximal chunk in the buffer unless the file ends
+        std::vector<unsigned char> buffer(chunker.maximumSize() * 4);
+        std::vector<Digest> chunks;
+        size_t begin = 0;
+        size_t end = 0;
+        bool eof = false;
+        while (true)
+        {
+            if (!eof && end - begin < chunker.maximumSize())
+            {
+                std::copy(buffer.begin() + begin, buffer.begin() + end, buffer.begin());
+                end -= begin;
+                begin = 0;
+                ssize_t count = read(fd, buffer.data() + end, buffer.size() - end);
+                if (count < 0)
+                {
+                    throw std::system_error(errno, std::generic_category(), "Failed to read " + path);
+                }
+                eof = count == 0;
+                end += count;
+                stats.bytes += count;
+                engine.throttle().consume(count);
+                continue;
+            }
+            if (begin == end)
+            {
+                break;
+            }
+            size_t length = chunker.next(buffer.data() + begin, end - begin);
+            putChunk(store, chunks, stats, buffer.data() + begin, length);
+            begin += length;
+        }
+        return chunks;
+    }
+}
+
+void dedupBackup(ChangeTracker& tracker, const std::string& dst, const std::string& dateTime,
+    const mINI::INIStructure& ini, CopyEngine& engine, CycleMetrics& metrics)
+{
+    const std::string& src = tracker.source();
+    const std::string& chunkSize = ini.get("dedup").get("chunk_size");
+    const std::string& packSize = ini.get("dedup").get("pack_size");
+
+    Store store(std::filesystem::path(dst) / ".store", packSize.empty() ? 64 << 20 : std::stoull(packSize));
+    Chunker chunker(chunkSize.empty() ? 64 * 1024 : std::stoull(chunkSize));
+
+    // Removing a recipe is how a snapshot is deleted, its chunks are reclaimed here
+    if (store.recipesDeleted())
+    {
+        PhaseTimer timer(metrics, Phase::Prune);
+        store.collectGarbage();
+    }
+
+    std::vector<std::string> recipes = store.listRecipes();
+    Recipe previous;
+    if (!recipes.empty())
+    {
+        previous = store.readRecipe(recipes.back());
+    }
+    std::unordered_map<std::string, const RecipeEntry*> previousByPath;
+    for (const RecipeEntry& item : previous)
+    {
+        previousByPath.emplace(item.entry.path, &item);
+    }
+    // The source root is not part of the scan, it never counts as deleted
+    previousByPath.erase(std::string());
+
+    // Unchanged files keep their chunk lists without being read
+    DedupStats stats;
+    Recipe recipe;
+    size_t changed = 0;
+    size_t failed = 0;
+    Manifest current;
+    RecipeEntry root;
+    {
+        PhaseTimer timer(metrics, Phase::Scan);
+        root.entry = statRoot(src);
+        current = tracker.scan();
+    }
+    metrics.scanned = current.size();
+    PhaseTimer copyTimer(metrics, Phase::Copy);
+    for (Entry& entry : current)
+    {
+        RecipeEntry item;
+        auto found = previousByPath.find(entry.path);
+        if (found != previousByPath.end() && !isChanged(entry, found->second->entry))
+        {
+            item.chunks = found->second->chunks;
+            item.entry = std::move(entry);
+            recipe.push_back(std::move(item));
+            previousByPath.erase(found);
+            continue;
+        }
+
+        if (found != previousByPath.end())
+        {
+            previousByPath.erase(found);
+        }
+
+        std::string path = (std::filesystem::path(src) / entry.path).string();
+        auto start = std::chrono::steady_clock::now();
+        try
+        {
+            if (S_ISREG(entry.mode))
+            {
+                item.chunks = storeFile(store, chunker, path, stats, engine);
+            }
+            else if (S_ISLNK(entry.mode))
+            {
+                // The target of a symbolic link is stored as its data
+                std::string target = std::filesystem::read_symlink(path).string();
+                putChunk(store, item.chunks, stats, reinterpret_cast<const unsigned char*>(target.data()), target.size());
+            }
+        }
+        catch (const std::exception& error)
+        {
+            // Leave the entry out, so the next cycle retries it
+            syslog(LOG_WARNING, "%s", error.what());
+            tracker.markDirty(entry.path);
+            ++failed;
+            continue;
+        }
+        if (S_ISREG(entry.mode) || S_ISLNK(entry.mode))
+        {
+            metrics.latency.observe(std::chrono::steady_clock::now() - start);
+        }
+        ++changed;
+        item.entry = std::move(entry);
+        recipe.push_back(std::move(item));
+    }
+
+    copyTimer.stop();
+    metrics.copied = changed;
+    metrics.skipped = recipe.size() - changed;
+    metrics.failed = failed;
+    metrics.bytes = stats.bytes;
+    if (changed == 0 && previousByPath.empty() && !recipes.empty())
+    {
+        syslog(LOG_INFO, "No changes in %s since %s", src.c_str(), recipes.back().c_str());
+        return;
+    }
+
+    // Flushes the open pack before the recipe which refers to its chunks
+    // The empty path sorts before everything else
+    recipe.insert(recipe.begin(), std::move(root));
+    PhaseTimer syncTimer(metrics, Phase::Fsync);
+    store.writeRecipe(dateTime, recipe);
+
+    syslog(LOG_INFO, "Stored %s: %zu changed entries, %zu deleted, %zu failed, read %llu bytes, "
+        "%zu new chunks with %llu bytes, %zu chunks in store",
+        dateTime.c_str(), changed, previousByPath.size(), failed, static_cast<unsigned long long>(stats.bytes),
+        stats.newChunks, static_cast<unsigned long long>(stats.newBytes), store.chunkCount());
+}
@@ -0,0 +1,15 @@
+#ifndef BACKUP_DEDUP_H
+#define BACKUP_DEDUP_H
+
+#include "copier.h"
+#include "tracker.h"
+
+#include <mini/ini.h>
+
+#include <string>
+
+// Stores the source tree in the chunk store at dst/.store, see store.h
+void dedupBackup(ChangeTracker& tracker, const std::string& dst, const std::string& dateTime,
+    const mINI::INIStructure& ini, CopyEngine& engine, CycleMetrics& metrics);
+
+#endif
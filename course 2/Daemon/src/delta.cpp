@@ -0,0 +1,626 @@
+#include "delta.h"
+
+#include "file_copy.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+    const uint32_t signatureMagic = 0x31534b42;  // "BKS1"
+    const size_t bufferSize = 8 << 20;
+    // Long runs of new data are written while the window moves on
+    const size_t literalSize = 1 << 20;
+    const size_t filterBits = 1 << 20;
+    const uint32_t noBlock = std::numeric_limits<uint32_t>::max();
+
+    struct BlockSignature
+    {
+        uint32_t weak;
+        Digest strong;
+    };
+
+    struct FileSignature
+    {
+        uint32_t blockSize = 0;
+        uint64_t inode = 0;
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        std::vector<BlockSignature> blocks;
+    };
+
+    [[noreturn]] void fail(const std::string& message, const std::filesystem::path& path)
+    {
+        throw std::filesystem::filesystem_error(message, path, std::error_code(errno, std::generic_category()));
+    }
+
+    template <class T>
+    void append(std::vector<char>& buffer, const T& value)
+    {
+        const char* bytes = reinterpret_cast<const char*>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    template <class T>
+    T extract(const char*& data)
+    {
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        data += sizeof(T);
+        return value;
+    }
+
+    int64_t mtimeOf(const struct stat& status)
+    {
+        return status.st_mtim.tv_sec * 1000000000LL + status.st_mtim.tv_nsec;
+    }
+
+    // rsync's weak checksum: two 16-bit sums which move by one byte in O(1)
+    class RollingChecksum
+    {
+    public:
+        void reset(const unsigned char* data, size_t size)
+        {
+            a = 0;
+            b = 0;
+            length = size;
+            for (size_t i = 0; i < size; ++i)
+            {
+                a += data[i];
+                b += (size - i) * data[i];
+            }
+        }
+
+        void roll(unsigned char out, unsigned char in)
+        {
+            a += in - out;
+            b += a - length * out;
+        }
+
+        uint32_t value() const { return (a & 0xffff) | (b << 16); }
+
+    private:
+        uint32_t a = 0;
+        uint32_t b = 0;
+        uint32_t length = 0;
+    };
+
+    BlockSignature signBlock(const unsigned char* data, size_t size)
+    {
+        RollingChecksum weak;
+        weak.reset(data, size);
+        return {weak.value(), computeDigest(data, size)};
+    }
+
+    ssize_t readFully(int fd, unsigned char* data, size_t size, const std::filesystem::path& path)
+    {
+        size_t done = 0;
+        while (done < size)
+        {
+            ssize_t count = read(fd, data + done, size - done);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                fail("Failed to read", path);
+            }
+            if (count == 0)
+            {
+                break;
+            }
+            done += count;
+        }
+        return done;
+    }
+
+    // The cached signature if it describes this very copy, empty blocks otherwise
+    FileSignature loadSignature(const std::filesystem::path& path, const struct stat& basis, size_t blockSize)
+    {
+        FileSignature signature;
+        FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        struct stat status;
+        if (fd == -1 || fstat(fd, &status) != 0)
+        {
+            return signature;
+        }
+        std::vector<char> data(status.st_size);
+        if (readFully(fd, reinterpret_cast<unsigned char*>(data.data()), data.size(), path) != status.st_size
+            || data.size() < 2 * sizeof(uint32_t) + 4 * sizeof(uint64_t))
+        {
+            return signature;
+        }
+        const char* cursor = data.data();
+        uint32_t magic = extract<uint32_t>(cursor);
+        uint32_t size = extract<uint32_t>(cursor);
+        uint64_t inode = extract<uint64_t>(cursor);
+        uint64_t length = extract<uint64_t>(cursor);
+        int64_t mtime = extract<int64_t>(cursor);
+        uint64_t count = extract<uint64_t>(cursor);
+        size_t recordSize = sizeof(uint32_t) + sizeof(Digest);
+        if (magic != signatureMagic || size != blockSize || inode != static_cast<uint64_t>(basis.st_ino)
+            || length != static_cast<uint64_t>(basis.st_size) || mtime != mtimeOf(basis)
+            || count != (length + size - 1) / size || static_cast<size_t>(data.data() + data.size() - cursor) != count * recordSize)
+        {
+            return signature;
+        }
+        signature.blockSize = size;
+        signature.inode = inode;
+        signature.size = length;
+        signature.mtime = mtime;
+        signature.blocks.reserve(count);
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            BlockSignature block;
+            block.weak = extract<uint32_t>(cursor);
+            block.strong = extract<Digest>(cursor);
+            signature.blocks.push_back(block);
+        }
+        return signature;
+    }
+
+    // Written next to the cache file and renamed, a crash leaves the old one or none
+    void saveSignature(const std::filesystem::path& path, const FileSignature& signature)
+    {
+        std::vector<char> data;
+        data.reserve(2 * sizeof(uint32_t) + 4 * sizeof(uint64_t) + signature.blocks.size() * (sizeof(uint32_t) + sizeof(Digest)));
+        append(data, signatureMagic);
+        append(data, signature.blockSize);
+        append(data, signature.inode);
+        append(data, signature.size);
+        append(data, signature.mtime);
+        append(data, static_cast<uint64_t>(signature.blocks.size()));
+        for (const BlockSignature& block : signature.blocks)
+        {
+            append(data, block.weak);
+            append(data, block.strong);
+        }
+
+        std::filesystem::create_directories(path.parent_path());
+        std::filesystem::path temporary = path.parent_path() / (path.filename().string() + ".tmp");
+        FileDescriptor fd(open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+        if (fd == -1)
+        {
+            fail("Failed to create", temporary);
+        }
+        for (size_t offset = 0; offset < data.size();)
+        {
+            ssize_t count = write(fd, data.data() + offset, data.size() - offset);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                fail("Failed to write", temporary);
+            }
+            offset += count;
+        }
+        std::filesystem::rename(temporary, path);
+    }
+
+    // Reads the basis once when the cache does not describe it
+    FileSignature computeSignature(int fd, const std::filesystem::path& path, const struct stat& status, size_t blockSize,
+        Throttle* throttle)
+    {
+        FileSignature signature;
+        signature.blockSize = blockSize;
+        signature.inode = status.st_ino;
+        signature.size = status.st_size;
+        signature.mtime = mtimeOf(status);
+        signature.blocks.reserve((status.st_size + blockSize - 1) / blockSize);
+        std::vector<unsigned char> buffer(std::max(bufferSize / blockSize, size_t(1)) * blockSize);
+        while (true)
+        {
+            size_t count = readFully(fd, buffer.data(), buffer.size(), path);
+            if (throttle != nullptr)
+            {
+                throttle->consume(count);
+            }
+            for (size_t offset = 0; offset < count; offset += blockSize)
+            {
+                signature.blocks.push_back(signBlock(buffer.data() + offset, std::min(blockSize, count - offset)));
+            }
+            if (count < buffer.size())
+            {
+                return signature;
+            }
+        }
+    }
+
+    // Blocks of the basis by weak checksum. The filter rejects most windows
+    // with one bit test; identical blocks are kept once.
+    class BlockIndex
+    {
+    public:
+        explicit BlockIndex(const FileSignature& signature):
+        signature(signature),
+        filter(filterBits / 64),
+        next(signature.blocks.size(), noBlock)
+        {
+            size_t buckets = 1;
+            while (buckets < signature.blocks.size() * 2)
+            {
+                buckets *= 2;
+            }
+            heads.assign(buckets, noBlock);
+            mask = buckets - 1;
+            // The short last block can only match at the end of the new version, it is left out
+            size_t full = signature.size / signature.blockSize;
+            for (size_t i = 0; i < full; ++i)
+            {
+                const BlockSignature& block = signature.blocks[i];
+                uint32_t* slot = &heads[block.weak & mask];
+                bool duplicate = false;
+                for (uint32_t k = *slot; k != noBlock && !duplicate; k = next[k])
+                {
+                    duplicate = signature.blocks[k].weak == block.weak && signature.blocks[k].strong == block.strong;
+                }
+                if (duplicate)
+                {
+                    continue;
+                }
+                next[i] = *slot;
+                *slot = i;
+                filter[(block.weak % filterBits) / 64] |= uint64_t(1) << (block.weak % 64);
+            }
+            this->full = full;
+        }
+
+        // Block with the data of the window or noBlock. The block after the
+        // last match is tried first, a file changed in place matches in order.
+        uint32_t find(uint32_t weak, const unsigned char* data, size_t size, uint64_t expected) const
+        {
+            if ((filter[(weak % filterBits) / 64] & (uint64_t(1) << (weak % 64))) == 0)
+            {
+                return noBlock;
+            }
+            Digest strong{};
+            bool hashed = false;
+            if (expected < full && signature.blocks[expected].weak == weak)
+            {
+                strong = computeDigest(data, size);
+                hashed = true;
+                if (signature.blocks[expected].strong == strong)
+                {
+                    return expected;
+                }
+            }
+            for (uint32_t k = heads[weak & mask]; k != noBlock; k = next[k])
+            {
+                if (signature.blocks[k].weak != weak)
+                {
+                    continue;
+                }
+                if (!hashed)
+                {
+                    strong = computeDigest(data, size);
+                    hashed = true;
+                }
+                if (signature.blocks[k].strong == strong)
+                {
+                    return k;
+                }
+            }
+            return noBlock;
+        }
+
+    private:
+        const FileSignature& signature;
+        std::vector<uint64_t> filter;
+        std::vector<uint32_t> heads;
+        std::vector<uint32_t> next;
+        size_t mask = 0;
+        size_t full = 0;
+    };
+
+    // Writes the new data and clones or copies the runs of matched blocks
+    class DeltaWriter
+    {
+    public:
+        DeltaWriter(int basis, int out, const std::filesystem::path& path, size_t alignment, Throttle* throttle):
+        basis(basis),
+        out(out),
+        path(path),
+        alignment(alignment),
+        throttle(throttle)
+        {
+        }
+
+        void literal(const unsigned char* data, size_t size, uint64_t offset)
+        {
+            for (size_t done = 0; done < size;)
+            {
+                ssize_t count = pwrite(out, data + done, size - done, offset + done);
+                if (count < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    fail("Failed to write", path);
+                }
+                done += count;
+            }
+            result.literal += size;
+            // An operation, the bytes were charged when they were read from the source
+            if (throttle != nullptr && size > 0)
+            {
+                throttle->consume(0);
+            }
+        }
+
+        // Adjacent blocks in both files are copied as one run
+        void match(uint64_t from, uint64_t to, uint64_t size)
+        {
+            if (runSize > 0 && from == runFrom + runSize && to == runTo + runSize)
+            {
+                runSize += size;
+                return;
+            }
+            flush();
+            runFrom = from;
+            runTo = to;
+            runSize = size;
+        }
+
+        void flush()
+        {
+            if (runSize == 0)
+            {
+                return;
+            }
+            copyRun(runFrom, runTo, runSize);
+            result.matched += runSize;
+            runSize = 0;
+        }
+
+        const DeltaCopier::Result& total() const { return result; }
+
+    private:
+        void copyRun(uint64_t from, uint64_t to, uint64_t size)
+        {
+            // Shares the extents on a CoW filesystem, only whole filesystem blocks can be cloned
+            if (cloning && from % alignment == 0 && to % alignment == 0 && size % alignment == 0)
+            {
+                file_clone_range range = {};
+                range.src_fd = basis;
+                range.src_offset = from;
+                range.src_length = size;
+                range.dest_offset = to;
+                if (ioctl(out, FICLONERANGE, &range) == 0)
+                {
+                    if (throttle != nullptr)
+                    {
+                        throttle->consume(0);
+                    }
+                    return;
+                }
+                cloning = false;
+            }
+            while (size > 0 && inKernel)
+            {
+                loff_t inOffset = from;
+                loff_t outOffset = to;
+                ssize_t count = copy_file_range(basis, &inOffset, out, &outOffset, size, 0);
+                if (count <= 0)
+                {
+                    if (count < 0 && errno == EINTR)
+                    {
+                        continue;
+                    }
+                    // Another filesystem or an old kernel, the rest goes through the buffer
+                    inKernel = false;
+                    break;
+                }
+                from += count;
+                to += count;
+                size -= count;
+                if (throttle != nullptr)
+                {
+                    throttle->consume(count);
+                }
+            }
+            std::vector<unsigned char> buffer(std::min<uint64_t>(size, bufferSize));
+            while (size > 0)
+            {
+                ssize_t count = pread(basis, buffer.data(), std::min<uint64_t>(size, buffer.size()), from);
+                if (count <= 0)
+                {
+                    if (count < 0 && errno == EINTR)
+                    {
+                        continue;
+                    }
+                    fail("Failed to read the basis of", path);
+                }
+                literal(buffer.data(), count, to);
+                result.literal -= count;
+                from += count;
+                to += count;
+                size -= count;
+            }
+        }
+
+        int basis;
+        int out;
+        const std::filesystem::path& path;
+        size_t alignment;
+        Throttle* throttle;
+        bool cloning = true;
+        bool inKernel = true;
+        uint64_t runFrom = 0;
+        uint64_t runTo = 0;
+        uint64_t runSize = 0;
+        DeltaCopier::Result result;
+    };
+}
+
+DeltaCopier::DeltaCopier(size_t blockSize, Throttle* throttle):
+block(blockSize),
+throttle(throttle)
+{
+}
+
+DeltaCopier::Result DeltaCopier::copy(const std::filesystem::path& from, const std::filesystem::path& to,
+    const std::filesystem::path& basis, const std::filesystem::path& signature, Digest* checksum)
+{
+    FileDescriptor in(open(from.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat source;
+    if (in == -1 || fstat(in, &source) != 0)
+    {
+        fail("Failed to open", from);
+    }
+    FileDescriptor old(open(basis.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat basisStatus;
+    if (old == -1 || fstat(old, &basisStatus) != 0)
+    {
+        fail("Failed to open", basis);
+    }
+    FileSignature previous = loadSignature(signature, basisStatus, block);
+    if (previous.blocks.empty() && basisStatus.st_size > 0)
+    {
+        previous = computeSignature(old, basis, basisStatus, block, throttle);
+    }
+    previous.blockSize = block;
+    BlockIndex index(previous);
+
+    FileDescriptor out(open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    struct stat target;
+    if (out == -1 || fstat(out, &target) != 0)
+    {
+        fail("Failed to create", to);
+    }
+    DeltaWriter writer(old, out, to, target.st_blksize, throttle);
+
+    // The buffer holds the window [position, position + block) and everything
+    // after `kept` which is neither written nor signed yet
+    std::vector<unsigned char> buffer(std::max(bufferSize, 4 * block));
+    uint64_t start = 0;      // Offset of buffer[0] in the new version
+    size_t filled = 0;
+    bool eof = false;
+    uint64_t position = 0;
+    uint64_t literalStart = 0;
+    uint64_t signedEnd = 0;
+    uint64_t expected = 0;
+    RollingChecksum rolling;
+    bool rollingValid = false;
+    DigestBuilder digest;
+    FileSignature current;
+    current.blockSize = block;
+
+    while (true)
+    {
+        if (!eof && position + block > start + filled)
+        {
+            writer.literal(buffer.data() + (literalStart - start), position - literalStart, literalStart);
+            literalStart = position;
+            // The next cycle gets the signature of this version without reading it again
+            while (signedEnd + block <= start + filled)
+            {
+                current.blocks.push_back(signBlock(buffer.data() + (signedEnd - start), block));
+                signedEnd += block;
+            }
+            uint64_t kept = std::min(position, signedEnd);
+            std::memmove(buffer.data(), buffer.data() + (kept - start), start + filled - kept);
+            filled -= kept - start;
+            start = kept;
+
+            ssize_t count = read(in, buffer.data() + filled, buffer.size() - filled);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                fail("Failed to read", from);
+            }
+            eof = count == 0;
+            if (checksum != nullptr)
+            {
+                digest.put(reinterpret_cast<const char*>(buffer.data() + filled), count);
+            }
+            filled += count;
+            if (throttle != nullptr)
+            {
+                throttle->consume(count);
+            }
+            continue;
+        }
+        // Less than a block is left, it is new data
+        if (position + block > start + filled)
+        {
+            break;
+        }
+
+        const unsigned char* window = buffer.data() + (position - start);
+        if (!rollingValid)
+        {
+            rolling.reset(window, block);
+            rollingValid = true;
+        }
+        uint32_t found = index.find(rolling.value(), window, block, expected);
+        if (found != noBlock)
+        {
+            writer.literal(buffer.data() + (literalStart - start), position - literalStart, literalStart);
+            writer.match(static_cast<uint64_t>(found) * block, position, block);
+            position += block;
+            literalStart = position;
+            expected = found + 1;
+            rollingValid = false;
+            continue;
+        }
+
+        // No block starts here, the window moves on by one byte
+        if (position + block < start + filled)
+        {
+            rolling.roll(window[0], window[block]);
+        }
+        else
+        {
+            rollingValid = false;
+        }
+        ++position;
+        if (position - literalStart >= literalSize)
+        {
+            writer.literal(buffer.data() + (literalStart - start), position - literalStart, literalStart);
+            literalStart = position;
+        }
+    }
+
+    uint64_t size = start + filled;
+    writer.literal(buffer.data() + (literalStart - start), size - literalStart, literalStart);
+    writer.flush();
+    for (; signedEnd < size; signedEnd += block)
+    {
+        current.blocks.push_back(signBlock(buffer.data() + (signedEnd - start), std::min<uint64_t>(block, size - signedEnd)));
+    }
+
+    if (ftruncate(out, size) != 0)
+    {
+        fail("Failed to truncate", to);
+    }
+    // open() applies the umask, the original permissions are restored here
+    if (fchmod(out, source.st_mode & 07777) != 0 || fstat(out, &target) != 0)
+    {
+        fail("Failed to set permissions", to);
+    }
+    current.inode = target.st_ino;
+    current.size = size;
+    current.mtime = mtimeOf(target);
+    saveSignature(signature, current);
+    if (checksum != nullptr)
+    {
+        *checksum = digest.finish();
+    }
+    return writer.total();
+}
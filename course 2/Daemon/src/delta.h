@@ -0,0 +1,44 @@
+#ifndef BACKUP_DELTA_H
+#define BACKUP_DELTA_H
+
+#include "digest.h"
+#include "throttle.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+// rsync-style copy of a large file which changed in place, e.g. a database
+// or a VM image. Its older copy in the previous snapshot (the basis) is
+// described by the weak rolling checksum and the SHA-1 of every block; the
+// new version is read once with a rolling window, blocks found in the basis
+// are cloned or copied from it in the kernel and only the rest is written.
+// The block signatures of every file are cached, so the basis is read only
+// if the cache does not describe it:
+//   header  "BKS1", u32 block size, u64 inode, u64 size, i64 mtime of the copy, u64 block count
+//   blocks  u32 weak checksum, 20 bytes SHA-1 - one per block, the last one may be short
+class DeltaCopier
+{
+public:
+    struct Result
+    {
+        uint64_t matched = 0;  // Bytes cloned or copied from the basis
+        uint64_t literal = 0;  // Bytes written from the new version
+    };
+
+    DeltaCopier(size_t blockSize, Throttle* throttle = nullptr);
+
+    // Writes `to` from `from` with the data and the permissions of `from`.
+    // `signature` is the cache file of the path, it is replaced by the
+    // signature of the new copy for the next cycle.
+    Result copy(const std::filesystem::path& from, const std::filesystem::path& to, const std::filesystem::path& basis,
+        const std::filesystem::path& signature, Digest* checksum = nullptr);
+
+    size_t blockSize() const { return block; }
+
+private:
+    size_t block;
+    Throttle* throttle;
+};
+
+#endif
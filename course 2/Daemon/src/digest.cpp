@@ -0,0 +1,97 @@
+#include "digest.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+    const size_t bufferSize = 1 << 20;
+}
+
+size_t DigestHash::operator()(const Digest& digest) const
+{
+    // The digest is already uniformly distributed
+    size_t value;
+    std::memcpy(&value, digest.data(), sizeof(value));
+    return value;
+}
+
+Digest computeDigest(const unsigned char* data, size_t size)
+{
+    DigestBuilder builder;
+    builder.put(reinterpret_cast<const char*>(data), size);
+    return builder.finish();
+}
+
+std::string toHex(const Digest& digest)
+{
+    static const char* const digits = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(digest.size() * 2);
+    for (unsigned char byte : digest)
+    {
+        hex += digits[byte >> 4];
+        hex += digits[byte & 15];
+    }
+    return hex;
+}
+
+Digest fromHex(const std::string& hex)
+{
+    Digest digest;
+    if (hex.size() != digest.size() * 2)
+    {
+        throw std::runtime_error("Bad digest " + hex);
+    }
+    for (size_t i = 0; i < digest.size(); ++i)
+    {
+        digest[i] = std::stoi(hex.substr(i * 2, 2), nullptr, 16);
+    }
+    return digest;
+}
+
+Digest DigestBuilder::finish()
+{
+    sha.compute();
+
+    // Words are kept in host order, the digest is written big-endian like sha1sum does
+    Digest digest;
+    const sys::u32* words = sha.digest();
+    for (int i = 0; i < sys::sha1::digest_length(); ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            digest[i * 4 + j] = words[i] >> (24 - j * 8);
+        }
+    }
+    return digest;
+}
+
+Digest digestFile(int fd, const std::filesystem::path& path)
+{
+    thread_local std::vector<char> buffer(bufferSize);
+    DigestBuilder builder;
+    off_t offset = 0;
+    while (true)
+    {
+        ssize_t count = pread(fd, buffer.data(), buffer.size(), offset);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw std::filesystem::filesystem_error("Failed to read", path, std::error_code(errno, std::generic_category()));
+        }
+        if (count == 0)
+        {
+            return builder.finish();
+        }
+        builder.put(buffer.data(), count);
+        offset += count;
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef BACKUP_DIGEST_H
+#define BACKUP_DIGEST_H
+
+#include <unistdx/sha1.hh>
+
+#include <array>
+#include <cstddef>
+#include <filesystem>
+#include <string>
+
+// SHA-1 of chunk or file data, all zero if it was not computed
+using Digest = std::array<unsigned char, 20>;
+
+struct DigestHash
+{
+    size_t operator()(const Digest& digest) const;
+};
+
+Digest computeDigest(const unsigned char* data, size_t size);
+std::string toHex(const Digest& digest);
+Digest fromHex(const std::string& hex);
+
+// Digest of data which arrives piece by piece, e.g. a file while it is copied
+class DigestBuilder
+{
+public:
+    void put(const char* data, size_t size) { sha.put(data, size); }
+    Digest finish();
+
+private:
+    sys::sha1 sha;
+};
+
+// Reads the whole file from the start, the offset of `fd` is not changed
+Digest digestFile(int fd, const std::filesystem::path& path);
+
+#endif
@@ -0,0 +1,247 @@
+#include "fanout.h"
+
+#include "file_copy.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace
+{
+    [[noreturn]] void fail(const std::string& message, const std::filesystem::path& path)
+    {
+        throw std::filesystem::filesystem_error(message, path, std::error_code(errno, std::generic_category()));
+    }
+
+    // Holes read as zeros, the checksum of a sparse copy includes them
+    void putZeros(DigestBuilder& digest, uint64_t size)
+    {
+        static const std::vector<char> zeros(1 << 16);
+        while (size > 0)
+        {
+            size_t count = std::min<uint64_t>(size, zeros.size());
+            digest.put(zeros.data(), count);
+            size -= count;
+        }
+    }
+}
+
+FanOut::FanOut(size_t destinations, Throttle* throttle, size_t blockSize, size_t queueBlocks):
+throttle(throttle),
+blockSize(blockSize)
+{
+    for (size_t i = 0; i < destinations; ++i)
+    {
+        writers.push_back(std::make_unique<Writer>(queueBlocks));
+        BoundedQueue<Block>& queue = writers.back()->queue;
+        writers.back()->thread = std::thread([this, &queue] { write(queue); });
+    }
+}
+
+FanOut::~FanOut()
+{
+    // The writers drain their queues first, so every target gets its done()
+    for (const auto& writer : writers)
+    {
+        writer->queue.close();
+    }
+    for (const auto& writer : writers)
+    {
+        writer->thread.join();
+    }
+}
+
+void FanOut::copy(const std::filesystem::path& from, std::vector<Target> targets, bool checksums)
+{
+    std::vector<std::shared_ptr<File>> files;
+    for (Target& target : targets)
+    {
+        files.push_back(std::make_shared<File>());
+        files.back()->target = std::move(target);
+    }
+
+    // Every block goes to the queue of each destination, the last one also on an error
+    auto queue = [this, &files](const std::shared_ptr<const std::vector<char>>& data, uint64_t offset, bool last)
+    {
+        for (const std::shared_ptr<File>& file : files)
+        {
+            Block block{file, data, offset, last};
+            writers[file->target.destination]->queue.push(block);
+        }
+    };
+
+    uint64_t offset = 0;
+    try
+    {
+        FileDescriptor in(open(from.c_str(), O_RDONLY | O_CLOEXEC));
+        struct stat source;
+        if (in == -1 || fstat(in, &source) != 0)
+        {
+            fail("Failed to open", from);
+        }
+        posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+        // Fewer blocks than the size says, only the data extents are read then
+        bool sparse = static_cast<uint64_t>(source.st_blocks) * 512 < static_cast<uint64_t>(source.st_size);
+        uint64_t extentEnd = sparse ? 0 : UINT64_MAX;
+        DigestBuilder digest;
+        while (true)
+        {
+            if (offset == extentEnd)
+            {
+                off_t data = lseek(in, offset, SEEK_DATA);
+                if (data < 0 && errno != ENXIO)
+                {
+                    fail("Failed to seek", from);
+                }
+                // Without data after the offset the rest up to the size is a hole
+                uint64_t next = data < 0 ? std::max<uint64_t>(offset, source.st_size) : data;
+                if (checksums)
+                {
+                    putZeros(digest, next - offset);
+                }
+                offset = next;
+                if (data < 0)
+                {
+                    break;
+                }
+                off_t hole = lseek(in, data, SEEK_HOLE);
+                if (hole < 0)
+                {
+                    fail("Failed to seek", from);
+                }
+                extentEnd = hole;
+            }
+            // A small file gets a buffer of its size, a growing one is read on until the end
+            uint64_t remaining = offset < static_cast<uint64_t>(source.st_size) ? source.st_size - offset : 0;
+            uint64_t length = std::min<uint64_t>({blockSize, std::max<uint64_t>(remaining, 4096), extentEnd - offset});
+            auto data = std::make_shared<std::vector<char>>(length);
+            size_t filled = 0;
+            while (filled < data->size())
+            {
+                ssize_t count = pread(in, data->data() + filled, data->size() - filled, offset + filled);
+                if (count < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (count < 0)
+                {
+                    fail("Failed to read", from);
+                }
+                if (count == 0)
+                {
+                    break;
+                }
+                // The bytes are charged once for all destinations, like a copy by FileCopier
+                if (throttle != nullptr)
+                {
+                    throttle->consume(count);
+                }
+                filled += count;
+            }
+            if (filled == 0)
+            {
+                break;
+            }
+            data->resize(filled);
+            if (checksums)
+            {
+                digest.put(data->data(), filled);
+            }
+            queue(data, offset, false);
+            offset += filled;
+        }
+        Digest checksum = checksums ? digest.finish() : Digest{};
+        for (const std::shared_ptr<File>& file : files)
+        {
+            file->mode = source.st_mode & 07777;
+            file->size = offset;
+            file->checksum = checksum;
+        }
+    }
+    catch (...)
+    {
+        for (const std::shared_ptr<File>& file : files)
+        {
+            file->readError = std::current_exception();
+        }
+    }
+    queue(nullptr, offset, true);
+}
+
+void FanOut::write(BoundedQueue<Block>& queue)
+{
+    Block block;
+    while (queue.pop(block))
+    {
+        // The fields set by the reader are read only with the last block
+        File& file = *block.file;
+        try
+        {
+            if (!file.error && file.fd == -1 && !(block.last && file.readError))
+            {
+                file.fd = open(file.target.to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+                if (file.fd == -1)
+                {
+                    fail("Failed to create", file.target.to);
+                }
+            }
+            if (!file.error && block.data)
+            {
+                const std::vector<char>& data = *block.data;
+                for (size_t written = 0; written < data.size();)
+                {
+                    ssize_t count = pwrite(file.fd, data.data() + written, data.size() - written, block.offset + written);
+                    if (count < 0 && errno != EINTR)
+                    {
+                        fail("Failed to write", file.target.to);
+                    }
+                    written += std::max<ssize_t>(count, 0);
+                }
+                // An operation, the bytes were charged when they were read
+                if (throttle != nullptr)
+                {
+                    throttle->consume(0);
+                }
+            }
+        }
+        catch (...)
+        {
+            file.error = std::current_exception();
+        }
+        if (block.last)
+        {
+            finish(file);
+        }
+    }
+}
+
+void FanOut::finish(File& file)
+{
+    // The size covers a hole at the end
+    try
+    {
+        if (!file.readError && !file.error && (ftruncate(file.fd, file.size) != 0 || fchmod(file.fd, file.mode) != 0))
+        {
+            fail("Failed to write", file.target.to);
+        }
+    }
+    catch (...)
+    {
+        file.error = std::current_exception();
+    }
+    if (file.fd != -1 && close(file.fd) != 0 && !file.error && !file.readError)
+    {
+        file.error = std::make_exception_ptr(std::filesystem::filesystem_error("Failed to write", file.target.to,
+            std::error_code(errno, std::generic_category())));
+    }
+    file.fd = -1;
+    std::exception_ptr error = file.readError ? file.readError : file.error;
+    if (error)
+    {
+        unlink(file.target.to.c_str());
+    }
+    file.target.done(file.size, file.checksum, error);
+}
@@ -0,0 +1,85 @@
+#ifndef BACKUP_FANOUT_H
+#define BACKUP_FANOUT_H
+
+#include "digest.h"
+#include "pipeline.h"
+#include "throttle.h"
+
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Copies regular files into several destinations while reading each one
+// once. Every block of the source is read into a buffer shared by all its
+// copies and queued for the writer thread of each destination, which writes
+// the blocks of a file in order. A slow destination holds back the reader,
+// and with it the others, only when its queue of `queueBlocks` blocks is
+// full, so the buffers never take more than destinations * queueBlocks *
+// blockSize bytes.
+class FanOut
+{
+public:
+    // One copy of the source. `done` is called on the writer thread of the
+    // destination when the copy is complete or failed.
+    struct Target
+    {
+        size_t destination;
+        std::filesystem::path to;
+        std::function<void(uint64_t bytes, const Digest& checksum, std::exception_ptr error)> done;
+    };
+
+    FanOut(size_t destinations, Throttle* throttle = nullptr, size_t blockSize = 1 << 20, size_t queueBlocks = 16);
+    ~FanOut();
+
+    FanOut(const FanOut&) = delete;
+    FanOut& operator=(const FanOut&) = delete;
+
+    // Reads `from` once for all targets and returns when its last block is
+    // queued. The copies get the permissions of the source, the holes of a
+    // sparse source stay holes. With `checksums` the data is hashed on
+    // the way. A source which can not be read fails every target.
+    void copy(const std::filesystem::path& from, std::vector<Target> targets, bool checksums);
+
+private:
+    // One copy while it is written. The reader sets the fields up to
+    // readError before it queues the last block, the writer the rest.
+    struct File
+    {
+        Target target;
+        uint32_t mode = 0;
+        uint64_t size = 0;
+        Digest checksum{};
+        std::exception_ptr readError;
+        std::exception_ptr error;
+        int fd = -1;
+    };
+
+    struct Block
+    {
+        std::shared_ptr<File> file;
+        std::shared_ptr<const std::vector<char>> data;
+        uint64_t offset = 0;
+        bool last = false;
+    };
+
+    struct Writer
+    {
+        explicit Writer(size_t capacity): queue(capacity) {}
+
+        BoundedQueue<Block> queue;
+        std::thread thread;
+    };
+
+    void write(BoundedQueue<Block>& queue);
+    void finish(File& file);
+
+    Throttle* throttle;
+    size_t blockSize;
+    std::vector<std::unique_ptr<Writer>> writers;
+};
+
+#endif
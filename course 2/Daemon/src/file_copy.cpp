@@ -0,0 +1,380 @@
+#include "file_copy.h"
+
+#include "cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <limits>
+#include <linux/fs.h>
+#include <stdexcept>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+    // Smaller files are not worth an extra syscall
+    const uint64_t preallocateSize = 1 << 20;
+    const size_t chunkSize = 1 << 30;
+    const size_t bufferSize = 1 << 20;
+
+    // Errors which mean "try the next method", anything else is a real failure
+    bool isUnsupported(int error)
+    {
+        return error == EXDEV || error == EINVAL || error == EOPNOTSUPP || error == ENOSYS
+            || error == ENOTTY || error == EBADF;
+    }
+
+    // Holes read as zeros, the checksum of a sparse copy includes them
+    void putZeros(DigestBuilder& digest, uint64_t size)
+    {
+        static const std::vector<char> zeros(bufferSize);
+        while (size > 0)
+        {
+            size_t count = std::min<uint64_t>(size, zeros.size());
+            digest.put(zeros.data(), count);
+            size -= count;
+        }
+    }
+
+    [[noreturn]] void fail(const std::string& message, const std::filesystem::path& path)
+    {
+        throw std::filesystem::filesystem_error(message, path, std::error_code(errno, std::generic_category()));
+    }
+}
+
+const char* methodName(CopyMethod method)
+{
+    switch (method)
+    {
+        case CopyMethod::Reflink: return "reflink";
+        case CopyMethod::CopyFileRange: return "copy_file_range";
+        case CopyMethod::Sendfile: return "sendfile";
+        case CopyMethod::ReadWrite: return "readwrite";
+    }
+    return "unknown";
+}
+
+CopyMethod parseMethod(const std::string& name)
+{
+    for (CopyMethod method : {CopyMethod::Reflink, CopyMethod::CopyFileRange, CopyMethod::Sendfile, CopyMethod::ReadWrite})
+    {
+        if (name == methodName(method))
+        {
+            return method;
+        }
+    }
+    if (name.empty() || name == "auto")
+    {
+        return CopyMethod::Reflink;
+    }
+    throw std::runtime_error("Unknown copy method " + name);
+}
+
+FileCopier::FileCopier(CopyMethod first, Throttle* throttle):
+first(first),
+throttle(throttle)
+{
+}
+
+bool FileCopier::tryCopy(CopyMethod method, int in, int out, uint64_t offset, uint64_t length, uint64_t& copied,
+    DigestBuilder* digest)
+{
+    copied = 0;
+    size_t chunk = throttle != nullptr ? throttle->chunkSize(chunkSize) : chunkSize;
+    switch (method)
+    {
+        case CopyMethod::Reflink:
+        {
+            // The whole file, holes included
+            struct stat source;
+            if (ioctl(out, FICLONE, in) != 0)
+            {
+                if (isUnsupported(errno))
+                {
+                    return false;
+                }
+                throw std::system_error(errno, std::generic_category(), "FICLONE");
+            }
+            if (fstat(in, &source) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "fstat");
+            }
+            copied = source.st_size;
+            if (throttle != nullptr)
+            {
+                throttle->consume(0);
+            }
+            return true;
+        }
+
+        case CopyMethod::CopyFileRange:
+        {
+            loff_t inOffset = offset;
+            loff_t outOffset = offset;
+            while (copied < length)
+            {
+                ssize_t count = copy_file_range(in, &inOffset, out, &outOffset, std::min<uint64_t>(chunk, length - copied), 0);
+                if (count < 0)
+                {
+                    if (copied == 0 && isUnsupported(errno))
+                    {
+                        return false;
+                    }
+                    throw std::system_error(errno, std::generic_category(), "copy_file_range");
+                }
+                if (count == 0)
+                {
+                    break;
+                }
+                copied += count;
+                if (throttle != nullptr)
+                {
+                    throttle->consume(count);
+                }
+            }
+            return true;
+        }
+
+        case CopyMethod::Sendfile:
+        {
+            // sendfile() writes at the offset of the output
+            off_t inOffset = offset;
+            if (lseek(out, offset, SEEK_SET) < 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "lseek");
+            }
+            while (copied < length)
+            {
+                ssize_t count = sendfile(out, in, &inOffset, std::min<uint64_t>(chunk, length - copied));
+                if (count < 0)
+                {
+                    if (copied == 0 && isUnsupported(errno))
+                    {
+                        return false;
+                    }
+                    throw std::system_error(errno, std::generic_category(), "sendfile");
+                }
+                if (count == 0)
+                {
+                    break;
+                }
+                copied += count;
+                if (throttle != nullptr)
+                {
+                    throttle->consume(count);
+                }
+            }
+            return true;
+        }
+
+        case CopyMethod::ReadWrite:
+        {
+            thread_local std::vector<char> buffer(bufferSize);
+            while (copied < length)
+            {
+                ssize_t count = pread(in, buffer.data(), std::min<uint64_t>({buffer.size(), chunk, length - copied}),
+                    offset + copied);
+                if (count < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    throw std::system_error(errno, std::generic_category(), "read");
+                }
+                if (count == 0)
+                {
+                    break;
+                }
+                if (digest != nullptr)
+                {
+                    digest->put(buffer.data(), count);
+                }
+                for (ssize_t done = 0; done < count;)
+                {
+                    ssize_t written = pwrite(out, buffer.data() + done, count - done, offset + copied + done);
+                    if (written < 0)
+                    {
+                        if (errno == EINTR)
+                        {
+                            continue;
+                        }
+                        throw std::system_error(errno, std::generic_category(), "write");
+                    }
+                    done += written;
+                }
+                copied += count;
+                if (throttle != nullptr)
+                {
+                    throttle->consume(count, 2);
+                }
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+bool FileCopier::tryCopyExtents(CopyMethod method, int in, int out, uint64_t& copied, uint64_t& length,
+    DigestBuilder* digest)
+{
+    copied = 0;
+    uint64_t end = 0;
+    while (true)
+    {
+        off_t data = lseek(in, end, SEEK_DATA);
+        if (data < 0)
+        {
+            // No data after the offset
+            if (errno == ENXIO)
+            {
+                break;
+            }
+            throw std::system_error(errno, std::generic_category(), "SEEK_DATA");
+        }
+        off_t hole = lseek(in, data, SEEK_HOLE);
+        if (hole < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "SEEK_HOLE");
+        }
+        if (digest != nullptr)
+        {
+            putZeros(*digest, data - end);
+        }
+        uint64_t count;
+        if (!tryCopy(method, in, out, data, hole - data, count, digest))
+        {
+            return false;
+        }
+        copied += count;
+        end = data + count;
+        // The source shrank while it was copied
+        if (count < static_cast<uint64_t>(hole - data))
+        {
+            length = end;
+            return true;
+        }
+    }
+
+    // A hole at the end has no extent to write, the size makes it
+    off_t size = lseek(in, 0, SEEK_END);
+    if (size < 0)
+    {
+        throw std::system_error(errno, std::generic_category(), "lseek");
+    }
+    length = std::max<uint64_t>(end, size);
+    if (digest != nullptr)
+    {
+        putZeros(*digest, length - end);
+    }
+    if (ftruncate(out, length) != 0)
+    {
+        throw std::system_error(errno, std::generic_category(), "ftruncate");
+    }
+    return true;
+}
+
+uint64_t FileCopier::copy(const std::filesystem::path& from, const std::filesystem::path& to, Digest* checksum)
+{
+    FileDescriptor in(open(from.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat source;
+    if (in == -1 || fstat(in, &source) != 0)
+    {
+        fail("Failed to open", from);
+    }
+    // The copy is read back for the checksum unless the data goes through the buffer
+    FileDescriptor out(open(to.c_str(), (checksum != nullptr ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+    struct stat target;
+    if (out == -1 || fstat(out, &target) != 0)
+    {
+        fail("Failed to create", to);
+    }
+    PageCacheGuard inCache(in, cacheNeutral);
+    PageCacheGuard outCache(out, cacheNeutral, true);
+
+    auto devices = std::make_pair(source.st_dev, target.st_dev);
+    CopyMethod method = first;
+    bool probing = true;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = methods.find(devices);
+        if (found != methods.end())
+        {
+            method = found->second;
+            probing = false;
+        }
+    }
+
+    // Fewer blocks than the size needs, e.g. a thin VM image: its holes are
+    // skipped and not written as zeros
+    uint64_t size = source.st_size;
+    bool sparse = static_cast<uint64_t>(source.st_blocks) * 512 < size;
+
+    // Reserve the space at once when the data is really written, not shared
+    bool shared = method == CopyMethod::Reflink || (method == CopyMethod::CopyFileRange && source.st_dev == target.st_dev);
+    if (!shared && !sparse && size >= preallocateSize)
+    {
+        fallocate(out, 0, 0, size);
+    }
+
+    uint64_t copied = 0;
+    uint64_t length = 0;
+    DigestBuilder digest;
+    try
+    {
+        while (true)
+        {
+            // Only read/write sees the data, a failed probe must not leave anything in the digest
+            DigestBuilder* hashed = checksum != nullptr && method == CopyMethod::ReadWrite ? &digest : nullptr;
+            bool extents = sparse && method != CopyMethod::Reflink;
+            if (extents ? tryCopyExtents(method, in, out, copied, length, hashed)
+                : tryCopy(method, in, out, 0, std::numeric_limits<uint64_t>::max(), copied, hashed))
+            {
+                length = extents ? length : copied;
+                break;
+            }
+            if (method == CopyMethod::ReadWrite)
+            {
+                throw std::system_error(errno, std::generic_category(), "Unsupported file");
+            }
+            method = static_cast<CopyMethod>(static_cast<int>(method) + 1);
+            probing = true;
+        }
+    }
+    catch (const std::system_error& error)
+    {
+        throw std::filesystem::filesystem_error(std::string("Failed to copy: ") + error.what(), from, to, error.code());
+    }
+
+    if (probing)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        methods[devices] = method;
+        syslog(LOG_INFO, "Using %s to copy from device %lu to %lu", methodName(method),
+            static_cast<unsigned long>(source.st_dev), static_cast<unsigned long>(target.st_dev));
+    }
+
+    // The source shrank while it was copied
+    if (length < size && ftruncate(out, length) != 0)
+    {
+        fail("Failed to truncate", to);
+    }
+
+    if (checksum != nullptr)
+    {
+        *checksum = method == CopyMethod::ReadWrite ? digest.finish() : digestFile(out, to);
+    }
+
+    // open() applies the umask, the original permissions are restored here
+    if (fchmod(out, source.st_mode & 07777) != 0)
+    {
+        fail("Failed to set permissions", to);
+    }
+    return copied;
+}
@@ -0,0 +1,76 @@
+#ifndef BACKUP_FILE_COPY_H
+#define BACKUP_FILE_COPY_H
+
+#include "digest.h"
+#include "throttle.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <unistd.h>
+
+// From the cheapest to the most expensive one
+enum class CopyMethod
+{
+    Reflink,        // FICLONE, the data is shared by a CoW filesystem
+    CopyFileRange,  // In-kernel copy, may be offloaded by the filesystem
+    Sendfile,       // In-kernel copy through the page cache
+    ReadWrite       // Plain copy through a user space buffer
+};
+
+// Closes the descriptor when it goes out of scope
+class FileDescriptor
+{
+public:
+    explicit FileDescriptor(int fd): fd(fd) {}
+    ~FileDescriptor() { if (fd != -1) close(fd); }
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+    operator int() const { return fd; }
+
+private:
+    int fd;
+};
+
+const char* methodName(CopyMethod method);
+CopyMethod parseMethod(const std::string& name);
+
+// Copies regular files with the cheapest primitive which works between
+// the source and the destination filesystem. The primitive is probed on
+// the first copy between a pair of devices and cached for the next ones.
+class FileCopier
+{
+public:
+    // The probing starts from the given method, e.g. to skip reflinks
+    explicit FileCopier(CopyMethod first = CopyMethod::Reflink, Throttle* throttle = nullptr);
+
+    // Copies the data and the permissions, returns the number of bytes copied.
+    // With `checksum` the data is hashed in the buffer of read/write; the
+    // in-kernel methods do not bring it to user space, so the copy is read back.
+    // Of a sparse file only the data extents are copied, the holes stay holes.
+    uint64_t copy(const std::filesystem::path& from, const std::filesystem::path& to, Digest* checksum = nullptr);
+
+    // Drop the pages of copied files from the page cache, see PageCacheGuard
+    void setCacheNeutral(bool enabled) { cacheNeutral = enabled; }
+
+private:
+    // Copies `length` bytes at `offset` with the method, or less at the end of
+    // the file, false if the method is not supported for these files
+    bool tryCopy(CopyMethod method, int in, int out, uint64_t offset, uint64_t length, uint64_t& copied,
+        DigestBuilder* digest);
+
+    // Copies the extents found with SEEK_DATA / SEEK_HOLE one by one and sets
+    // the size of the copy to `length`, the end of the source with its holes
+    bool tryCopyExtents(CopyMethod method, int in, int out, uint64_t& copied, uint64_t& length, DigestBuilder* digest);
+
+    CopyMethod first;
+    Throttle* throttle;
+    bool cacheNeutral = false;
+    std::mutex mutex;
+    std::map<std::pair<dev_t, dev_t>, CopyMethod> methods;
+};
+
+#endif
@@ -0,0 +1,468 @@
+#include "filter.h"
+
+#include <algorithm>
+#include <bitset>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+
+namespace
+{
+    // What a pattern does to the entries it matches
+    const uint8_t excludeAny = 1;
+    const uint8_t excludeDirectory = 2;
+    const uint8_t includeAny = 4;
+    const uint8_t includeDirectory = 8;
+
+    // Subset construction can blow up on pathological globs
+    const size_t maxStates = 1 << 16;
+
+    using ByteSet = std::bitset<256>;
+
+    struct NfaState
+    {
+        std::vector<std::pair<size_t, size_t>> edges;  // Byte set, target
+        std::vector<size_t> epsilon;
+        uint8_t match = 0;
+    };
+
+    class Nfa
+    {
+    public:
+        Nfa()
+        {
+            add();
+            notSlash.set();
+            notSlash.reset('/');
+        }
+
+        size_t add()
+        {
+            states.emplace_back();
+            return states.size() - 1;
+        }
+
+        void edge(size_t from, const ByteSet& bytes, size_t to)
+        {
+            auto it = std::find(sets.begin(), sets.end(), bytes);
+            states[from].edges.emplace_back(it - sets.begin(), to);
+            if (it == sets.end())
+            {
+                sets.push_back(bytes);
+            }
+        }
+
+        void literal(size_t from, unsigned char byte, size_t to)
+        {
+            ByteSet bytes;
+            bytes.set(byte);
+            edge(from, bytes, to);
+        }
+
+        // Glob matched against the whole input, see PathFilter
+        void addGlob(const std::string& glob, uint8_t match)
+        {
+            size_t current = add();
+            states[0].epsilon.push_back(current);
+            for (size_t i = 0; i < glob.size();)
+            {
+                if (glob.compare(i, 3, "**/") == 0)
+                {
+                    // Any number of whole directories, none included
+                    size_t loop = add();
+                    size_t next = add();
+                    states[current].epsilon.push_back(loop);
+                    states[current].epsilon.push_back(next);
+                    edge(loop, ByteSet().set(), loop);
+                    literal(loop, '/', next);
+                    current = next;
+                    i += 3;
+                }
+                else if (glob.compare(i, 2, "**") == 0)
+                {
+                    size_t loop = add();
+                    states[current].epsilon.push_back(loop);
+                    edge(loop, ByteSet().set(), loop);
+                    current = loop;
+                    i += 2;
+                }
+                else if (glob[i] == '*')
+                {
+                    size_t loop = add();
+                    states[current].epsilon.push_back(loop);
+                    edge(loop, notSlash, loop);
+                    current = loop;
+                    ++i;
+                }
+                else
+                {
+                    ByteSet bytes;
+                    i = parseAtom(glob, i, bytes);
+                    size_t next = add();
+                    edge(current, bytes, next);
+                    current = next;
+                }
+            }
+            states[current].match |= match;
+        }
+
+        std::vector<NfaState> states;
+        std::vector<ByteSet> sets;
+
+    private:
+        // One character, '?' or a class starting at i, returns the index after it
+        size_t parseAtom(const std::string& glob, size_t i, ByteSet& bytes) const
+        {
+            if (glob[i] == '?')
+            {
+                bytes = notSlash;
+                return i + 1;
+            }
+            if (glob[i] == '\\' && i + 1 < glob.size())
+            {
+                bytes.set(static_cast<unsigned char>(glob[i + 1]));
+                return i + 2;
+            }
+            if (glob[i] == '[')
+            {
+                size_t j = i + 1;
+                bool negated = j < glob.size() && (glob[j] == '!' || glob[j] == '^');
+                if (negated)
+                {
+                    ++j;
+                }
+                ByteSet members;
+                // A ']' right after the bracket belongs to the class
+                for (bool first = true; j < glob.size() && (first || glob[j] != ']'); first = false)
+                {
+                    unsigned char low = glob[j];
+                    if (low == '\\' && j + 1 < glob.size())
+                    {
+                        low = glob[++j];
+                    }
+                    unsigned char high = low;
+                    if (j + 2 < glob.size() && glob[j + 1] == '-' && glob[j + 2] != ']')
+                    {
+                        high = glob[j + 2];
+                        j += 2;
+                    }
+                    for (unsigned int c = low; c <= high; ++c)
+                    {
+                        members.set(c);
+                    }
+                    ++j;
+                }
+                // Unterminated, the bracket is an ordinary character like in fnmatch()
+                if (j < glob.size())
+                {
+                    bytes = (negated ? ~members : members) & notSlash;
+                    return j + 1;
+                }
+            }
+            bytes.set(static_cast<unsigned char>(glob[i]));
+            return i + 1;
+        }
+
+        ByteSet notSlash;
+    };
+
+    // The text of a glob without wildcards, false if it has one
+    bool plainText(const std::string& glob, std::string& text)
+    {
+        text.clear();
+        for (size_t i = 0; i < glob.size(); ++i)
+        {
+            if (glob[i] == '*' || glob[i] == '?' || glob[i] == '[')
+            {
+                return false;
+            }
+            if (glob[i] == '\\' && i + 1 < glob.size())
+            {
+                ++i;
+            }
+            text += glob[i];
+        }
+        return true;
+    }
+
+    // FNV-1a from the last byte back, so every suffix of a name is hashed in one pass
+    uint64_t hashStep(uint64_t hash, unsigned char byte)
+    {
+        return (hash ^ byte) * 1099511628211ULL;
+    }
+
+    const uint64_t hashStart = 14695981039346656037ULL;
+
+    std::vector<size_t> closure(std::vector<size_t> set, const std::vector<NfaState>& states)
+    {
+        for (size_t i = 0; i < set.size(); ++i)
+        {
+            for (size_t next : states[set[i]].epsilon)
+            {
+                if (std::find(set.begin(), set.end(), next) == set.end())
+                {
+                    set.push_back(next);
+                }
+            }
+        }
+        std::sort(set.begin(), set.end());
+        return set;
+    }
+
+    bool skipped(uint8_t match, bool directory)
+    {
+        bool excluded = (match & excludeAny) || (directory && (match & excludeDirectory));
+        bool included = (match & includeAny) || (directory && (match & includeDirectory));
+        return excluded && !included;
+    }
+}
+
+GlobAutomaton::GlobAutomaton(const std::vector<std::pair<std::string, uint8_t>>& globs)
+{
+    if (globs.empty())
+    {
+        return;
+    }
+    Nfa nfa;
+    for (const auto& glob : globs)
+    {
+        nfa.addGlob(glob.first, glob.second);
+    }
+
+    for (const ByteSet& set : nfa.sets)
+    {
+        std::map<std::pair<uint8_t, bool>, uint8_t> split;
+        for (int c = 0; c < 256; ++c)
+        {
+            auto key = std::make_pair(classOf[c], static_cast<bool>(set[c]));
+            auto it = split.emplace(key, static_cast<uint8_t>(split.size())).first;
+            classOf[c] = it->second;
+        }
+    }
+    classes = *std::max_element(classOf, classOf + 256) + 1;
+    std::vector<unsigned char> representative(classes);
+    for (int c = 255; c >= 0; --c)
+    {
+        representative[classOf[c]] = c;
+    }
+
+    // Subset construction, state 0 is the empty set
+    std::map<std::vector<size_t>, uint32_t> ids = {{{}, 0}};
+    std::vector<std::vector<size_t>> sets = {{}};
+    transitions.assign(classes, 0);
+    accept.assign(1, 0);
+    auto stateOf = [&](std::vector<size_t> set)
+    {
+        auto it = ids.find(set);
+        if (it != ids.end())
+        {
+            return it->second;
+        }
+        if (sets.size() >= maxStates)
+        {
+            throw std::runtime_error("The [filter] patterns are too complex, more than "
+                + std::to_string(maxStates) + " states");
+        }
+        uint32_t id = sets.size();
+        ids.emplace(set, id);
+        uint8_t match = 0;
+        for (size_t nfaState : set)
+        {
+            match |= nfa.states[nfaState].match;
+        }
+        accept.push_back(match);
+        transitions.resize(transitions.size() + classes, 0);
+        sets.push_back(std::move(set));
+        return id;
+    };
+    start = stateOf(closure({0}, nfa.states));
+    for (uint32_t state = 1; state < sets.size(); ++state)
+    {
+        for (size_t column = 0; column < classes; ++column)
+        {
+            unsigned char byte = representative[column];
+            std::vector<size_t> next;
+            for (size_t nfaState : sets[state])
+            {
+                for (const auto& edge : nfa.states[nfaState].edges)
+                {
+                    if (nfa.sets[edge.first][byte] && std::find(next.begin(), next.end(), edge.second) == next.end())
+                    {
+                        next.push_back(edge.second);
+                    }
+                }
+            }
+            uint32_t target = stateOf(closure(std::move(next), nfa.states));
+            transitions[state * classes + column] = target;
+        }
+    }
+}
+
+PathFilter::PathFilter(const std::vector<std::string>& include, const std::vector<std::string>& exclude)
+{
+    std::vector<std::pair<std::string, uint8_t>> nameGlobs;
+    std::vector<std::pair<std::string, uint8_t>> pathGlobs;
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        for (std::string pattern : pass == 0 ? exclude : include)
+        {
+            bool directoryOnly = pattern.size() > 1 && pattern.back() == '/';
+            if (directoryOnly)
+            {
+                pattern.pop_back();
+            }
+            uint8_t match = pass == 0 ? (directoryOnly ? excludeDirectory : excludeAny)
+                : (directoryOnly ? includeDirectory : includeAny);
+            if (pattern.find('/') != std::string::npos)
+            {
+                pattern.erase(0, pattern.find_first_not_of('/'));
+                pathGlobs.emplace_back(pattern, match);
+                continue;
+            }
+
+            std::string text;
+            if (plainText(pattern, text))
+            {
+                addLiteral(text, match, true);
+            }
+            else if (pattern.size() > 1 && pattern[0] == '*' && pattern[1] != '*' && plainText(pattern.substr(1), text))
+            {
+                addLiteral(text, match, false);
+            }
+            else
+            {
+                nameGlobs.emplace_back(pattern, match);
+            }
+        }
+    }
+    names = GlobAutomaton(nameGlobs);
+    paths = GlobAutomaton(pathGlobs);
+}
+
+void PathFilter::addLiteral(const std::string& text, uint8_t match, bool whole)
+{
+    uint64_t hash = hashStart;
+    for (size_t i = text.size(); i > 0; --i)
+    {
+        hash = hashStep(hash, text[i - 1]);
+    }
+    literals.push_back({text, match, whole});
+    suffixes[hash].push_back(literals.size() - 1);
+    longest = std::max(longest, text.size());
+}
+
+uint8_t PathFilter::matches(State state, const char* name) const
+{
+    size_t length = std::strlen(name);
+    uint8_t match = 0;
+    if (!literals.empty())
+    {
+        uint64_t hash = hashStart;
+        for (size_t size = 1; size <= std::min(length, longest); ++size)
+        {
+            hash = hashStep(hash, name[length - size]);
+            auto it = suffixes.find(hash);
+            if (it == suffixes.end())
+            {
+                continue;
+            }
+            for (size_t index : it->second)
+            {
+                const Literal& literal = literals[index];
+                if (literal.text.size() == size && (!literal.whole || size == length)
+                    && literal.text.compare(0, size, name + length - size) == 0)
+                {
+                    match |= literal.match;
+                }
+            }
+        }
+    }
+    // A name glob matches from the start of the name, a path glob goes on from the directory
+    uint32_t inName = names.start;
+    for (size_t i = 0; i < length && (state != 0 || inName != 0); ++i)
+    {
+        unsigned char byte = name[i];
+        state = paths.step(state, byte);
+        inName = names.step(inName, byte);
+    }
+    return match | paths.accept[state] | names.accept[inName];
+}
+
+PathFilter::State PathFilter::enter(State state, const char* name) const
+{
+    for (; *name != '\0' && state != 0; ++name)
+    {
+        state = paths.step(state, *name);
+    }
+    return paths.step(state, '/');
+}
+
+PathFilter::State PathFilter::below(const std::string& directory) const
+{
+    State state = paths.start;
+    for (size_t first = 0; first < directory.size() && state != 0;)
+    {
+        size_t slash = std::min(directory.find('/', first), directory.size());
+        state = enter(state, directory.substr(first, slash - first).c_str());
+        first = slash + 1;
+    }
+    return state;
+}
+
+bool PathFilter::excluded(State state, const char* name, bool directory) const
+{
+    return skipped(matches(state, name), directory);
+}
+
+bool PathFilter::excluded(const std::string& path, bool directory) const
+{
+    if (empty())
+    {
+        return false;
+    }
+    State state = paths.start;
+    for (size_t first = 0; first < path.size();)
+    {
+        size_t slash = std::min(path.find('/', first), path.size());
+        std::string name = path.substr(first, slash - first);
+        bool last = slash == path.size();
+        if (excluded(state, name.c_str(), last ? directory : true))
+        {
+            return true;
+        }
+        state = enter(state, name.c_str());
+        first = slash + 1;
+    }
+    return false;
+}
+
+PathFilter readFilter(const mINI::INIStructure& ini)
+{
+    return PathFilter(splitList(ini.get("filter").get("include")), splitList(ini.get("filter").get("exclude")));
+}
+
+std::vector<std::string> splitList(const std::string& list)
+{
+    std::vector<std::string> items;
+    std::string item;
+    for (size_t i = 0; i <= list.size(); ++i)
+    {
+        if (i == list.size() || list[i] == ',')
+        {
+            size_t first = item.find_first_not_of(" \t");
+            size_t last = item.find_last_not_of(" \t");
+            if (first != std::string::npos)
+            {
+                items.push_back(item.substr(first, last - first + 1));
+            }
+            item.clear();
+            continue;
+        }
+        if (list[i] == '\\' && i + 1 < list.size() && list[i + 1] == ',')
+        {
+            ++i;
+        }
+        item += list[i];
+    }
+    return items;
+}
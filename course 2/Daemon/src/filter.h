@@ -0,0 +1,96 @@
+#ifndef BACKUP_FILTER_H
+#define BACKUP_FILTER_H
+
+#include <mini/ini.h>
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Globs compiled into one deterministic automaton over bytes, every glob has
+// to match the whole input. State 0 can not match anymore, `accept` holds
+// the flags of the globs matching in a state.
+struct GlobAutomaton
+{
+    GlobAutomaton() = default;
+    // Every glob with its flags, the patterns are described at PathFilter
+    explicit GlobAutomaton(const std::vector<std::pair<std::string, uint8_t>>& globs);
+
+    uint32_t step(uint32_t state, unsigned char byte) const { return transitions[state * classes + classOf[byte]]; }
+
+    // Bytes no glob tells apart share a column of the table
+    uint8_t classOf[256] = {};
+    size_t classes = 1;
+    std::vector<uint32_t> transitions = {0};
+    std::vector<uint8_t> accept = {0};
+    uint32_t start = 0;
+};
+
+// Include and exclude patterns of [filter], compiled once into one matcher.
+// A pattern is a glob: `*` and `?` match anything but '/', `**` matches
+// across directories, `[a-z]` and `[!a-z]` are classes and `\` quotes the
+// next character. A pattern without '/' matches the name at any depth,
+// e.g. `*.tmp` or `node_modules`; one with '/' matches the whole path from
+// the source root, e.g. `var/cache/**`. A trailing '/' matches directories
+// only. An entry is skipped if it matches an exclude and no include, and
+// the entries below a skipped directory are never read.
+//
+// Plain names and `*<suffix>` patterns, most of the rules in practice, are
+// looked up by a hash of every suffix of the name. The other name patterns
+// go into one DFA run over the name and the path patterns into one run over
+// the path, so a name is matched in a single pass over its bytes however
+// many patterns there are. The path DFA is walked down the tree, every
+// directory keeps the state after its own path. Two automatons instead of
+// one keep the name patterns from multiplying the states of the path ones.
+class PathFilter
+{
+public:
+    using State = uint32_t;
+
+    // Keeps everything
+    PathFilter() = default;
+    PathFilter(const std::vector<std::string>& include, const std::vector<std::string>& exclude);
+
+    bool empty() const { return literals.empty() && names.accept.size() <= 1 && paths.accept.size() <= 1; }
+
+    // State of the entries of the directory, a path relative to the root
+    State below(const std::string& directory) const;
+    // State of the entries of the subdirectory `name`
+    State enter(State state, const char* name) const;
+
+    // True if the entry `name` of the directory of `state` is skipped
+    bool excluded(State state, const char* name, bool directory) const;
+    // Same for a path relative to the root, true if one of its parents is skipped as well
+    bool excluded(const std::string& path, bool directory) const;
+
+private:
+    // Plain name or `*<suffix>` pattern
+    struct Literal
+    {
+        std::string text;
+        uint8_t match;
+        bool whole;
+    };
+
+    void addLiteral(const std::string& text, uint8_t match, bool whole);
+    uint8_t matches(State state, const char* name) const;
+
+    std::vector<Literal> literals;
+    // Hash of the reversed text -> literals
+    std::unordered_map<uint64_t, std::vector<size_t>> suffixes;
+    size_t longest = 0;
+
+    GlobAutomaton names;
+    GlobAutomaton paths;
+};
+
+// Comma-separated patterns of [filter] include and exclude, see splitList()
+PathFilter readFilter(const mINI::INIStructure& ini);
+
+// Items of a comma-separated value of backup.ini without the blanks around
+// them, `\,` is a comma in an item
+std::vector<std::string> splitList(const std::string& list);
+
+#endif
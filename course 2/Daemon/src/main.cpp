@@ -1,22 +1,26 @@
+#include "backup.h"
+#include "filter.h"
+#include "scheduler.h"
+#include "scrub.h"
+#include "snapshot.h"
+
 #include <mini/ini.h>
-#include <filesystem>
+#include <algorithm>
+#include <ctime>
+#include <initializer_list>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <syslog.h>
+#include <system_error>
 #include <thread>
-#include <ctime>
-
-bool is_running = true;
-
-const std::string currentDatetime()
-{
-    time_t now = time(0);
-    tm* data = localtime(&now);
-
-    std::ostringstream stream;
-    stream << std::put_time(data, "%d.%m.%Y %H-%M-%S");
-    return stream.str();
-}
+#include <tuple>
+#include <unistd.h>
+#include <vector>
 
 const mINI::INIStructure readINI()
 {
@@ -31,66 +35,442 @@ const mINI::INIStructure readINI()
     return ini;
 }
 
-void backup(const mINI::INIStructure& ini)
+// Throws if `value` of [section] key is neither empty nor a whole number
+long long checkNumber(const mINI::INIStructure& ini, const std::string& section, const std::string& key)
 {
-    const std::string& src = ini.get("src").get("path");
-    const std::string& dst = ini.get("dst").get("path"); 
+    const std::string& value = ini.get(section).get(key);
+    if (value.empty())
+    {
+        return 0;
+    }
+    size_t end = 0;
+    try
+    {
+        long long number = std::stoll(value, &end);
+        if (end == value.size())
+        {
+            return number;
+        }
+    }
+    catch (const std::exception&)
+    {
+    }
+    throw std::runtime_error("Invalid number in [" + section + "] " + key + ": " + value);
+}
 
-    // Create backup directory
-    if (!std::filesystem::exists(dst))
+void checkName(const std::string& value, std::initializer_list<const char*> names, const std::string& what)
+{
+    for (const char* name : names)
+    {
+        if (value == name)
+        {
+            return;
+        }
+    }
+    if (!value.empty())
     {
-        std::filesystem::create_directory(dst);
+        throw std::runtime_error("Unknown " + what + " " + value);
     }
+}
 
-    // Copy files
-    std::string dateTime = currentDatetime();
-    std::string outputPath = dst + dateTime;
-    std::filesystem::copy(src, outputPath, std::filesystem::copy_options::recursive);
+// Checksums go to the manifest, full snapshots and archives have none to hold them
+void checkMode(const mINI::INIStructure& ini, const std::string& mode, const std::string& what)
+{
+    checkName(mode, {"full", "incremental", "hardlink", "dedup", "archive"}, "backup mode");
+    if (ini.get("integrity").get("checksums") == "yes" && (mode.empty() || mode == "full" || mode == "archive"))
+    {
+        throw std::runtime_error(what + ": full snapshots and archives do not record [integrity] checksums");
+    }
+}
+
+// Throws on the values of backup.ini the daemon can not start with. A reload
+// checks the new file before the running configuration is torn down, so a
+// typo keeps the daemon running as it was.
+void validate(const mINI::INIStructure& ini)
+{
+    // Section, key and whether the value, when set, has to be positive
+    const std::tuple<const char*, const char*, bool> numbers[] = {
+        {"frequency", "sec", false},
+        {"performance", "threads", true},
+        {"throttle", "bandwidth", false},
+        {"throttle", "iops", false},
+        {"throttle", "nice", false},
+        {"throttle", "cpu_percent", false},
+        {"compression", "level", false},
+        {"compression", "block_size", true},
+        {"delta", "min_size", false},
+        {"delta", "block_size", true},
+        {"dedup", "chunk_size", true},
+        {"dedup", "pack_size", true},
+        {"integrity", "scrub_sec", true},
+        {"integrity", "scrub_bandwidth", false},
+        {"integrity", "scrub_threads", true},
+    };
+    for (const auto& key : numbers)
+    {
+        const char* section = std::get<0>(key);
+        const char* name = std::get<1>(key);
+        if (checkNumber(ini, section, name) <= 0 && std::get<2>(key) && !ini.get(section).get(name).empty())
+        {
+            throw std::runtime_error(std::string("[") + section + "] " + name + " has to be positive");
+        }
+    }
+    // A compressed block records its length in 32 bits
+    if (checkNumber(ini, "compression", "block_size") > std::numeric_limits<uint32_t>::max())
+    {
+        throw std::runtime_error("[compression] block_size has to fit in 32 bits");
+    }
+    parseMethod(ini.get("performance").get("copy_method"));
+    checkName(ini.get("throttle").get("io_class"), {"idle", "best-effort"}, "I/O class");
+    checkName(ini.get("watch").get("backend"), {"fanotify", "inotify"}, "watch backend");
+    readFilter(ini);
 
-    std::string log = "Copied " + src + " to " + outputPath;
-    syslog(LOG_INFO, log.c_str());
+    // A job falls back to [frequency] sec, [watch] backend and [filter]
+    bool jobs = false;
+    for (const auto& section : ini)
+    {
+        if (section.first.compare(0, 4, "job.") != 0)
+        {
+            continue;
+        }
+        jobs = true;
+        const auto& job = section.second;
+        long long sec = job.has("sec") ? checkNumber(ini, section.first, "sec") : checkNumber(ini, "frequency", "sec");
+        if (sec <= 0)
+        {
+            throw std::runtime_error("Job " + section.first.substr(4) + ": sec has to be positive");
+        }
+        checkName(job.get("watch"), {"fanotify", "inotify"}, "watch backend");
+        checkMode(ini, job.has("mode") ? job.get("mode") : ini.get("mode").get("type"), "Job " + section.first.substr(4));
+        PathFilter(splitList(job.has("include") ? job.get("include") : ini.get("filter").get("include")),
+            splitList(job.has("exclude") ? job.get("exclude") : ini.get("filter").get("exclude")));
+    }
+    if (!jobs && checkNumber(ini, "frequency", "sec") <= 0)
+    {
+        throw std::runtime_error("[frequency] sec has to be positive");
+    }
+    if (!jobs)
+    {
+        checkMode(ini, ini.get("mode").get("type"), "[mode] type");
+    }
 }
 
-void pause_handler(int sig_num)
+// Everything built from backup.ini, replaced as a whole on SIGHUP. All jobs
+// share the copy workers, the throttle and the compression settings.
+struct Daemon
 {
-    is_running = false;
-    syslog(LOG_INFO, "Pause");
+    Daemon(const mINI::INIStructure& ini, MetricsRegistry& metrics):
+    engine(threadCount(ini), parseMethod(ini.get("performance").get("copy_method")),
+        ini.get("performance").get("io_uring") == "yes"),
+    jobs(readJobs(ini, engine.pool())),
+    scheduler(engine, jobs.size(), metrics, ini.get("metrics").get("textfile"))
+    {
+        const std::string& bandwidth = ini.get("throttle").get("bandwidth");
+        const std::string& iops = ini.get("throttle").get("iops");
+        engine.throttle().setLimits(bandwidth.empty() ? 0 : stoull(bandwidth), iops.empty() ? 0 : stoull(iops));
+        if (ini.get("performance").get("cache_neutral") == "yes")
+        {
+            engine.enableCacheNeutral();
+        }
+        if (ini.get("compression").get("enabled") == "yes")
+        {
+            const std::string& level = ini.get("compression").get("level");
+            const std::string& blockSize = ini.get("compression").get("block_size");
+            engine.enableCompression(level.empty() ? 6 : stoi(level), blockSize.empty() ? 1 << 20 : stoul(blockSize));
+        }
+        const std::string& socketPath = ini.get("metrics").get("socket");
+        if (!socketPath.empty())
+        {
+            socket = std::make_unique<MetricsSocket>(socketPath);
+        }
+        if (ini.get("integrity").get("checksums") == "yes")
+        {
+            engine.enableChecksums();
+        }
+        if (ini.get("delta").get("enabled") == "yes")
+        {
+            const std::string& minSize = ini.get("delta").get("min_size");
+            const std::string& blockSize = ini.get("delta").get("block_size");
+            engine.enableDelta(minSize.empty() ? 64 << 20 : stoull(minSize), blockSize.empty() ? 128 << 10 : stoul(blockSize));
+        }
+        const std::string& scrubPeriod = ini.get("integrity").get("scrub_sec");
+        if (!scrubPeriod.empty())
+        {
+            std::vector<Scrubber::Target> targets;
+            for (const std::unique_ptr<Job>& job : jobs)
+            {
+                for (const std::string& dst : destinations(job->ini))
+                {
+                    targets.push_back({job->name, dst});
+                }
+            }
+            const std::string& bandwidth = ini.get("integrity").get("scrub_bandwidth");
+            const std::string& threads = ini.get("integrity").get("scrub_threads");
+            scrubber = std::make_unique<Scrubber>(std::move(targets), stoll(scrubPeriod),
+                bandwidth.empty() ? 0 : stoull(bandwidth), threads.empty() ? 2 : stoul(threads), metrics,
+                ini.get("metrics").get("textfile"));
+        }
+    }
+
+    static size_t threadCount(const mINI::INIStructure& ini)
+    {
+        const std::string& threads = ini.get("performance").get("threads");
+        // hardware_concurrency() is 0 when it is not known
+        return threads.empty() ? std::max(1u, std::thread::hardware_concurrency()) : stoi(threads);
+    }
+
+    CopyEngine engine;
+    std::vector<std::unique_ptr<Job>> jobs;
+    // Declared after the jobs, so the running cycles finish before the jobs go away
+    JobScheduler scheduler;
+    std::unique_ptr<MetricsSocket> socket;
+    // Stopped before everything else, a scrub has nothing to finish
+    std::unique_ptr<Scrubber> scrubber;
+};
+
+int64_t monotonicTime()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
 }
 
-void continue_handler(int sig_num)
+// Arms the timer for the first tick of the cadence started at `start` which is
+// not earlier than `notBefore`. Cycles start at start + k * period however long
+// each of them takes.
+void schedule(int timer, int64_t start, int64_t period, int64_t notBefore)
 {
-    is_running = true;
-    syslog(LOG_INFO, "Continue");
+    int64_t next = start;
+    if (notBefore > start)
+    {
+        next = start + (notBefore - start + period - 1) / period * period;
+    }
+    itimerspec spec = {};
+    spec.it_value.tv_sec = next / 1000000000;
+    spec.it_value.tv_nsec = next % 1000000000;
+    spec.it_interval.tv_sec = period / 1000000000;
+    spec.it_interval.tv_nsec = period % 1000000000;
+    if (timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, nullptr) != 0)
+    {
+        throw std::system_error(errno, std::generic_category(), "timerfd_settime");
+    }
 }
 
-void terminate_handler(int sig_num)
+// A disarmed timer never wakes the daemon up
+void unschedule(int timer)
 {
-    syslog(LOG_INFO, "Terminate");
-    closelog();
-    exit(EXIT_SUCCESS);
+    itimerspec spec = {};
+    timerfd_settime(timer, 0, &spec, nullptr);
 }
 
-int main()
+// Adds the timers of the jobs and the metrics socket to the loop and starts the
+// cadences at `start`, or one period later after a reload
+void startDaemon(int epollFd, Daemon& daemon, int64_t start, bool running, bool delayed)
 {
-    // Add signal handlers
-    signal(SIGTSTP, pause_handler);
-    signal(SIGCONT, continue_handler);
-    signal(SIGTERM, terminate_handler);
+    if (daemon.socket)
+    {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.ptr = daemon.socket.get();
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, daemon.socket->fd(), &event) != 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+        }
+    }
+    for (const std::unique_ptr<Job>& job : daemon.jobs)
+    {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.ptr = job.get();
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, job->timer, &event) != 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+        }
+        job->start = start;
+        if (running)
+        {
+            schedule(job->timer, start, job->period, delayed ? start + job->period : start);
+        }
+    }
+}
 
-    // Read configuration file
-    const mINI::INIStructure ini = readINI();
-    int deltaTime = stoi(ini.get("frequency").get("sec"));
+int main()
+{
+    // Signals are read from a signalfd instead of handlers. They are blocked
+    // before any thread starts, so every worker inherits the mask.
+    sigset_t signals;
+    sigemptyset(&signals);
+    for (int signal : {SIGTSTP, SIGCONT, SIGTERM, SIGINT, SIGHUP})
+    {
+        sigaddset(&signals, signal);
+    }
+    sigprocmask(SIG_BLOCK, &signals, nullptr);
+    int signalFd = signalfd(-1, &signals, SFD_CLOEXEC);
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (signalFd == -1 || epollFd == -1)
+    {
+        throw std::system_error(errno, std::generic_category(), "Failed to create the event loop");
+    }
+    // Every job has its own timer, its events carry the job
+    epoll_event signalEvent = {};
+    signalEvent.events = EPOLLIN;
+    signalEvent.data.ptr = nullptr;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, signalFd, &signalEvent);
 
     // Open log file
     openlog("Backup daemon", LOG_PID | LOG_NDELAY, LOG_USER);
-    syslog(LOG_INFO, "Start");
+
+    // Read configuration file, the priorities are inherited by the workers
+    // The running configuration, a reload which fails falls back to it
+    auto ini = std::make_unique<mINI::INIStructure>(readINI());
+    validate(*ini);
+    applyProcessLimits(*ini);
+    // The counters survive reloads
+    MetricsRegistry metrics;
+    auto daemon = std::make_unique<Daemon>(*ini, metrics);
+    syslog(LOG_INFO, "Start with %zu jobs", daemon->jobs.size());
+
+    // The first cycles start at once
+    bool running = true;
+    int64_t start = monotonicTime();
+    startDaemon(epollFd, *daemon, start, running, false);
 
     while (true)
     {
-        if (is_running)
+        epoll_event events[16];
+        int count = epoll_wait(epollFd, events, 16, -1);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "epoll_wait");
+        }
+
+        for (int i = 0; i < count; ++i)
         {
-            backup(ini);
-            std::this_thread::sleep_for(std::chrono::seconds(deltaTime));
+            // Answered between the other events, a request never waits for a cycle
+            if (daemon->socket && events[i].data.ptr == daemon->socket.get())
+            {
+                daemon->socket->serve(metrics);
+                continue;
+            }
+
+            Job* job = static_cast<Job*>(events[i].data.ptr);
+            if (job != nullptr)
+            {
+                uint64_t ticks = 0;
+                if (read(job->timer, &ticks, sizeof(ticks)) != sizeof(ticks) || !running)
+                {
+                    continue;
+                }
+                // A cycle still running or waiting for its disks takes this tick too
+                if (!daemon->scheduler.submit(*job))
+                {
+                    ++ticks;
+                }
+                if (ticks > 1)
+                {
+                    syslog(LOG_WARNING, "Job %s skipped %llu cycles, the previous one took longer than %lld s",
+                        job->name.c_str(), static_cast<unsigned long long>(ticks - 1),
+                        static_cast<long long>(job->period / 1000000000));
+                }
+                continue;
+            }
+
+            // Cycles run on the scheduler threads, a signal never interrupts a copy
+            signalfd_siginfo info;
+            if (read(signalFd, &info, sizeof(info)) != sizeof(info))
+            {
+                continue;
+            }
+            switch (info.ssi_signo)
+            {
+                case SIGTSTP:
+                    running = false;
+                    for (const std::unique_ptr<Job>& job : daemon->jobs)
+                    {
+                        unschedule(job->timer);
+                    }
+                    // The running cycles finish, the queued ones wait for SIGCONT
+                    daemon->scheduler.cancel();
+                    if (daemon->scrubber)
+                    {
+                        daemon->scrubber->setPaused(true);
+                    }
+                    syslog(LOG_INFO, "Pause");
+                    break;
+
+                case SIGCONT:
+                    if (!running)
+                    {
+                        running = true;
+                        int64_t now = monotonicTime();
+                        for (const std::unique_ptr<Job>& job : daemon->jobs)
+                        {
+                            schedule(job->timer, job->start, job->period, now);
+                        }
+                        if (daemon->scrubber)
+                        {
+                            daemon->scrubber->setPaused(false);
+                        }
+                        syslog(LOG_INFO, "Continue");
+                    }
+                    break;
+
+                case SIGHUP:
+                    try
+                    {
+                        // A mistake in the new file leaves the running configuration alone
+                        auto next = std::make_unique<mINI::INIStructure>(readINI());
+                        validate(*next);
+                        applyProcessLimits(*next);
+                        // The old workers, watches and timers go away before the new ones start
+                        daemon.reset();
+                        bool reloaded = true;
+                        try
+                        {
+                            daemon = std::make_unique<Daemon>(*next, metrics);
+                            ini = std::move(next);
+                        }
+                        catch (const std::exception& error)
+                        {
+                            // What validate() can not see, e.g. a metrics socket which can not be bound
+                            syslog(LOG_ERR, "Failed to reload: %s", error.what());
+                            reloaded = false;
+                            applyProcessLimits(*ini);
+                            daemon = std::make_unique<Daemon>(*ini, metrics);
+                        }
+                        if (daemon->scrubber && !running)
+                        {
+                            daemon->scrubber->setPaused(true);
+                        }
+                        start = monotonicTime();
+                        startDaemon(epollFd, *daemon, start, running, true);
+                        syslog(LOG_INFO, reloaded ? "Reload with %zu jobs" : "Restored the previous configuration with %zu jobs",
+                            daemon->jobs.size());
+                    }
+                    catch (const std::exception& error)
+                    {
+                        syslog(LOG_ERR, "Failed to reload: %s", error.what());
+                        if (!daemon)
+                        {
+                            closelog();
+                            return EXIT_FAILURE;
+                        }
+                    }
+                    // The other events of this batch may belong to the old jobs
+                    count = 0;
+                    break;
+
+                default:
+                    syslog(LOG_INFO, "Terminate");
+                    // The running cycles finish first
+                    daemon.reset();
+                    closelog();
+                    return EXIT_SUCCESS;
+            }
         }
     }
 
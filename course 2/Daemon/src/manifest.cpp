@@ -0,0 +1,168 @@
+#include "manifest.h"
+
+#include "walker.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <system_error>
+
+std::string escapePath(const std::string& path)
+{
+    std::string result;
+    result.reserve(path.size());
+    for (char c : path)
+    {
+        switch (c)
+        {
+            case '\\': result += "\\\\"; break;
+            case '\t': result += "\\t"; break;
+            case '\n': result += "\\n"; break;
+            default: result += c;
+        }
+    }
+    return result;
+}
+
+std::string unescapePath(const std::string& path)
+{
+    std::string result;
+    result.reserve(path.size());
+    for (size_t i = 0; i < path.size(); ++i)
+    {
+        if (path[i] == '\\' && i + 1 < path.size())
+        {
+            ++i;
+            result += path[i] == 't' ? '\t' : path[i] == 'n' ? '\n' : path[i];
+        }
+        else
+        {
+            result += path[i];
+        }
+    }
+    return result;
+}
+
+bool statEntry(const std::filesystem::path& file, const std::string& path, Entry& entry)
+{
+    struct stat info;
+    if (lstat(file.c_str(), &info) != 0)
+    {
+        // The file was removed while we were walking the tree
+        return false;
+    }
+
+    entry.path = path;
+    entry.size = S_ISDIR(info.st_mode) ? 0 : info.st_size;
+    entry.mtime = info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+    entry.inode = info.st_ino;
+    entry.mode = info.st_mode;
+    return true;
+}
+
+Entry statRoot(const std::string& src)
+{
+    Entry root;
+    if (!statEntry(src, std::string(), root))
+    {
+        throw std::filesystem::filesystem_error("Failed to stat", src, std::error_code(errno, std::generic_category()));
+    }
+    return root;
+}
+
+Manifest scanTree(const std::string& src, ThreadPool* pool)
+{
+    return walkTree(src, pool);
+}
+
+bool isChanged(const Entry& current, const Entry& previous)
+{
+    return current.size != previous.size
+        || current.mtime != previous.mtime
+        || current.inode != previous.inode
+        || current.mode != previous.mode;
+}
+
+std::string formatEntry(const Entry& entry)
+{
+    std::ostringstream stream;
+    stream << std::oct << entry.mode << std::dec << '\t' << entry.size << '\t'
+           << entry.mtime << '\t' << entry.inode << '\t' << entry.origin << '\t'
+           << escapePath(entry.path);
+    if (entry.checksum != Digest{})
+    {
+        stream << '\t' << toHex(entry.checksum);
+    }
+    stream << '\n';
+    return stream.str();
+}
+
+bool parseEntry(const std::string& line, Entry& entry)
+{
+    std::istringstream fields(line);
+    std::string path;
+    entry = Entry();
+    fields >> std::oct >> entry.mode >> std::dec >> entry.size >> entry.mtime >> entry.inode;
+    fields.ignore(1);
+    std::getline(fields, entry.origin, '\t');
+    std::getline(fields, path, '\t');
+    if (fields.fail())
+    {
+        return false;
+    }
+    entry.path = unescapePath(path);
+    // Manifests written without checksums end with the path
+    std::string checksum;
+    if (std::getline(fields, checksum) && !checksum.empty())
+    {
+        entry.checksum = fromHex(checksum);
+    }
+    return true;
+}
+
+Manifest readManifest(const std::string& file)
+{
+    Manifest manifest;
+    std::ifstream stream(file);
+    std::string line;
+    while (std::getline(stream, line))
+    {
+        Entry entry;
+        if (!parseEntry(line, entry))
+        {
+            throw std::runtime_error("Corrupted manifest " + file);
+        }
+        manifest.push_back(std::move(entry));
+    }
+    return manifest;
+}
+
+void writeManifest(const std::string& file, const Manifest& manifest)
+{
+    std::ofstream stream(file);
+    for (const Entry& entry : manifest)
+    {
+        stream << formatEntry(entry);
+    }
+    if (!stream)
+    {
+        throw std::runtime_error("Failed to write manifest " + file);
+    }
+}
+
+void writeDeleted(const std::string& file, const std::vector<std::string>& paths)
+{
+    std::ofstream stream(file);
+    for (const std::string& path : paths)
+    {
+        stream << escapePath(path) << '\n';
+    }
+    if (!stream)
+    {
+        throw std::runtime_error("Failed to write " + file);
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef BACKUP_MANIFEST_H
+#define BACKUP_MANIFEST_H
+
+#include "digest.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Every snapshot keeps the state of the whole source tree in this file
+const std::string manifestName = ".manifest";
+// Paths which disappeared from the source since the previous snapshot
+const std::string deletedName = ".deleted";
+
+struct Entry
+{
+    std::string path;   // Relative to the source root
+    uint64_t size = 0;
+    int64_t mtime = 0;  // Nanoseconds since epoch
+    uint64_t inode = 0;
+    uint32_t mode = 0;
+    std::string origin; // Snapshot which holds the data of this entry
+    Digest checksum{};  // Of the data of a regular file, see [integrity]
+};
+
+using Manifest = std::vector<Entry>;
+
+// Fills the entry from lstat() of file, false if it does not exist
+bool statEntry(const std::filesystem::path& file, const std::string& path, Entry& entry);
+
+// The source root itself, an entry with an empty path. Snapshots record its
+// mode and mtime so a restore can give them to the target.
+Entry statRoot(const std::string& src);
+
+class ThreadPool;
+
+// Entries of the source tree sorted by path, see walkTree()
+Manifest scanTree(const std::string& src, ThreadPool* pool = nullptr);
+
+// True if the entry has to be copied again
+bool isChanged(const Entry& current, const Entry& previous);
+
+// Paths may contain anything except '\0', so separators are escaped
+std::string escapePath(const std::string& path);
+std::string unescapePath(const std::string& path);
+
+// One line of a manifest with the newline, tab-separated fields
+std::string formatEntry(const Entry& entry);
+// False if the line is not a manifest line
+bool parseEntry(const std::string& line, Entry& entry);
+
+Manifest readManifest(const std::string& file);
+void writeManifest(const std::string& file, const Manifest& manifest);
+
+void writeDeleted(const std::string& file, const std::vector<std::string>& paths);
+
+#endif
@@ -0,0 +1,365 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace
+{
+    const Phase phases[] = {Phase::Scan, Phase::Copy, Phase::Fsync, Phase::Prune};
+
+    std::string number(double value)
+    {
+        char text[32];
+        snprintf(text, sizeof(text), "%.9g", value);
+        return text;
+    }
+
+    // Header of a metric family, its samples follow
+    void family(std::string& out, const char* name, const char* type, const char* help)
+    {
+        out += "# HELP ";
+        out += name;
+        out += " ";
+        out += help;
+        out += "\n# TYPE ";
+        out += name;
+        out += " ";
+        out += type;
+        out += "\n";
+    }
+
+    void sample(std::string& out, const std::string& name, const std::string& labels, double value)
+    {
+        out += name + "{" + labels + "} " + number(value) + "\n";
+    }
+
+    std::string jobLabel(const std::string& job)
+    {
+        // Job names come from section names, which can not hold quotes or newlines
+        return "job=\"" + job + "\"";
+    }
+
+    void histogram(std::string& out, const std::string& name, const std::string& labels, const LatencyHistogram& latency)
+    {
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < LatencyHistogram::bucketCount; ++i)
+        {
+            cumulative += latency.count(i);
+            std::string bound = i < LatencyHistogram::bounds.size() ? number(LatencyHistogram::bounds[i]) : "+Inf";
+            sample(out, name + "_bucket", labels + ",le=\"" + bound + "\"", cumulative);
+        }
+        sample(out, name + "_sum", labels, latency.seconds());
+        sample(out, name + "_count", labels, cumulative);
+    }
+}
+
+const char* phaseName(Phase phase)
+{
+    switch (phase)
+    {
+        case Phase::Scan:
+            return "scan";
+        case Phase::Copy:
+            return "copy";
+        case Phase::Fsync:
+            return "fsync";
+        case Phase::Prune:
+            return "prune";
+    }
+    return "unknown";
+}
+
+// From 100 us, a cached small file, to 10 s, a large file on a slow disk
+const std::array<double, LatencyHistogram::bucketCount - 1> LatencyHistogram::bounds =
+    {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.05, 0.25, 1, 10};
+
+LatencyHistogram::LatencyHistogram(const LatencyHistogram& other)
+{
+    add(other);
+}
+
+LatencyHistogram& LatencyHistogram::operator=(const LatencyHistogram& other)
+{
+    for (size_t i = 0; i < bucketCount; ++i)
+    {
+        buckets[i] = other.buckets[i].load();
+    }
+    nanoseconds = other.nanoseconds.load();
+    return *this;
+}
+
+void LatencyHistogram::observe(std::chrono::steady_clock::duration time)
+{
+    double seconds = std::chrono::duration<double>(time).count();
+    size_t bucket = std::lower_bound(bounds.begin(), bounds.end(), seconds) - bounds.begin();
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    nanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(time).count(), std::memory_order_relaxed);
+}
+
+void LatencyHistogram::add(const LatencyHistogram& other)
+{
+    for (size_t i = 0; i < bucketCount; ++i)
+    {
+        buckets[i] += other.buckets[i];
+    }
+    nanoseconds += other.nanoseconds;
+}
+
+uint64_t LatencyHistogram::total() const
+{
+    uint64_t total = 0;
+    for (const auto& bucket : buckets)
+    {
+        total += bucket;
+    }
+    return total;
+}
+
+void CycleMetrics::add(const CycleMetrics& other)
+{
+    scanned += other.scanned;
+    copied += other.copied;
+    skipped += other.skipped;
+    failed += other.failed;
+    bytes += other.bytes;
+    seconds += other.seconds;
+    for (size_t i = 0; i < phaseCount; ++i)
+    {
+        phases[i] += other.phases[i];
+    }
+    latency.add(other.latency);
+}
+
+PhaseTimer::PhaseTimer(CycleMetrics& metrics, Phase phase):
+metrics(metrics),
+phase(phase),
+start(std::chrono::steady_clock::now())
+{
+}
+
+void PhaseTimer::stop()
+{
+    if (!running)
+    {
+        return;
+    }
+    running = false;
+    metrics.phases[static_cast<size_t>(phase)] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void MetricsRegistry::record(const std::string& job, const CycleMetrics& cycle, bool succeeded)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    JobMetrics& metrics = jobs[job];
+    metrics.last = cycle;
+    metrics.total.add(cycle);
+    ++metrics.cycles;
+    metrics.failures += succeeded ? 0 : 1;
+    metrics.finished = std::time(nullptr);
+}
+
+void MetricsRegistry::recordScrub(const std::string& job, uint64_t bytes, size_t corrupted)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    ScrubMetrics& metrics = scrubs[job];
+    metrics.bytes += bytes;
+    ++metrics.scrubs;
+    metrics.corrupted = corrupted;
+    metrics.finished = std::time(nullptr);
+}
+
+std::string MetricsRegistry::render() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string out;
+
+    // Counters since the start and gauges of the last cycle of every job
+    struct Counter
+    {
+        const char* name;
+        const char* help;
+        std::function<double(const CycleMetrics&)> value;
+    };
+    const Counter counters[] = {
+        {"files_scanned", "Entries found in the source tree", [](const CycleMetrics& m) { return m.scanned; }},
+        {"files_copied", "Entries written, linked or stored", [](const CycleMetrics& m) { return m.copied; }},
+        {"files_skipped", "Unchanged entries which were not read", [](const CycleMetrics& m) { return m.skipped; }},
+        {"files_failed", "Entries which could not be backed up", [](const CycleMetrics& m) { return m.failed; }},
+        {"bytes_copied", "Bytes of file data read from the source", [](const CycleMetrics& m) { return m.bytes; }},
+        {"seconds", "Duration of the cycles", [](const CycleMetrics& m) { return m.seconds; }},
+    };
+    for (const Counter& counter : counters)
+    {
+        std::string total = std::string("backup_") + counter.name + "_total";
+        family(out, total.c_str(), "counter", counter.help);
+        for (const auto& job : jobs)
+        {
+            sample(out, total, jobLabel(job.first), counter.value(job.second.total));
+        }
+        std::string last = std::string("backup_last_cycle_") + counter.name;
+        family(out, last.c_str(), "gauge", counter.help);
+        for (const auto& job : jobs)
+        {
+            sample(out, last, jobLabel(job.first), counter.value(job.second.last));
+        }
+    }
+
+    family(out, "backup_phase_seconds_total", "counter", "Time spent in each phase of the cycles");
+    for (const auto& job : jobs)
+    {
+        for (Phase phase : phases)
+        {
+            sample(out, "backup_phase_seconds_total", jobLabel(job.first) + ",phase=\"" + phaseName(phase) + "\"",
+                job.second.total.phases[static_cast<size_t>(phase)]);
+        }
+    }
+    family(out, "backup_last_cycle_phase_seconds", "gauge", "Time spent in each phase of the last cycle");
+    for (const auto& job : jobs)
+    {
+        for (Phase phase : phases)
+        {
+            sample(out, "backup_last_cycle_phase_seconds", jobLabel(job.first) + ",phase=\"" + phaseName(phase) + "\"",
+                job.second.last.phases[static_cast<size_t>(phase)]);
+        }
+    }
+
+    family(out, "backup_file_copy_seconds", "histogram", "Time to copy one file");
+    for (const auto& job : jobs)
+    {
+        histogram(out, "backup_file_copy_seconds", jobLabel(job.first), job.second.total.latency);
+    }
+
+    family(out, "backup_cycles_total", "counter", "Finished cycles");
+    for (const auto& job : jobs)
+    {
+        sample(out, "backup_cycles_total", jobLabel(job.first), job.second.cycles);
+    }
+    family(out, "backup_cycle_failures_total", "counter", "Cycles which stopped with an error");
+    for (const auto& job : jobs)
+    {
+        sample(out, "backup_cycle_failures_total", jobLabel(job.first), job.second.failures);
+    }
+    family(out, "backup_last_cycle_timestamp_seconds", "gauge", "Unix time the last cycle finished");
+    for (const auto& job : jobs)
+    {
+        sample(out, "backup_last_cycle_timestamp_seconds", jobLabel(job.first), job.second.finished);
+    }
+
+    family(out, "backup_scrubs_total", "counter", "Finished scrubs of the dst");
+    for (const auto& job : scrubs)
+    {
+        sample(out, "backup_scrubs_total", jobLabel(job.first), job.second.scrubs);
+    }
+    family(out, "backup_scrub_bytes_total", "counter", "Bytes read back by the scrubs");
+    for (const auto& job : scrubs)
+    {
+        sample(out, "backup_scrub_bytes_total", jobLabel(job.first), job.second.bytes);
+    }
+    family(out, "backup_last_scrub_corrupted", "gauge", "Files and chunks which did not match their checksum in the last scrub");
+    for (const auto& job : scrubs)
+    {
+        sample(out, "backup_last_scrub_corrupted", jobLabel(job.first), job.second.corrupted);
+    }
+    family(out, "backup_last_scrub_timestamp_seconds", "gauge", "Unix time the last scrub finished");
+    for (const auto& job : scrubs)
+    {
+        sample(out, "backup_last_scrub_timestamp_seconds", jobLabel(job.first), job.second.finished);
+    }
+    return out;
+}
+
+void MetricsRegistry::writeTextfile(const std::string& path) const
+{
+    if (path.empty())
+    {
+        return;
+    }
+    // Cycles of several jobs may end at once, one writer at a time
+    std::lock_guard<std::mutex> lock(textfileMutex);
+    std::string text = render();
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::trunc);
+        file << text;
+        if (!file.flush())
+        {
+            syslog(LOG_WARNING, "Failed to write metrics to %s: %s", temporary.c_str(), strerror(errno));
+            return;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary, path, error);
+    if (error)
+    {
+        syslog(LOG_WARNING, "Failed to write metrics to %s: %s", path.c_str(), error.message().c_str());
+        std::filesystem::remove(temporary, error);
+    }
+}
+
+MetricsSocket::MetricsSocket(const std::string& path):
+path(path),
+listener(socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0))
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (listener == -1 || path.size() >= sizeof(address.sun_path))
+    {
+        if (listener != -1)
+        {
+            close(listener);
+        }
+        throw std::system_error(errno, std::generic_category(), "Failed to create metrics socket " + path);
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    // A socket left by a killed daemon
+    unlink(path.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 16) != 0)
+    {
+        int error = errno;
+        close(listener);
+        throw std::system_error(error, std::generic_category(), "Failed to listen on " + path);
+    }
+}
+
+MetricsSocket::~MetricsSocket()
+{
+    close(listener);
+    unlink(path.c_str());
+}
+
+void MetricsSocket::serve(const MetricsRegistry& registry)
+{
+    while (true)
+    {
+        int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client == -1)
+        {
+            return;
+        }
+        // A few kilobytes fit into the socket buffer, a slow reader does not block the loop
+        std::string text = registry.render();
+        timeval timeout = {1, 0};
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        for (size_t sent = 0; sent < text.size();)
+        {
+            ssize_t count = send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+            if (count <= 0)
+            {
+                break;
+            }
+            sent += count;
+        }
+        close(client);
+    }
+}
@@ -0,0 +1,147 @@
+#ifndef BACKUP_METRICS_H
+#define BACKUP_METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Parts of a cycle whose duration is measured
+enum class Phase
+{
+    Scan,   // Walking the source tree and reading the previous manifest
+    Copy,   // Copying, linking or storing the entries
+    Fsync,  // Making the snapshot durable
+    Prune   // Removing what deleted snapshots left behind
+};
+
+const size_t phaseCount = 4;
+
+const char* phaseName(Phase phase);
+
+// Per-file copy times in buckets with the upper bounds in seconds, the last
+// bucket has no bound. All copy workers update it at once.
+class LatencyHistogram
+{
+public:
+    static const size_t bucketCount = 12;
+    static const std::array<double, bucketCount - 1> bounds;
+
+    LatencyHistogram() = default;
+    LatencyHistogram(const LatencyHistogram& other);
+    LatencyHistogram& operator=(const LatencyHistogram& other);
+
+    void observe(std::chrono::steady_clock::duration time);
+    void add(const LatencyHistogram& other);
+
+    // Files in the bucket itself, not in the lower ones
+    uint64_t count(size_t bucket) const { return buckets[bucket]; }
+    uint64_t total() const;
+    double seconds() const { return nanoseconds / 1e9; }
+
+private:
+    std::array<std::atomic<uint64_t>, bucketCount> buckets{};
+    std::atomic<uint64_t> nanoseconds{0};
+};
+
+// What one cycle of a job did
+struct CycleMetrics
+{
+    uint64_t scanned = 0;  // Entries of the source tree
+    uint64_t copied = 0;   // Entries written, linked or stored
+    uint64_t skipped = 0;  // Unchanged entries which were not read
+    uint64_t failed = 0;
+    uint64_t bytes = 0;
+    double seconds = 0;
+    std::array<double, phaseCount> phases{};
+    LatencyHistogram latency;
+
+    void add(const CycleMetrics& other);
+};
+
+// Adds the time until stop() or the end of the scope to a phase
+class PhaseTimer
+{
+public:
+    PhaseTimer(CycleMetrics& metrics, Phase phase);
+    ~PhaseTimer() { stop(); }
+
+    void stop();
+
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+private:
+    CycleMetrics& metrics;
+    Phase phase;
+    std::chrono::steady_clock::time_point start;
+    bool running = true;
+};
+
+// The last cycle and the totals since the daemon started for every job, in
+// the Prometheus text format. It outlives reloads, so the counters only grow.
+class MetricsRegistry
+{
+public:
+    void record(const std::string& job, const CycleMetrics& cycle, bool succeeded);
+    // A finished scrub of the dst of the job, see Scrubber
+    void recordScrub(const std::string& job, uint64_t bytes, size_t corrupted);
+
+    std::string render() const;
+
+    // node_exporter textfile collector style: written next to the file and
+    // renamed, so a scrape never sees half of it. Empty path does nothing.
+    void writeTextfile(const std::string& path) const;
+
+private:
+    struct JobMetrics
+    {
+        CycleMetrics last;
+        CycleMetrics total;
+        uint64_t cycles = 0;
+        uint64_t failures = 0;
+        std::time_t finished = 0;
+    };
+
+    struct ScrubMetrics
+    {
+        uint64_t bytes = 0;
+        uint64_t scrubs = 0;
+        size_t corrupted = 0;  // In the last scrub
+        std::time_t finished = 0;
+    };
+
+    mutable std::mutex mutex;
+    // Held from the render to the rename, so an older render never replaces a newer one
+    mutable std::mutex textfileMutex;
+    std::map<std::string, JobMetrics> jobs;
+    std::map<std::string, ScrubMetrics> scrubs;
+};
+
+// Unix stream socket which answers every connection with the metrics and
+// closes it, e.g. `socat - UNIX-CONNECT:/run/backup-daemon.sock`
+class MetricsSocket
+{
+public:
+    explicit MetricsSocket(const std::string& path);
+    ~MetricsSocket();
+
+    MetricsSocket(const MetricsSocket&) = delete;
+    MetricsSocket& operator=(const MetricsSocket&) = delete;
+
+    // Non-blocking listening socket for the event loop
+    int fd() const { return listener; }
+
+    // Answers the pending connections
+    void serve(const MetricsRegistry& registry);
+
+private:
+    std::string path;
+    int listener;
+};
+
+#endif
@@ -0,0 +1,71 @@
+#include "pipeline.h"
+
+EntryStream::EntryStream(Produce produce, size_t batchSize, size_t batches):
+queue(batches)
+{
+    thread = std::thread([this, produce, batchSize]
+    {
+        Manifest pending;
+        pending.reserve(batchSize);
+        bool open = true;
+        Emit emit = [this, &pending, &open, batchSize](Entry& entry)
+        {
+            pending.push_back(std::move(entry));
+            if (pending.size() >= batchSize)
+            {
+                open = queue.push(pending);
+                pending.clear();
+            }
+            return open;
+        };
+        try
+        {
+            produce(emit);
+            if (open && !pending.empty())
+            {
+                queue.push(pending);
+            }
+        }
+        catch (...)
+        {
+            // Read by the consumer after the queue is drained and closed
+            error = std::current_exception();
+        }
+        queue.close();
+    });
+}
+
+EntryStream::~EntryStream()
+{
+    queue.close();
+    thread.join();
+}
+
+Entry* EntryStream::peek()
+{
+    while (position == batch.size())
+    {
+        if (finished)
+        {
+            return nullptr;
+        }
+        batch.clear();
+        position = 0;
+        if (!queue.pop(batch))
+        {
+            finished = true;
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+    return &batch[position];
+}
+
+Entry EntryStream::take()
+{
+    Entry* entry = peek();
+    ++position;
+    return std::move(*entry);
+}
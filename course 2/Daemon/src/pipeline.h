@@ -0,0 +1,100 @@
+#ifndef BACKUP_PIPELINE_H
+#define BACKUP_PIPELINE_H
+
+#include "manifest.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Hands items from one stage of a pipeline to the next. push() blocks while
+// the queue is full, so a fast stage waits for a slow one and the items in
+// flight stay bounded. After close() push() fails at once and pop() fails
+// as soon as the queue is drained.
+template <class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity): capacity(capacity) {}
+
+    // The item is moved only if it was queued
+    bool push(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+        if (closed)
+        {
+            return false;
+        }
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty())
+        {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    std::deque<T> items;
+    bool closed = false;
+};
+
+// Entries produced on a thread of their own, e.g. by a walk, and read one
+// by one in the order they were emitted. They are passed in batches through
+// a bounded queue, so the producer runs ahead at most `batches` batches and
+// blocks when the reader falls behind. Destroying the stream early makes
+// `emit` return false, the producer is expected to stop then.
+class EntryStream
+{
+public:
+    using Emit = std::function<bool(Entry&)>;
+    using Produce = std::function<void(const Emit&)>;
+
+    explicit EntryStream(Produce produce, size_t batchSize = 256, size_t batches = 16);
+    ~EntryStream();
+
+    EntryStream(const EntryStream&) = delete;
+    EntryStream& operator=(const EntryStream&) = delete;
+
+    // The next entry, nullptr at the end. Rethrows what the producer threw.
+    Entry* peek();
+    // Moves the next entry out and advances
+    Entry take();
+
+private:
+    BoundedQueue<Manifest> queue;
+    Manifest batch;
+    size_t position = 0;
+    bool finished = false;
+    std::exception_ptr error;
+    std::thread thread;
+};
+
+#endif
@@ -0,0 +1,701 @@
+#include "restore.h"
+
+#include "archive.h"
+#include "snapshot.h"
+#include "store.h"
+#include "walker.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace
+{
+    const size_t bufferSize = 1 << 20;
+    // Entries are handed to the workers in batches like in the copier
+    const size_t batchEntries = 64;
+
+    using Visit = std::function<void(const char*, size_t)>;
+
+    [[noreturn]] void fail(const std::string& message, const std::filesystem::path& path)
+    {
+        throw std::filesystem::filesystem_error(message, path, std::error_code(errno, std::generic_category()));
+    }
+
+    void writeFull(int fd, const char* data, size_t size, const std::filesystem::path& path)
+    {
+        while (size > 0)
+        {
+            ssize_t count = write(fd, data, size);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                fail("Failed to write", path);
+            }
+            data += count;
+            size -= count;
+        }
+    }
+
+    // Less than `size` only at the end of the file
+    size_t readFull(int fd, char* data, size_t size, const std::filesystem::path& path)
+    {
+        size_t total = 0;
+        while (total < size)
+        {
+            ssize_t count = read(fd, data + total, size - total);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                fail("Failed to read", path);
+            }
+            if (count == 0)
+            {
+                break;
+            }
+            total += count;
+        }
+        return total;
+    }
+
+    // Entries of one snapshot and their data, whatever mode wrote it
+    class Snapshot
+    {
+    public:
+        virtual ~Snapshot() = default;
+
+        // All entries in path order
+        const Manifest& entries() const { return manifest; }
+
+        // Passes the data of a regular file or the target of a symlink piece by piece
+        virtual void read(size_t index, const Visit& visit) = 0;
+
+        // Creates the regular file or the symlink, returns the number of bytes written
+        virtual uint64_t restore(size_t index, const std::filesystem::path& to)
+        {
+            if (S_ISLNK(manifest[index].mode))
+            {
+                std::string link;
+                read(index, [&link](const char* data, size_t size) { link.append(data, size); });
+                if (symlink(link.c_str(), to.c_str()) != 0)
+                {
+                    fail("Failed to create", to);
+                }
+                return 0;
+            }
+            FileDescriptor out(open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+            if (out == -1)
+            {
+                fail("Failed to create", to);
+            }
+            uint64_t written = 0;
+            read(index, [&out, &to, &written](const char* data, size_t size)
+            {
+                writeFull(out, data, size, to);
+                written += size;
+            });
+            return written;
+        }
+
+        // Creates the directories and restores the files and symlinks of the
+        // selection on the pool, one restore() each
+        virtual CopyResult copy(const std::vector<size_t>& selected, const std::filesystem::path& target,
+            CopyEngine& engine, CopyProgress* progress)
+        {
+            auto start = std::chrono::steady_clock::now();
+            CopyResult result;
+            std::mutex mutex;
+            auto failed = [&result, &mutex](const std::string& path, const std::exception& error)
+            {
+                syslog(LOG_WARNING, "%s", error.what());
+                std::lock_guard<std::mutex> lock(mutex);
+                result.failed.push_back(path);
+            };
+
+            // Writable until the metadata pass gives them their own mode
+            for (size_t index : selected)
+            {
+                const Entry& entry = manifest[index];
+                std::filesystem::path to = target / entry.path;
+                if (!S_ISDIR(entry.mode))
+                {
+                    continue;
+                }
+                if (mkdir(to.c_str(), 0700) == 0)
+                {
+                    ++result.stats.directories;
+                }
+                else if (errno != EEXIST)
+                {
+                    failed(entry.path, std::filesystem::filesystem_error("Failed to create", to,
+                        std::error_code(errno, std::generic_category())));
+                }
+            }
+
+            std::atomic<size_t> files{0};
+            std::atomic<uint64_t> bytes{0};
+            LatencyHistogram& latency = result.stats.latency;
+            TaskGroup group(engine.pool());
+            for (size_t first = 0; first < selected.size(); first += batchEntries)
+            {
+                size_t last = std::min(first + batchEntries, selected.size());
+                group.run([&, first, last]
+                {
+                    for (size_t i = first; i < last; ++i)
+                    {
+                        const Entry& entry = manifest[selected[i]];
+                        if (!S_ISREG(entry.mode) && !S_ISLNK(entry.mode))
+                        {
+                            if (!S_ISDIR(entry.mode))
+                            {
+                                syslog(LOG_WARNING, "Skipped special file %s", entry.path.c_str());
+                            }
+                            continue;
+                        }
+                        auto begin = std::chrono::steady_clock::now();
+                        try
+                        {
+                            uint64_t count = restore(selected[i], target / entry.path);
+                            engine.throttle().consume(count);
+                            bytes += count;
+                            ++files;
+                            latency.observe(std::chrono::steady_clock::now() - begin);
+                            if (progress != nullptr)
+                            {
+                                progress->bytes += count;
+                                ++progress->files;
+                            }
+                        }
+                        catch (const std::exception& error)
+                        {
+                            failed(entry.path, error);
+                        }
+                    }
+                });
+            }
+            group.wait();
+
+            result.stats.files = files;
+            result.stats.bytes = bytes;
+            result.stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::sort(result.failed.begin(), result.failed.end());
+            return result;
+        }
+
+    protected:
+        Manifest manifest;
+    };
+
+    // A directory in dst. Full and hardlink snapshots hold everything, the
+    // unchanged entries of an incremental one are in the older snapshots
+    // named by their origin.
+    class TreeSnapshot : public Snapshot
+    {
+    public:
+        TreeSnapshot(const std::filesystem::path& dst, const std::string& name, ThreadPool& pool): dst(dst)
+        {
+            std::filesystem::path root = dst / name;
+            if (std::filesystem::exists(root / manifestName))
+            {
+                manifest = readManifest(root / manifestName);
+            }
+            else
+            {
+                // A full snapshot has no manifest, the copy itself is the state of the tree
+                manifest = walkTree(root.string(), &pool);
+                for (Entry& entry : manifest)
+                {
+                    entry.origin = name;
+                }
+            }
+            // The snapshot directory has the mode and mtime of the source root, see Staging::commit()
+            Entry top = statRoot(root.string());
+            top.origin = name;
+            manifest.insert(manifest.begin(), std::move(top));
+        }
+
+        void read(size_t index, const Visit& visit) override
+        {
+            const Entry& entry = manifest[index];
+            std::filesystem::path path = source(entry);
+            if (S_ISLNK(entry.mode))
+            {
+                std::string link = std::filesystem::read_symlink(path).string();
+                visit(link.data(), link.size());
+                return;
+            }
+
+            std::vector<char> buffer(bufferSize);
+            if (CompressedFile::isCompressed(path))
+            {
+                CompressedFile file(path);
+                uint64_t offset = 0;
+                while (size_t count = file.read(offset, buffer.data(), buffer.size()))
+                {
+                    visit(buffer.data(), count);
+                    offset += count;
+                }
+                return;
+            }
+            FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+            if (fd == -1)
+            {
+                fail("Failed to open", path);
+            }
+            while (size_t count = readFull(fd, buffer.data(), buffer.size(), path))
+            {
+                visit(buffer.data(), count);
+            }
+        }
+
+        // The copy engine probes reflinks, copy_file_range and sendfile like for a backup
+        CopyResult copy(const std::vector<size_t>& selected, const std::filesystem::path& target,
+            CopyEngine& engine, CopyProgress* progress) override
+        {
+            std::vector<CopyJob> jobs;
+            jobs.reserve(selected.size());
+            for (size_t index : selected)
+            {
+                const Entry& entry = manifest[index];
+                jobs.push_back({entry, source(entry), target / entry.path, {}, {}, {}});
+            }
+            engine.enableDecompression();
+            return engine.copyEntries(jobs, progress);
+        }
+
+    private:
+        std::filesystem::path source(const Entry& entry) const
+        {
+            return dst / entry.origin / entry.path;
+        }
+
+        std::filesystem::path dst;
+    };
+
+    // A single file written by the archive mode
+    class ArchiveSnapshot : public Snapshot
+    {
+    public:
+        explicit ArchiveSnapshot(const std::filesystem::path& path):
+        archive(path),
+        fd(open(path.c_str(), O_RDONLY | O_CLOEXEC))
+        {
+            if (fd == -1)
+            {
+                fail("Failed to open", path);
+            }
+            manifest.reserve(archive.size());
+            items.reserve(archive.size());
+            for (size_t i = 0; i < archive.size(); ++i)
+            {
+                ArchiveEntry item = archive.entry(i);
+                Entry entry;
+                entry.path = std::string(item.path);
+                entry.size = item.size;
+                entry.mtime = item.mtime;
+                entry.mode = item.mode;
+                manifest.push_back(std::move(entry));
+                items.push_back(item);
+            }
+        }
+
+        void read(size_t index, const Visit& visit) override
+        {
+            visit(archive.data(items[index]), items[index].size);
+        }
+
+        // The data is copied by the kernel from the archive, on a CoW
+        // filesystem the extents may even be shared
+        uint64_t restore(size_t index, const std::filesystem::path& to) override
+        {
+            const ArchiveEntry& item = items[index];
+            if (!S_ISREG(item.mode) || !zeroCopy)
+            {
+                return Snapshot::restore(index, to);
+            }
+            FileDescriptor out(open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+            if (out == -1)
+            {
+                fail("Failed to create", to);
+            }
+            loff_t offset = item.offset;
+            uint64_t copied = 0;
+            while (copied < item.size)
+            {
+                ssize_t count = copy_file_range(fd, &offset, out, nullptr, item.size - copied, 0);
+                if (count > 0)
+                {
+                    copied += count;
+                    continue;
+                }
+                if (count < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (count < 0 && errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+                {
+                    fail("Failed to copy", to);
+                }
+                // Not supported between these filesystems, the rest comes from the mapping
+                zeroCopy = false;
+                writeFull(out, archive.data(item) + copied, item.size - copied, to);
+                copied = item.size;
+            }
+            return copied;
+        }
+
+    private:
+        Archive archive;
+        FileDescriptor fd;
+        std::vector<ArchiveEntry> items;
+        std::atomic<bool> zeroCopy{true};
+    };
+
+    // A recipe in the chunk store of the dedup mode
+    class StoreSnapshot : public Snapshot
+    {
+    public:
+        StoreSnapshot(const std::filesystem::path& root, const std::string& name):
+        store(root),
+        recipe(store.readRecipe(name))
+        {
+            manifest.reserve(recipe.size());
+            for (const RecipeEntry& item : recipe)
+            {
+                manifest.push_back(item.entry);
+            }
+        }
+
+        void read(size_t index, const Visit& visit) override
+        {
+            for (const Digest& digest : recipe[index].chunks)
+            {
+                std::vector<unsigned char> data = store.get(digest);
+                visit(reinterpret_cast<const char*>(data.data()), data.size());
+            }
+        }
+
+    private:
+        Store store;
+        Recipe recipe;
+    };
+
+    // The newest snapshot in dst if `name` is empty, `name` becomes the one opened
+    std::unique_ptr<Snapshot> openSnapshot(const std::filesystem::path& dst, std::string& name, ThreadPool& pool)
+    {
+        std::filesystem::path store = dst / ".store";
+        if (name.empty())
+        {
+            name = latestSnapshot(dst.string());
+        }
+        if (name.empty() && std::filesystem::is_directory(store / "snapshots"))
+        {
+            std::vector<std::string> recipes = listSnapshots((store / "snapshots").string());
+            name = recipes.empty() ? std::string() : recipes.back();
+        }
+        if (name.empty())
+        {
+            throw std::runtime_error("No snapshots in " + dst.string());
+        }
+
+        std::filesystem::path path = dst / name;
+        if (std::filesystem::is_directory(path))
+        {
+            return std::make_unique<TreeSnapshot>(dst, name, pool);
+        }
+        if (std::filesystem::is_regular_file(path) && Archive::isArchive(path))
+        {
+            return std::make_unique<ArchiveSnapshot>(path);
+        }
+        if (std::filesystem::is_regular_file(store / "snapshots" / name))
+        {
+            return std::make_unique<StoreSnapshot>(store, name);
+        }
+        throw std::runtime_error("No snapshot " + name + " in " + dst.string());
+    }
+
+    // "./a/b/" and "/a/b" select the same subtree as "a/b", an empty path the whole snapshot
+    std::string normalizePath(const std::string& path)
+    {
+        std::string result = std::filesystem::path(path).lexically_normal().string();
+        size_t first = result.find_first_not_of('/');
+        size_t last = result.find_last_not_of('/');
+        result = first == std::string::npos ? std::string() : result.substr(first, last - first + 1);
+        return result == "." ? std::string() : result;
+    }
+
+    bool isSelected(const std::string& path, const std::vector<std::string>& roots)
+    {
+        if (roots.empty())
+        {
+            return true;
+        }
+        for (const std::string& root : roots)
+        {
+            if (root.empty() || path == root
+                || (path.size() > root.size() && path.compare(0, root.size(), root) == 0 && path[root.size()] == '/'))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void applyMetadata(const Entry& entry, const std::filesystem::path& path)
+    {
+        // Symlinks have no mode of their own
+        if (!S_ISLNK(entry.mode) && chmod(path.c_str(), entry.mode & 07777) != 0)
+        {
+            fail("Failed to set permissions", path);
+        }
+        timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1].tv_sec = entry.mtime / 1000000000;
+        times[1].tv_nsec = entry.mtime % 1000000000;
+        if (times[1].tv_nsec < 0)
+        {
+            times[1].tv_nsec += 1000000000;
+            --times[1].tv_sec;
+        }
+        if (utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            fail("Failed to set mtime", path);
+        }
+    }
+
+    bool sameData(Snapshot& snapshot, size_t index, const std::filesystem::path& path)
+    {
+        FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (fd == -1)
+        {
+            fail("Failed to open", path);
+        }
+        std::vector<char> buffer(bufferSize);
+        bool same = true;
+        snapshot.read(index, [&](const char* data, size_t size)
+        {
+            // A piece of an archive is the whole file, it is compared buffer by buffer
+            while (same && size > 0)
+            {
+                size_t length = std::min(size, buffer.size());
+                same = readFull(fd, buffer.data(), length, path) == length && std::memcmp(buffer.data(), data, length) == 0;
+                data += length;
+                size -= length;
+            }
+        });
+        // Nothing may follow the data of the snapshot
+        return same && readFull(fd, buffer.data(), 1, path) == 0;
+    }
+
+    // Throws if the restored entry is not what the snapshot holds
+    void verifyEntry(Snapshot& snapshot, size_t index, const std::filesystem::path& path)
+    {
+        const Entry& entry = snapshot.entries()[index];
+        struct stat status;
+        if (lstat(path.c_str(), &status) != 0)
+        {
+            fail("Failed to verify", path);
+        }
+        const char* difference = nullptr;
+        if ((status.st_mode & S_IFMT) != (entry.mode & S_IFMT))
+        {
+            difference = "type";
+        }
+        else if (!S_ISLNK(entry.mode) && (status.st_mode & 07777) != (entry.mode & 07777))
+        {
+            difference = "mode";
+        }
+        else if (status.st_mtim.tv_sec * 1000000000LL + status.st_mtim.tv_nsec != entry.mtime)
+        {
+            difference = "mtime";
+        }
+        else if (S_ISLNK(entry.mode))
+        {
+            std::string link;
+            snapshot.read(index, [&link](const char* data, size_t size) { link.append(data, size); });
+            if (std::filesystem::read_symlink(path).string() != link)
+            {
+                difference = "target";
+            }
+        }
+        else if (S_ISREG(entry.mode) && !sameData(snapshot, index, path))
+        {
+            difference = "data";
+        }
+        if (difference != nullptr)
+        {
+            throw std::runtime_error("Restored " + path.string() + " differs from the snapshot: " + difference);
+        }
+    }
+
+    // Runs `apply` on the entries in batches on the pool, the paths of the
+    // ones which threw are added to `failed`
+    void forEachEntry(ThreadPool& pool, const Manifest& manifest, const std::vector<size_t>& selected,
+        const std::function<void(size_t)>& apply, std::vector<std::string>& failed)
+    {
+        std::mutex mutex;
+        TaskGroup group(pool);
+        for (size_t first = 0; first < selected.size(); first += batchEntries)
+        {
+            size_t last = std::min(first + batchEntries, selected.size());
+            group.run([&, first, last]
+            {
+                for (size_t i = first; i < last; ++i)
+                {
+                    try
+                    {
+                        apply(selected[i]);
+                    }
+                    catch (const std::exception& error)
+                    {
+                        syslog(LOG_WARNING, "%s", error.what());
+                        std::lock_guard<std::mutex> lock(mutex);
+                        failed.push_back(manifest[selected[i]].path);
+                    }
+                }
+            });
+        }
+        group.wait();
+    }
+}
+
+RestoreResult restoreSnapshot(const std::string& dst, const std::string& target, const RestoreOptions& options,
+    CopyEngine& engine, CopyProgress* progress)
+{
+    RestoreResult result;
+    result.snapshot = options.snapshot;
+    std::unique_ptr<Snapshot> snapshot = openSnapshot(dst, result.snapshot, engine.pool());
+    const Manifest& manifest = snapshot->entries();
+
+    std::vector<std::string> roots;
+    for (const std::string& path : options.paths)
+    {
+        roots.push_back(normalizePath(path));
+    }
+    std::vector<size_t> selected;
+    size_t files = 0;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < manifest.size(); ++i)
+    {
+        const Entry& entry = manifest[i];
+        if (!isSelected(entry.path, roots))
+        {
+            continue;
+        }
+        selected.push_back(i);
+        if (S_ISREG(entry.mode) || S_ISLNK(entry.mode))
+        {
+            ++files;
+            bytes += S_ISREG(entry.mode) ? entry.size : 0;
+        }
+    }
+    if (selected.empty())
+    {
+        throw std::runtime_error("Nothing to restore from " + result.snapshot);
+    }
+    result.entries = selected.size();
+    if (progress != nullptr)
+    {
+        progress->totalFiles = files;
+        progress->totalBytes = bytes;
+    }
+
+    // The parents of the selected paths are not restored, they only have to exist
+    std::filesystem::path root(target);
+    bool replace = std::filesystem::exists(root) && !std::filesystem::is_empty(root);
+    std::filesystem::create_directories(root);
+    for (const std::string& path : roots)
+    {
+        if (!path.empty())
+        {
+            std::filesystem::create_directories((root / path).parent_path());
+        }
+    }
+
+    // Restoring over an old tree, whatever is at the place of a file or a symlink goes away
+    ThreadPool& pool = engine.pool();
+    if (replace)
+    {
+        std::vector<std::string> ignored;
+        forEachEntry(pool, manifest, selected, [&manifest, &root](size_t index)
+        {
+            if (!S_ISDIR(manifest[index].mode))
+            {
+                unlink((root / manifest[index].path).c_str());
+            }
+        }, ignored);
+    }
+
+    CopyResult copied = snapshot->copy(selected, root, engine, progress);
+    result.stats = copied.stats;
+    result.failed = std::move(copied.failed);
+
+    // Metadata goes last: files and symlinks on the pool, then the directories
+    // deepest first, as restoring their children changed their mtime
+    std::vector<size_t> restored;
+    std::vector<size_t> directories;
+    for (size_t index : selected)
+    {
+        const Entry& entry = manifest[index];
+        if (std::binary_search(result.failed.begin(), result.failed.end(), entry.path))
+        {
+            continue;
+        }
+        if (S_ISDIR(entry.mode))
+        {
+            directories.push_back(index);
+        }
+        else if (S_ISREG(entry.mode) || S_ISLNK(entry.mode))
+        {
+            restored.push_back(index);
+        }
+    }
+    std::vector<std::string> failed;
+    forEachEntry(pool, manifest, restored, [&manifest, &root](size_t index)
+    {
+        applyMetadata(manifest[index], root / manifest[index].path);
+    }, failed);
+    // A path sorts after all of its parents
+    for (auto it = directories.rbegin(); it != directories.rend(); ++it)
+    {
+        try
+        {
+            applyMetadata(manifest[*it], root / manifest[*it].path);
+        }
+        catch (const std::exception& error)
+        {
+            syslog(LOG_WARNING, "%s", error.what());
+            failed.push_back(manifest[*it].path);
+        }
+    }
+    result.failed.insert(result.failed.end(), failed.begin(), failed.end());
+    std::sort(result.failed.begin(), result.failed.end());
+
+    if (options.verify)
+    {
+        restored.insert(restored.end(), directories.begin(), directories.end());
+        Snapshot& source = *snapshot;
+        forEachEntry(pool, manifest, restored, [&source, &manifest, &root](size_t index)
+        {
+            verifyEntry(source, index, root / manifest[index].path);
+        }, result.mismatched);
+        std::sort(result.mismatched.begin(), result.mismatched.end());
+    }
+    return result;
+}
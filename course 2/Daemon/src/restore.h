@@ -0,0 +1,41 @@
+#ifndef BACKUP_RESTORE_H
+#define BACKUP_RESTORE_H
+
+#include "copier.h"
+
+#include <string>
+#include <vector>
+
+struct RestoreOptions
+{
+    // Name of the snapshot in dst, the newest one if empty
+    std::string snapshot;
+    // Relative paths restored with everything below them, the whole snapshot if empty
+    std::vector<std::string> paths;
+    // Read everything back and compare it with the snapshot
+    bool verify = false;
+};
+
+struct RestoreResult
+{
+    std::string snapshot;
+    size_t entries = 0;
+    CopyStats stats;
+    // Relative paths which could not be restored
+    std::vector<std::string> failed;
+    // Relative paths which differ from the snapshot after --verify
+    std::vector<std::string> mismatched;
+};
+
+// Restores a snapshot of any [mode] type from dst into target in three
+// passes: directories are created, the data is copied on the pool of the
+// engine, then mode and mtime are applied, directories deepest first, so
+// nothing written later changes them. Directory snapshots go through
+// copyEntries() with the copy method of the engine, archives are copied with
+// copy_file_range() from the archive and dedup snapshots chunk by chunk.
+// A restore of the whole snapshot gives `target` the mode and mtime of the
+// source root.
+RestoreResult restoreSnapshot(const std::string& dst, const std::string& target, const RestoreOptions& options,
+    CopyEngine& engine, CopyProgress* progress = nullptr);
+
+#endif
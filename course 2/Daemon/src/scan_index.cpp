@@ -0,0 +1,361 @@
+#include "scan_index.h"
+
+#include "file_copy.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace
+{
+    const char magic[4] = {'B', 'K', 'I', '2'};
+    // shared, suffix length, size, mtime, inode, mode, origin, checksum
+    const size_t recordSize = 2 * sizeof(uint32_t) + 3 * sizeof(uint64_t) + 2 * sizeof(uint32_t) + sizeof(Digest);
+    const size_t trailerSize = 6 * sizeof(uint64_t) + sizeof(magic);
+    const size_t restartInterval = 16;
+    const size_t bufferSize = 1 << 20;
+
+    [[noreturn]] void fail(const std::string& message, const std::filesystem::path& path)
+    {
+        throw std::filesystem::filesystem_error(message, path, std::error_code(errno, std::generic_category()));
+    }
+
+    template <class T>
+    void append(std::vector<char>& buffer, const T& value)
+    {
+        const char* bytes = reinterpret_cast<const char*>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    template <class T>
+    T extract(const char*& data)
+    {
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        data += sizeof(T);
+        return value;
+    }
+
+    void appendString(std::vector<char>& buffer, const std::string& value)
+    {
+        append(buffer, static_cast<uint32_t>(value.size()));
+        buffer.insert(buffer.end(), value.begin(), value.end());
+    }
+}
+
+ScanIndex::ScanIndex(const std::filesystem::path& path)
+{
+    FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat status;
+    if (fd == -1 || fstat(fd, &status) != 0 || static_cast<size_t>(status.st_size) < sizeof(magic) + trailerSize)
+    {
+        return;
+    }
+    void* address = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED)
+    {
+        return;
+    }
+    memory = static_cast<const char*>(address);
+    length = status.st_size;
+
+    const char* trailer = memory + length - trailerSize;
+    uint64_t total = extract<uint64_t>(trailer);
+    uint64_t restartsOffset = extract<uint64_t>(trailer);
+    uint64_t restartTotal = extract<uint64_t>(trailer);
+    uint64_t originsOffset = extract<uint64_t>(trailer);
+    uint64_t originTotal = extract<uint64_t>(trailer);
+    uint64_t nameOffset = extract<uint64_t>(trailer);
+    uint64_t end = length - trailerSize;
+    bool valid = std::memcmp(memory, magic, sizeof(magic)) == 0 && std::memcmp(trailer, magic, sizeof(magic)) == 0
+        && restartsOffset >= sizeof(magic) && restartsOffset <= originsOffset && originsOffset <= nameOffset
+        && nameOffset + sizeof(uint32_t) <= end
+        && restartTotal == (total + restartInterval - 1) / restartInterval
+        && restartsOffset + restartTotal * sizeof(uint64_t) == originsOffset;
+
+    // The origins and the name are few short strings, everything else stays mapped
+    const char* data = memory + originsOffset;
+    for (uint64_t i = 0; valid && i < originTotal; ++i)
+    {
+        uint32_t size = data + sizeof(uint32_t) <= memory + nameOffset ? extract<uint32_t>(data) : 0;
+        valid = data + size <= memory + nameOffset;
+        origins.emplace_back(data, valid ? size : 0);
+        data += size;
+    }
+    data = memory + nameOffset;
+    uint32_t nameSize = valid ? extract<uint32_t>(data) : 0;
+    if (!valid || data + nameSize > memory + end)
+    {
+        // Treated as no index, the manifest is read instead
+        munmap(address, length);
+        memory = nullptr;
+        origins.clear();
+        return;
+    }
+    name.assign(data, nameSize);
+    records = memory + sizeof(magic);
+    recordsEnd = memory + restartsOffset;
+    restarts = recordsEnd;
+    restartCount = restartTotal;
+    count = total;
+}
+
+ScanIndex::~ScanIndex()
+{
+    if (memory != nullptr)
+    {
+        munmap(const_cast<char*>(memory), length);
+    }
+}
+
+const char* ScanIndex::decode(const char* record, std::string& path, Entry& entry) const
+{
+    if (record + recordSize > recordsEnd)
+    {
+        throw std::runtime_error("Corrupted index of " + name);
+    }
+    uint32_t shared = extract<uint32_t>(record);
+    uint32_t suffix = extract<uint32_t>(record);
+    entry.size = extract<uint64_t>(record);
+    entry.mtime = extract<int64_t>(record);
+    entry.inode = extract<uint64_t>(record);
+    entry.mode = extract<uint32_t>(record);
+    uint32_t origin = extract<uint32_t>(record);
+    entry.checksum = extract<Digest>(record);
+    if (shared > path.size() || record + suffix > recordsEnd || origin >= origins.size())
+    {
+        throw std::runtime_error("Corrupted index of " + name);
+    }
+    path.resize(shared);
+    path.append(record, suffix);
+    entry.origin = origins[origin];
+    return record + suffix;
+}
+
+bool ScanIndex::find(const std::string& path, Entry& entry) const
+{
+    // The last restart whose path is not greater than `path`
+    size_t first = 0;
+    size_t last = restartCount;
+    std::string current;
+    while (first < last)
+    {
+        size_t middle = first + (last - first) / 2;
+        const char* restart = restarts + middle * sizeof(uint64_t);
+        const char* record = memory + extract<uint64_t>(restart);
+        // A restart does not share anything with the previous record
+        current.clear();
+        decode(record, current, entry);
+        if (current <= path)
+        {
+            first = middle + 1;
+        }
+        else
+        {
+            last = middle;
+        }
+    }
+    if (first == 0)
+    {
+        return false;
+    }
+
+    const char* restart = restarts + (first - 1) * sizeof(uint64_t);
+    const char* record = memory + extract<uint64_t>(restart);
+    current.clear();
+    size_t remaining = std::min(restartInterval, count - (first - 1) * restartInterval);
+    for (size_t i = 0; i < remaining; ++i)
+    {
+        record = decode(record, current, entry);
+        int order = current.compare(path);
+        if (order == 0)
+        {
+            entry.path = current;
+            return true;
+        }
+        if (order > 0)
+        {
+            break;
+        }
+    }
+    return false;
+}
+
+bool ScanIndex::Cursor::next(Entry& entry)
+{
+    if (position == index.count)
+    {
+        return false;
+    }
+    record = index.decode(record, path, entry);
+    entry.path = path;
+    ++position;
+    return true;
+}
+
+void ScanIndex::forEach(const std::function<void(const Entry&)>& visit) const
+{
+    Cursor cursor(*this);
+    Entry entry;
+    while (cursor.next(entry))
+    {
+        visit(entry);
+    }
+}
+
+void ScanIndex::write(const std::filesystem::path& path, const Manifest& manifest, const std::string& snapshot)
+{
+    Writer writer(path);
+    for (const Entry& entry : manifest)
+    {
+        writer.add(entry);
+    }
+    writer.finish(snapshot);
+}
+
+ScanIndex::Writer::Writer(const std::filesystem::path& path):
+path(path),
+temporary(path.parent_path() / (path.filename().string() + ".tmp")),
+restartsPath(path.parent_path() / (path.filename().string() + ".restarts")),
+fd(open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)),
+restartsFd(open(restartsPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600))
+{
+    if (fd == -1 || restartsFd == -1)
+    {
+        int error = errno;
+        close(fd);
+        close(restartsFd);
+        errno = error;
+        fail("Failed to create", fd == -1 ? temporary : restartsPath);
+    }
+    buffer.insert(buffer.end(), magic, magic + sizeof(magic));
+}
+
+ScanIndex::Writer::~Writer()
+{
+    close(fd);
+    close(restartsFd);
+    std::error_code ignored;
+    std::filesystem::remove(restartsPath, ignored);
+    if (!finished)
+    {
+        std::filesystem::remove(temporary, ignored);
+    }
+}
+
+void ScanIndex::Writer::flush(int file, std::vector<char>& data, const std::filesystem::path& name)
+{
+    for (size_t written = 0; written < data.size();)
+    {
+        ssize_t size = ::write(file, data.data() + written, data.size() - written);
+        if (size < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fail("Failed to write", name);
+        }
+        written += size;
+    }
+    data.clear();
+}
+
+void ScanIndex::Writer::add(const Entry& entry)
+{
+    size_t shared = 0;
+    if (count % restartInterval == 0)
+    {
+        append(restartBuffer, offset + buffer.size());
+        ++restartCount;
+        if (restartBuffer.size() >= bufferSize)
+        {
+            flush(restartsFd, restartBuffer, restartsPath);
+        }
+    }
+    else
+    {
+        size_t limit = std::min(previous.size(), entry.path.size());
+        while (shared < limit && previous[shared] == entry.path[shared])
+        {
+            ++shared;
+        }
+    }
+    auto origin = originIds.emplace(entry.origin, originNames.size());
+    if (origin.second)
+    {
+        originNames.push_back(entry.origin);
+    }
+
+    append(buffer, static_cast<uint32_t>(shared));
+    append(buffer, static_cast<uint32_t>(entry.path.size() - shared));
+    append(buffer, entry.size);
+    append(buffer, entry.mtime);
+    append(buffer, entry.inode);
+    append(buffer, entry.mode);
+    append(buffer, origin.first->second);
+    append(buffer, entry.checksum);
+    buffer.insert(buffer.end(), entry.path.begin() + shared, entry.path.end());
+    previous = entry.path;
+    ++count;
+    if (buffer.size() >= bufferSize)
+    {
+        offset += buffer.size();
+        flush(fd, buffer, temporary);
+    }
+}
+
+void ScanIndex::Writer::finish(const std::string& snapshot)
+{
+    uint64_t restartsOffset = offset + buffer.size();
+    flush(fd, buffer, temporary);
+    flush(restartsFd, restartBuffer, restartsPath);
+    // The offsets were spilled to keep the memory flat, they are copied behind the records
+    for (uint64_t done = 0; done < restartCount * sizeof(uint64_t);)
+    {
+        buffer.resize(std::min<uint64_t>(bufferSize, restartCount * sizeof(uint64_t) - done));
+        ssize_t size = pread(restartsFd, buffer.data(), buffer.size(), done);
+        if (size <= 0)
+        {
+            if (size < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            fail("Failed to read", restartsPath);
+        }
+        buffer.resize(size);
+        done += size;
+        flush(fd, buffer, temporary);
+    }
+
+    uint64_t originsOffset = restartsOffset + restartCount * sizeof(uint64_t);
+    for (const std::string& origin : originNames)
+    {
+        appendString(buffer, origin);
+    }
+    uint64_t nameOffset = originsOffset + buffer.size();
+    appendString(buffer, snapshot);
+
+    append(buffer, count);
+    append(buffer, restartsOffset);
+    append(buffer, restartCount);
+    append(buffer, originsOffset);
+    append(buffer, static_cast<uint64_t>(originNames.size()));
+    append(buffer, nameOffset);
+    buffer.insert(buffer.end(), magic, magic + sizeof(magic));
+    flush(fd, buffer, temporary);
+
+    // The old index stays valid until the new one is complete on disk
+    if (fsync(fd) != 0)
+    {
+        fail("Failed to sync", temporary);
+    }
+    std::filesystem::rename(temporary, path);
+    finished = true;
+}
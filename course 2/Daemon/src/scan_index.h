@@ -0,0 +1,113 @@
+#ifndef BACKUP_SCAN_INDEX_H
+#define BACKUP_SCAN_INDEX_H
+
+#include "manifest.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+const std::string indexName = ".index";
+
+// dst/.index keeps the entries of the newest snapshot, so a cycle does not
+// have to parse its .manifest. Records are sorted by path and store only the
+// part of the path which differs from the previous record; every 16th record
+// is a restart with the full path. Opening maps the file and reads the
+// trailer, a lookup is a binary search over the restarts and a scan of at
+// most 16 records.
+class ScanIndex
+{
+public:
+    // Reads the entries one by one in path order, e.g. for a merge join with a sorted walk
+    class Cursor
+    {
+    public:
+        explicit Cursor(const ScanIndex& index): index(index), record(index.records) {}
+
+        // False after the last entry
+        bool next(Entry& entry);
+
+    private:
+        const ScanIndex& index;
+        const char* record;
+        size_t position = 0;
+        std::string path;
+    };
+
+    // Writes the index entry by entry into a temporary file next to `path`.
+    // Only the last path is kept, the offsets of the restarts go to a file
+    // of their own until finish() appends them.
+    class Writer
+    {
+    public:
+        explicit Writer(const std::filesystem::path& path);
+        ~Writer();
+
+        Writer(const Writer&) = delete;
+        Writer& operator=(const Writer&) = delete;
+
+        // Entries have to come sorted by path
+        void add(const Entry& entry);
+
+        // Syncs the index and renames it over the old one
+        void finish(const std::string& snapshot);
+
+    private:
+        void flush(int fd, std::vector<char>& buffer, const std::filesystem::path& file);
+
+        std::filesystem::path path;
+        std::filesystem::path temporary;
+        std::filesystem::path restartsPath;
+        int fd;
+        int restartsFd;
+        std::vector<char> buffer;
+        std::vector<char> restartBuffer;
+        uint64_t offset = 0;
+        uint64_t count = 0;
+        uint64_t restartCount = 0;
+        std::string previous;
+        std::unordered_map<std::string, uint32_t> originIds;
+        std::vector<std::string> originNames;
+        bool finished = false;
+    };
+
+    // A missing or corrupted index is empty
+    explicit ScanIndex(const std::filesystem::path& path);
+    ~ScanIndex();
+
+    ScanIndex(const ScanIndex&) = delete;
+    ScanIndex& operator=(const ScanIndex&) = delete;
+
+    // Snapshot whose manifest the index holds, empty if there is no index
+    const std::string& snapshot() const { return name; }
+
+    size_t size() const { return count; }
+
+    bool find(const std::string& path, Entry& entry) const;
+
+    // All entries in path order
+    void forEach(const std::function<void(const Entry&)>& visit) const;
+
+    // A whole manifest through a Writer. The manifest has to be sorted by path.
+    static void write(const std::filesystem::path& path, const Manifest& manifest, const std::string& snapshot);
+
+private:
+    // Decodes the record into `entry`, `path` holds the path of the previous
+    // record and becomes the one of this record. Returns the next record.
+    const char* decode(const char* record, std::string& path, Entry& entry) const;
+
+    const char* memory = nullptr;
+    size_t length = 0;
+    const char* records = nullptr;
+    const char* recordsEnd = nullptr;
+    const char* restarts = nullptr;
+    size_t restartCount = 0;
+    std::vector<std::string> origins;  // Few distinct snapshot names
+    size_t count = 0;
+    std::string name;
+};
+
+#endif
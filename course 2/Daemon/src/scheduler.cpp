@@ -0,0 +1,242 @@
+#include "scheduler.h"
+
+#include "backup.h"
+#include "snapshot.h"
+#include "throttle.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <syslog.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace
+{
+    // The disk of the path or of its nearest existing parent, dst may not exist
+    // yet. Filesystems without a block device (tmpfs, NFS) are told apart by st_dev.
+    std::string deviceOf(const std::string& path)
+    {
+        std::filesystem::path existing = std::filesystem::absolute(path);
+        std::error_code error;
+        while (!std::filesystem::exists(existing, error) && existing.has_relative_path())
+        {
+            existing = existing.parent_path();
+        }
+        std::string disk = diskNumber(existing);
+        if (!disk.empty())
+        {
+            return disk;
+        }
+        struct stat status;
+        if (stat(existing.c_str(), &status) != 0)
+        {
+            return path;
+        }
+        return "dev " + std::to_string(status.st_dev);
+    }
+
+    // Disks of the source and of every destination
+    std::set<std::string> devicesOf(const mINI::INIStructure& ini)
+    {
+        std::set<std::string> devices = {deviceOf(ini.get("src").get("path"))};
+        for (const std::string& dst : destinations(ini))
+        {
+            devices.insert(deviceOf(dst));
+        }
+        return devices;
+    }
+
+    // backup.ini with the keys of the job section put where backup() reads them
+    mINI::INIStructure jobConfig(const mINI::INIStructure& ini, const std::string& section)
+    {
+        mINI::INIStructure result = ini;
+        const auto& job = ini.get(section);
+        const std::pair<const char*, std::pair<const char*, const char*>> keys[] = {
+            {"src", {"src", "path"}},
+            {"dst", {"dst", "path"}},
+            {"sec", {"frequency", "sec"}},
+            {"mode", {"mode", "type"}},
+            {"watch", {"watch", "backend"}},
+            {"include", {"filter", "include"}},
+            {"exclude", {"filter", "exclude"}},
+        };
+        for (const auto& key : keys)
+        {
+            if (job.has(key.first))
+            {
+                result[key.second.first][key.second.second] = job.get(key.first);
+            }
+        }
+        // The dst of the job replaces the [dst.<name>] sections as well
+        if (job.has("dst"))
+        {
+            std::vector<std::string> sections;
+            for (const auto& other : ini)
+            {
+                if (other.first.compare(0, 4, "dst.") == 0)
+                {
+                    sections.push_back(other.first);
+                }
+            }
+            for (const std::string& name : sections)
+            {
+                result.remove(name);
+            }
+        }
+        return result;
+    }
+}
+
+Job::Job(const std::string& name, const mINI::INIStructure& ini, ThreadPool& pool):
+name(name),
+ini(ini),
+period(stoll(ini.get("frequency").get("sec")) * 1000000000),
+timer(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)),
+tracker(ini.get("src").get("path"), ini.get("watch").get("backend"), &pool, readFilter(ini)),
+devices(devicesOf(ini))
+{
+    if (timer == -1)
+    {
+        throw std::system_error(errno, std::generic_category(), "timerfd_create");
+    }
+    if (period <= 0)
+    {
+        close(timer);
+        throw std::runtime_error("Job " + name + ": sec has to be positive");
+    }
+}
+
+Job::~Job()
+{
+    close(timer);
+}
+
+std::vector<std::unique_ptr<Job>> readJobs(const mINI::INIStructure& ini, ThreadPool& pool)
+{
+    std::vector<std::unique_ptr<Job>> jobs;
+    for (const auto& section : ini)
+    {
+        if (section.first.compare(0, 4, "job.") == 0)
+        {
+            jobs.push_back(std::make_unique<Job>(section.first.substr(4), jobConfig(ini, section.first), pool));
+        }
+    }
+    if (jobs.empty())
+    {
+        jobs.push_back(std::make_unique<Job>("default", ini, pool));
+    }
+    return jobs;
+}
+
+JobScheduler::JobScheduler(CopyEngine& engine, size_t jobs, MetricsRegistry& metrics, const std::string& textfile):
+engine(engine),
+metrics(metrics),
+textfile(textfile)
+{
+    // More drivers than jobs would never have anything to do
+    for (size_t i = 0; i < jobs; ++i)
+    {
+        drivers.emplace_back(&JobScheduler::drive, this);
+    }
+}
+
+JobScheduler::~JobScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        queue.clear();
+    }
+    changed.notify_all();
+    for (std::thread& driver : drivers)
+    {
+        driver.join();
+    }
+}
+
+bool JobScheduler::submit(Job& job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (running.count(&job) != 0 || std::find(queue.begin(), queue.end(), &job) != queue.end())
+        {
+            return false;
+        }
+        queue.push_back(&job);
+    }
+    changed.notify_all();
+    return true;
+}
+
+void JobScheduler::cancel()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.clear();
+}
+
+Job* JobScheduler::next()
+{
+    for (auto it = queue.begin(); it != queue.end(); ++it)
+    {
+        Job* job = *it;
+        bool idle = std::none_of(job->devices.begin(), job->devices.end(),
+            [this](const std::string& device) { return busy.count(device) != 0; });
+        if (idle)
+        {
+            queue.erase(it);
+            return job;
+        }
+    }
+    return nullptr;
+}
+
+void JobScheduler::drive()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        Job* job = nullptr;
+        changed.wait(lock, [&] { return stopping || (job = next()) != nullptr; });
+        if (job == nullptr)
+        {
+            return;
+        }
+        running.insert(job);
+        busy.insert(job->devices.begin(), job->devices.end());
+        lock.unlock();
+
+        CycleMetrics cycle;
+        bool ran = false;
+        bool succeeded = true;
+        try
+        {
+            // A watched tree without changes costs nothing
+            if (job->tracker.hasChanges())
+            {
+                ran = true;
+                backup(job->ini, job->tracker, engine, cycle);
+            }
+        }
+        catch (const std::exception& error)
+        {
+            syslog(LOG_ERR, "Job %s failed: %s", job->name.c_str(), error.what());
+            succeeded = false;
+        }
+        if (ran)
+        {
+            metrics.record(job->name, cycle, succeeded);
+            metrics.writeTextfile(textfile);
+        }
+
+        lock.lock();
+        running.erase(job);
+        for (const std::string& device : job->devices)
+        {
+            busy.erase(device);
+        }
+        // The disks are free for the jobs waiting for them
+        changed.notify_all();
+    }
+}
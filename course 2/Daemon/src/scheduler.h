@@ -0,0 +1,84 @@
+#ifndef BACKUP_SCHEDULER_H
+#define BACKUP_SCHEDULER_H
+
+#include "copier.h"
+#include "metrics.h"
+#include "tracker.h"
+
+#include <mini/ini.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+// One [job.<name>] section of backup.ini. Its src, dst, sec, mode and watch
+// replace [src] path, [dst] path, [frequency] sec, [mode] type and [watch]
+// backend, the other sections are shared by all jobs.
+struct Job
+{
+    Job(const std::string& name, const mINI::INIStructure& ini, ThreadPool& pool);
+    ~Job();
+
+    Job(const Job&) = delete;
+    Job& operator=(const Job&) = delete;
+
+    std::string name;
+    mINI::INIStructure ini;        // backup.ini as seen by this job
+    int64_t period;                // Nanoseconds between cycles
+    int64_t start = 0;             // Monotonic time of the first cycle
+    int timer;                     // timerfd of the cadence
+    ChangeTracker tracker;
+    std::set<std::string> devices; // Disks of src and dst
+};
+
+// The [job.*] sections, or one job named "default" from [src], [dst] and
+// [frequency] if there are none. Their scans run on the pool.
+std::vector<std::unique_ptr<Job>> readJobs(const mINI::INIStructure& ini, ThreadPool& pool);
+
+// Runs the cycles of due jobs on driver threads, the copying itself is done
+// by the shared pool of the engine. A job starts only when none of its disks
+// is used by a running job, so jobs on one spindle take turns while jobs on
+// different disks run in parallel. Due jobs wait in one queue in the order
+// they became due, and a job is due again only after its cycle has finished,
+// so every job of a disk gets its turn. Every cycle is recorded in the
+// registry and the registry is written to `textfile` if it is set.
+class JobScheduler
+{
+public:
+    JobScheduler(CopyEngine& engine, size_t jobs, MetricsRegistry& metrics, const std::string& textfile);
+    // Waits for the running cycles, the queued ones are dropped
+    ~JobScheduler();
+
+    JobScheduler(const JobScheduler&) = delete;
+    JobScheduler& operator=(const JobScheduler&) = delete;
+
+    // False if the previous cycle of the job is still queued or running
+    bool submit(Job& job);
+
+    // Drops the cycles which have not started yet
+    void cancel();
+
+private:
+    void drive();
+    // The first queued job whose disks are idle, or nullptr
+    Job* next();
+
+    CopyEngine& engine;
+    MetricsRegistry& metrics;
+    std::string textfile;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<Job*> queue;
+    std::set<const Job*> running;
+    std::set<std::string> busy;
+    bool stopping = false;
+    std::vector<std::thread> drivers;
+};
+
+#endif
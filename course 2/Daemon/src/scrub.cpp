@@ -0,0 +1,321 @@
+#include "scrub.h"
+
+#include "cache.h"
+#include "compress.h"
+#include "file_copy.h"
+#include "manifest.h"
+#include "snapshot.h"
+#include "store.h"
+
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <filesystem>
+#include <set>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+
+namespace
+{
+    const size_t bufferSize = 1 << 20;
+    const size_t batchSize = 64;
+
+    // Shared by the tasks of one scrubDestination()
+    struct ScrubState
+    {
+        ScrubState(ThreadPool& pool, Throttle& throttle, const std::function<bool()>& proceed):
+        group(pool),
+        throttle(throttle),
+        gate(proceed)
+        {
+        }
+
+        // False from the first refusal of the gate on
+        bool proceed()
+        {
+            if (!stopped && !gate())
+            {
+                stopped = true;
+            }
+            return !stopped;
+        }
+
+        void read(uint64_t size)
+        {
+            throttle.consume(size);
+            bytes += size;
+        }
+
+        void corrupt(const std::string& what)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            corrupted.push_back(what);
+        }
+
+        // Hard links of one file in several snapshots are read once
+        bool firstLink(const struct stat& status)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return inodes.emplace(status.st_dev, status.st_ino).second;
+        }
+
+        TaskGroup group;
+        Throttle& throttle;
+        const std::function<bool()>& gate;
+        std::atomic<bool> stopped{false};
+        std::atomic<size_t> files{0};
+        std::atomic<uint64_t> bytes{0};
+        std::mutex mutex;
+        std::set<std::pair<dev_t, ino_t>> inodes;
+        std::vector<std::string> corrupted;
+    };
+
+    [[noreturn]] void fail(const std::string& message, const std::filesystem::path& path)
+    {
+        throw std::filesystem::filesystem_error(message, path, std::error_code(errno, std::generic_category()));
+    }
+
+    // Digest of the data as it was before compression, false if stopped
+    bool hashFile(ScrubState& state, int fd, const std::filesystem::path& path, Digest& digest)
+    {
+        thread_local std::vector<char> buffer(bufferSize);
+        DigestBuilder builder;
+        if (CompressedFile::isCompressed(path))
+        {
+            CompressedFile file(path);
+            uint64_t offset = 0;
+            while (state.proceed())
+            {
+                size_t count = file.read(offset, buffer.data(), buffer.size());
+                if (count == 0)
+                {
+                    digest = builder.finish();
+                    return true;
+                }
+                builder.put(buffer.data(), count);
+                offset += count;
+                state.read(count);
+            }
+            return false;
+        }
+
+        off_t offset = 0;
+        while (state.proceed())
+        {
+            ssize_t count = pread(fd, buffer.data(), buffer.size(), offset);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                fail("Failed to read", path);
+            }
+            if (count == 0)
+            {
+                digest = builder.finish();
+                return true;
+            }
+            builder.put(buffer.data(), count);
+            offset += count;
+            state.read(count);
+        }
+        return false;
+    }
+
+    void scrubFile(ScrubState& state, const std::filesystem::path& path, const Digest& expected)
+    {
+        FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        struct stat status;
+        if (fd == -1 || fstat(fd, &status) != 0)
+        {
+            fail("Failed to open", path);
+        }
+        if (!state.firstLink(status))
+        {
+            return;
+        }
+        // Reading everything back must not push the working set of the host out
+        PageCacheGuard cache(fd, true);
+        Digest digest;
+        if (!hashFile(state, fd, path, digest))
+        {
+            return;
+        }
+        ++state.files;
+        if (digest != expected)
+        {
+            syslog(LOG_ERR, "Checksum mismatch of %s: %s instead of %s", path.c_str(), toHex(digest).c_str(),
+                toHex(expected).c_str());
+            state.corrupt(path.string());
+        }
+    }
+
+    void scrubSnapshot(ScrubState& state, const std::filesystem::path& dst, const std::string& name)
+    {
+        std::filesystem::path root = dst / name;
+        // Unchanged entries of incremental snapshots are checked where their data is
+        Manifest files;
+        for (Entry& entry : readManifest((root / manifestName).string()))
+        {
+            if (S_ISREG(entry.mode) && entry.origin == name && entry.checksum != Digest{})
+            {
+                files.push_back(std::move(entry));
+            }
+        }
+
+        for (size_t first = 0; first < files.size(); first += batchSize)
+        {
+            size_t last = std::min(first + batchSize, files.size());
+            state.group.run([&state, &files, &root, first, last]
+            {
+                for (size_t i = first; i < last && state.proceed(); ++i)
+                {
+                    std::filesystem::path path = root / files[i].path;
+                    try
+                    {
+                        scrubFile(state, path, files[i].checksum);
+                    }
+                    catch (const std::exception& error)
+                    {
+                        // Unless the snapshot was removed in the meantime
+                        std::error_code ignored;
+                        if (std::filesystem::exists(root, ignored))
+                        {
+                            syslog(LOG_ERR, "%s", error.what());
+                            state.corrupt(path.string());
+                        }
+                    }
+                }
+            });
+        }
+        state.group.wait();
+    }
+
+    void scrubStore(ScrubState& state, const std::filesystem::path& root)
+    {
+        Store store(root);
+        std::vector<std::vector<Digest>> packs = store.chunksByPack();
+        for (const std::vector<Digest>& chunks : packs)
+        {
+            state.group.run([&state, &store, &root, &chunks]
+            {
+                if (!state.proceed())
+                {
+                    return;
+                }
+                std::vector<Digest> corrupted = store.verifyChunks(chunks, [&state](uint64_t size)
+                {
+                    ++state.files;
+                    state.read(size);
+                });
+                for (const Digest& digest : corrupted)
+                {
+                    syslog(LOG_ERR, "Chunk %s in %s does not match its digest", toHex(digest).c_str(), root.c_str());
+                    state.corrupt("chunk " + toHex(digest));
+                }
+            });
+        }
+        state.group.wait();
+    }
+}
+
+ScrubResult scrubDestination(const std::string& dst, ThreadPool& pool, Throttle& throttle,
+    const std::function<bool()>& proceed)
+{
+    auto start = std::chrono::steady_clock::now();
+    ScrubState state(pool, throttle, proceed);
+    std::filesystem::path root(dst);
+    for (const std::string& name : listSnapshots(dst))
+    {
+        if (state.proceed() && std::filesystem::exists(root / name / manifestName))
+        {
+            scrubSnapshot(state, root, name);
+        }
+    }
+    if (state.proceed() && std::filesystem::is_directory(root / ".store"))
+    {
+        scrubStore(state, root / ".store");
+    }
+
+    ScrubResult result;
+    result.files = state.files;
+    result.bytes = state.bytes;
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.corrupted = std::move(state.corrupted);
+    return result;
+}
+
+Scrubber::Scrubber(std::vector<Target> targets, int64_t period, uint64_t bandwidth, size_t threads,
+    MetricsRegistry& metrics, const std::string& textfile):
+targets(std::move(targets)),
+period(period),
+metrics(metrics),
+textfile(textfile),
+pool(threads)
+{
+    throttle.setLimits(bandwidth, 0);
+    thread = std::thread([this] { run(); });
+}
+
+Scrubber::~Scrubber()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    thread.join();
+}
+
+void Scrubber::setPaused(bool paused)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->paused = paused;
+    }
+    changed.notify_all();
+}
+
+bool Scrubber::proceed()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] { return stopping || !paused; });
+    return !stopping;
+}
+
+void Scrubber::run()
+{
+    // The first scrub starts one period after the daemon, the first cycles come first
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!changed.wait_for(lock, period, [this] { return stopping; }))
+    {
+        lock.unlock();
+        for (const Target& target : targets)
+        {
+            ScrubResult result;
+            try
+            {
+                result = scrubDestination(target.dst, pool, throttle, [this] { return proceed(); });
+            }
+            catch (const std::exception& error)
+            {
+                syslog(LOG_ERR, "Failed to scrub %s: %s", target.dst.c_str(), error.what());
+                continue;
+            }
+            if (!proceed())
+            {
+                break;
+            }
+            syslog(result.corrupted.empty() ? LOG_INFO : LOG_ERR,
+                "Scrubbed %s of job %s: %zu files and chunks, %.1f MiB in %.2f s, %zu corrupted", target.dst.c_str(),
+                target.job.c_str(), result.files, result.bytes / 1048576.0, result.seconds, result.corrupted.size());
+            metrics.recordScrub(target.job, result.bytes, result.corrupted.size());
+            metrics.writeTextfile(textfile);
+        }
+        lock.lock();
+    }
+}
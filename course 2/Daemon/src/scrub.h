@@ -0,0 +1,76 @@
+#ifndef BACKUP_SCRUB_H
+#define BACKUP_SCRUB_H
+
+#include "metrics.h"
+#include "thread_pool.h"
+#include "throttle.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ScrubResult
+{
+    size_t files = 0;    // Files and chunks read back
+    uint64_t bytes = 0;
+    double seconds = 0;
+    // Paths of the files and digests of the chunks which do not match
+    std::vector<std::string> corrupted;
+};
+
+// Reads the snapshots in dst back on the pool and compares every file with
+// the checksum its manifest recorded when it was copied, a file linked into
+// several snapshots once, and every chunk of a dedup store with its digest.
+// Entries without a checksum, archives and full snapshots are not checked.
+// `proceed` is asked before every buffer, it may block while the scrub is
+// paused and stops it by returning false.
+ScrubResult scrubDestination(const std::string& dst, ThreadPool& pool, Throttle& throttle,
+    const std::function<bool()>& proceed);
+
+// Scrubs the dst of every job once a period on threads of its own, limited
+// to `bandwidth` bytes per second, so the cycles keep the copy workers and
+// most of the disk. Mismatches are logged and every scrub is recorded in the
+// registry.
+class Scrubber
+{
+public:
+    struct Target
+    {
+        std::string job;
+        std::string dst;
+    };
+
+    Scrubber(std::vector<Target> targets, int64_t period, uint64_t bandwidth, size_t threads,
+        MetricsRegistry& metrics, const std::string& textfile);
+    // A running scrub stops after the buffer it reads
+    ~Scrubber();
+
+    Scrubber(const Scrubber&) = delete;
+    Scrubber& operator=(const Scrubber&) = delete;
+
+    // A paused scrub waits before its next buffer
+    void setPaused(bool paused);
+
+private:
+    void run();
+    bool proceed();
+
+    std::vector<Target> targets;
+    std::chrono::seconds period;
+    MetricsRegistry& metrics;
+    std::string textfile;
+    ThreadPool pool;
+    Throttle throttle;
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool paused = false;
+    bool stopping = false;
+    std::thread thread;
+};
+
+#endif
@@ -0,0 +1,83 @@
+#include "snapshot.h"
+
+#include "filter.h"
+
+#include <algorithm>
+#include <ctime>
+#include <filesystem>
+#include <iomanip>
+#include <sstream>
+
+namespace
+{
+    const char* const snapshotFormat = "%d.%m.%Y %H-%M-%S";
+
+    bool parseSnapshotName(const std::string& name, std::tm& data)
+    {
+        data = std::tm();
+        std::istringstream stream(name);
+        stream >> std::get_time(&data, snapshotFormat);
+        return !stream.fail() && stream.peek() == std::char_traits<char>::eof();
+    }
+}
+
+const std::string currentDatetime()
+{
+    time_t now = time(0);
+    tm* data = localtime(&now);
+
+    std::ostringstream stream;
+    stream << std::put_time(data, snapshotFormat);
+    return stream.str();
+}
+
+bool isSnapshotName(const std::string& name)
+{
+    std::tm data;
+    return parseSnapshotName(name, data);
+}
+
+std::vector<std::string> listSnapshots(const std::string& dst)
+{
+    std::vector<std::pair<time_t, std::string>> found;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(dst, error))
+    {
+        std::string name = entry.path().filename().string();
+        std::tm data;
+        if ((entry.is_directory() || entry.is_regular_file()) && parseSnapshotName(name, data))
+        {
+            data.tm_isdst = -1;
+            found.emplace_back(mktime(&data), name);
+        }
+    }
+
+    // Names are day-first, so they have to be ordered by the parsed time
+    std::sort(found.begin(), found.end());
+
+    std::vector<std::string> names;
+    for (auto& snapshot : found)
+    {
+        names.push_back(std::move(snapshot.second));
+    }
+    return names;
+}
+
+std::string latestSnapshot(const std::string& dst)
+{
+    std::vector<std::string> names = listSnapshots(dst);
+    return names.empty() ? std::string() : names.back();
+}
+
+std::vector<std::string> destinations(const mINI::INIStructure& ini)
+{
+    std::vector<std::string> paths = splitList(ini.get("dst").get("path"));
+    for (const auto& section : ini)
+    {
+        if (section.first.compare(0, 4, "dst.") == 0 && !section.second.get("path").empty())
+        {
+            paths.push_back(section.second.get("path"));
+        }
+    }
+    return paths;
+}
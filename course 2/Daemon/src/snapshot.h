@@ -0,0 +1,25 @@
+#ifndef BACKUP_SNAPSHOT_H
+#define BACKUP_SNAPSHOT_H
+
+#include <mini/ini.h>
+
+#include <string>
+#include <vector>
+
+// Snapshot directories are named after the moment they were taken
+const std::string currentDatetime();
+
+// Returns true if name looks like "%d.%m.%Y %H-%M-%S"
+bool isSnapshotName(const std::string& name);
+
+// Snapshot names (directories or files) found in dst, oldest first
+std::vector<std::string> listSnapshots(const std::string& dst);
+
+// Name of the newest snapshot in dst or empty string if there is none
+std::string latestSnapshot(const std::string& dst);
+
+// Every destination of the job: the comma-separated paths of [dst] path
+// followed by the path of every [dst.<name>] section
+std::vector<std::string> destinations(const mINI::INIStructure& ini);
+
+#endif
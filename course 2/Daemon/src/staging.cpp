@@ -0,0 +1,254 @@
+#include "staging.h"
+
+#include "compress.h"
+#include "file_copy.h"
+#include "walker.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+    const std::string stagingName = ".staging";
+    const std::string journalName = ".staging.journal";
+    const size_t flushSize = 64 * 1024;
+
+    [[noreturn]] void fail(const std::string& message, const std::filesystem::path& path)
+    {
+        throw std::filesystem::filesystem_error(message, path, std::error_code(errno, std::generic_category()));
+    }
+
+    // True if the staged file holds all of `entry`. The journal is written
+    // before the data is synced, after a power loss a recorded file may be
+    // cut off or empty. Its checksum is compared when the journal has one.
+    bool intact(const std::filesystem::path& path, const Entry& entry, const Digest& checksum)
+    {
+        try
+        {
+            if (CompressedFile::isCompressed(path))
+            {
+                CompressedFile file(path);
+                if (file.size() != entry.size)
+                {
+                    return false;
+                }
+                if (checksum == Digest{})
+                {
+                    return true;
+                }
+                std::vector<char> buffer(1 << 20);
+                DigestBuilder builder;
+                uint64_t offset = 0;
+                while (size_t count = file.read(offset, buffer.data(), buffer.size()))
+                {
+                    builder.put(buffer.data(), count);
+                    offset += count;
+                }
+                return builder.finish() == checksum;
+            }
+            FileDescriptor fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+            struct stat status;
+            if (fd == -1 || fstat(fd, &status) != 0 || static_cast<uint64_t>(status.st_size) != entry.size)
+            {
+                return false;
+            }
+            return checksum == Digest{} || digestFile(fd, path) == checksum;
+        }
+        catch (const std::exception&)
+        {
+            return false;
+        }
+    }
+}
+
+CopyJournal::CopyJournal(const std::filesystem::path& path, const std::string& header, bool resume):
+path(path),
+fd(-1),
+written(std::chrono::steady_clock::now())
+{
+    // Only complete lines count, the last one may be cut off by the crash
+    std::streamoff end = 0;
+    if (resume)
+    {
+        std::ifstream stream(path);
+        std::string line;
+        if (std::getline(stream, line) && !stream.eof() && line == header)
+        {
+            end = stream.tellg();
+            Entry entry;
+            while (std::getline(stream, line) && !stream.eof() && parseEntry(line, entry))
+            {
+                end = stream.tellg();
+                previous[entry.path] = std::move(entry);
+            }
+        }
+    }
+
+    if (!previous.empty())
+    {
+        fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd == -1 || ftruncate(fd, end) != 0)
+        {
+            fail("Failed to open", path);
+        }
+        return;
+    }
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        fail("Failed to create", path);
+    }
+    write(header + "\n");
+}
+
+CopyJournal::~CopyJournal()
+{
+    flush();
+    close(fd);
+}
+
+bool CopyJournal::finished(const Entry& entry, Digest& checksum) const
+{
+    auto found = previous.find(entry.path);
+    if (found == previous.end() || isChanged(entry, found->second))
+    {
+        return false;
+    }
+    checksum = found->second.checksum;
+    return true;
+}
+
+void CopyJournal::record(const Entry& entry, const Digest& checksum)
+{
+    Entry finished = entry;
+    finished.checksum = checksum;
+    std::string line = formatEntry(finished);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    buffer += line;
+    auto now = std::chrono::steady_clock::now();
+    if (buffer.size() >= flushSize || now - written >= std::chrono::seconds(1))
+    {
+        write(buffer);
+        buffer.clear();
+        written = now;
+    }
+}
+
+void CopyJournal::flush()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    write(buffer);
+    buffer.clear();
+}
+
+void CopyJournal::write(const std::string& data)
+{
+    // Without the journal the next cycle copies more, the snapshot itself is fine
+    for (size_t offset = 0; offset < data.size();)
+    {
+        ssize_t count = ::write(fd, data.data() + offset, data.size() - offset);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            syslog(LOG_WARNING, "Failed to write %s: %s", path.c_str(), strerror(errno));
+            return;
+        }
+        offset += count;
+    }
+}
+
+Staging::Staging(const std::filesystem::path& dst, const std::string& mode, const std::string& previous):
+dst(dst),
+directory(dst / stagingName),
+log(dst / journalName, "BKJ1\t" + mode + "\t" + previous, std::filesystem::is_directory(directory))
+{
+    if (log.resumed().empty())
+    {
+        // Nothing in it was recorded, any file may be cut off
+        std::filesystem::remove_all(directory);
+    }
+    else
+    {
+        syslog(LOG_INFO, "Resuming the interrupted cycle in %s with %zu finished entries", directory.c_str(),
+            log.resumed().size());
+    }
+    std::filesystem::create_directories(directory);
+}
+
+void Staging::prune(const EntryStream::Produce& scan)
+{
+    if (log.resumed().empty())
+    {
+        return;
+    }
+    // Also the files written in the last second before the crash, they are not
+    // in the journal. A link into an older snapshot is unlinked, not written through.
+    // Both walks are in path order, the staged one skips what was removed.
+    EntryStream current(scan);
+    Digest checksum;
+    streamTree(directory.string(), nullptr, [this, &current, &checksum](Entry& staged)
+    {
+        while (current.peek() != nullptr && current.peek()->path < staged.path)
+        {
+            current.take();
+        }
+        const Entry* entry = current.peek();
+        bool known = entry != nullptr && entry->path == staged.path;
+        bool keep = known && (S_ISDIR(staged.mode) ? S_ISDIR(entry->mode) : log.finished(*entry, checksum));
+        if (keep && S_ISREG(staged.mode) && !intact(directory / staged.path, *entry, checksum))
+        {
+            syslog(LOG_WARNING, "Copying %s again, its staged copy does not match the journal", staged.path.c_str());
+            log.forget(staged.path);
+            keep = false;
+        }
+        if (!keep)
+        {
+            std::error_code ignored;
+            std::filesystem::remove_all(directory / staged.path, ignored);
+        }
+        return true;
+    });
+}
+
+void Staging::commit(const std::string& name, const Entry& root)
+{
+    log.flush();
+    // Nothing is written into the directory from here on
+    timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = root.mtime / 1000000000;
+    times[1].tv_nsec = root.mtime % 1000000000;
+    if (times[1].tv_nsec < 0)
+    {
+        times[1].tv_nsec += 1000000000;
+        --times[1].tv_sec;
+    }
+    if (chmod(directory.c_str(), root.mode & 07777) != 0 || utimensat(AT_FDCWD, directory.c_str(), times, 0) != 0)
+    {
+        fail("Failed to set the metadata of", directory);
+    }
+    FileDescriptor fd(open(dst.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (fd == -1 || syncfs(fd) != 0)
+    {
+        fail("Failed to sync", dst);
+    }
+    std::filesystem::rename(directory, dst / name);
+    // The rename itself
+    if (fsync(fd) != 0)
+    {
+        fail("Failed to sync", dst);
+    }
+    std::filesystem::remove(dst / journalName);
+}
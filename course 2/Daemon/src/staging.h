@@ -0,0 +1,86 @@
+#ifndef BACKUP_STAGING_H
+#define BACKUP_STAGING_H
+
+#include "manifest.h"
+#include "pipeline.h"
+
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Append-only list of the entries a cycle has finished, one manifest line
+// each. Records are buffered and written at least once a second, so a
+// killed cycle loses the records of its last second at most.
+class CopyJournal
+{
+public:
+    // Keeps the records of an interrupted cycle if `resume` is set and the
+    // journal starts with `header`, otherwise starts a new one
+    CopyJournal(const std::filesystem::path& path, const std::string& header, bool resume);
+    ~CopyJournal();
+
+    CopyJournal(const CopyJournal&) = delete;
+    CopyJournal& operator=(const CopyJournal&) = delete;
+
+    // Entries finished by the interrupted cycle by path
+    const std::unordered_map<std::string, Entry>& resumed() const { return previous; }
+
+    // True if the interrupted cycle finished the entry and its source has not
+    // changed since, `checksum` is the one it recorded
+    bool finished(const Entry& entry, Digest& checksum) const;
+
+    // The entry is copied again, e.g. its staged file is cut off. Not
+    // thread-safe, called before the copy starts.
+    void forget(const std::string& path) { previous.erase(path); }
+
+    // Called by all copy workers at once
+    void record(const Entry& entry, const Digest& checksum = Digest{});
+    void flush();
+
+private:
+    void write(const std::string& data);
+
+    std::filesystem::path path;
+    int fd;
+    std::unordered_map<std::string, Entry> previous;
+    std::mutex mutex;
+    std::string buffer;
+    std::chrono::steady_clock::time_point written;
+};
+
+// Directory snapshots are built in dst/.staging and published with a single
+// rename(), so a killed cycle never leaves a directory which looks like a
+// snapshot. The finished entries go to the journal dst/.staging.journal and
+// the next cycle of the same mode on top of the same snapshot copies only
+// the rest.
+class Staging
+{
+public:
+    // Resumes the staging directory of an interrupted cycle of `mode` whose
+    // previous snapshot was `previous`, otherwise starts an empty one
+    Staging(const std::filesystem::path& dst, const std::string& mode, const std::string& previous);
+
+    const std::filesystem::path& path() const { return directory; }
+    CopyJournal& journal() { return log; }
+
+    // Removes everything the interrupted cycle left which is not a finished
+    // entry of the current tree with the same metadata or one of its
+    // directories, and the finished files whose staged size or checksum is
+    // not the recorded one. `scan` streams the tree, it is walked only on a resume.
+    void prune(const EntryStream::Produce& scan);
+
+    // The directory gets the mode and mtime of `root`, the source root, and
+    // stands for it in a restore. One syncfs() makes all files durable instead
+    // of an fsync() each, then the directory is renamed to dst/name and the
+    // journal is removed.
+    void commit(const std::string& name, const Entry& root);
+
+private:
+    std::filesystem::path dst;
+    std::filesystem::path directory;
+    CopyJournal log;
+};
+
+#endif
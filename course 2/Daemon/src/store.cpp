@@ -0,0 +1,499 @@
+#include "store.h"
+
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <syslog.h>
+#include <unistd.h>
+#include <unordered_set>
+
+namespace
+{
+    // Every chunk in a pack is preceded by its digest and length,
+    // so the index can be rebuilt from the packs alone
+    const size_t chunkHeaderSize = sizeof(Digest) + sizeof(uint32_t);
+    const size_t indexRecordSize = sizeof(Digest) + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t);
+    const size_t bufferSize = 4 << 20;
+
+    void writeAll(int fd, const unsigned char* data, size_t size, const std::string& name)
+    {
+        while (size > 0)
+        {
+            ssize_t written = write(fd, data, size);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category(), "Failed to write " + name);
+            }
+            data += written;
+            size -= written;
+        }
+    }
+
+    template <class T>
+    void append(std::vector<unsigned char>& buffer, const T& value)
+    {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+    }
+
+    template <class T>
+    T extract(const unsigned char*& data)
+    {
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        data += sizeof(T);
+        return value;
+    }
+
+    bool parsePackName(const std::filesystem::path& path, uint32_t& pack)
+    {
+        if (path.extension() != ".pack")
+        {
+            return false;
+        }
+        char* end = nullptr;
+        std::string stem = path.stem().string();
+        pack = strtoul(stem.c_str(), &end, 10);
+        return !stem.empty() && *end == '\0';
+    }
+}
+
+Store::Store(const std::filesystem::path& root, uint64_t packSize):
+root(root),
+packSize(packSize)
+{
+    std::filesystem::create_directories(root / "packs");
+    std::filesystem::create_directories(root / "snapshots");
+
+    std::ifstream stream(root / "index", std::ios::binary);
+    unsigned char record[indexRecordSize];
+    while (stream.read(reinterpret_cast<char*>(record), indexRecordSize))
+    {
+        const unsigned char* data = record;
+        Digest digest = extract<Digest>(data);
+        Location location;
+        location.pack = extract<uint32_t>(data);
+        location.offset = extract<uint64_t>(data);
+        location.length = extract<uint32_t>(data);
+        index[digest] = location;
+    }
+
+    // Keep appending to the newest pack until it is full
+    for (const auto& item : std::filesystem::directory_iterator(root / "packs"))
+    {
+        uint32_t pack;
+        if (parsePackName(item.path(), pack) && pack >= currentPack)
+        {
+            currentPack = pack;
+            currentOffset = item.file_size();
+        }
+    }
+}
+
+Store::~Store()
+{
+    try
+    {
+        flush();
+    }
+    catch (const std::exception& error)
+    {
+        syslog(LOG_ERR, "%s", error.what());
+    }
+    if (packFd != -1)
+    {
+        close(packFd);
+    }
+}
+
+std::filesystem::path Store::packPath(uint32_t pack) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%08u.pack", pack);
+    return root / "packs" / name;
+}
+
+void Store::openPack(uint32_t pack)
+{
+    if (packFd != -1)
+    {
+        writeBuffer();
+        fdatasync(packFd);
+        close(packFd);
+    }
+    packFd = open(packPath(pack).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (packFd == -1)
+    {
+        throw std::system_error(errno, std::generic_category(), "Failed to open " + packPath(pack).string());
+    }
+    currentPack = pack;
+    currentOffset = lseek(packFd, 0, SEEK_END);
+}
+
+void Store::writeBuffer()
+{
+    if (!buffer.empty())
+    {
+        writeAll(packFd, buffer.data(), buffer.size(), packPath(currentPack));
+        buffer.clear();
+    }
+}
+
+bool Store::has(const Digest& digest) const
+{
+    return index.count(digest) != 0;
+}
+
+bool Store::put(const Digest& digest, const unsigned char* data, size_t size)
+{
+    if (has(digest))
+    {
+        return false;
+    }
+
+    if (currentOffset > 0 && currentOffset + chunkHeaderSize + size > packSize)
+    {
+        openPack(currentPack + 1);
+    }
+    else if (packFd == -1)
+    {
+        openPack(currentPack);
+    }
+
+    append(buffer, digest);
+    append(buffer, uint32_t(size));
+    buffer.insert(buffer.end(), data, data + size);
+
+    Location location{currentPack, currentOffset + chunkHeaderSize, uint32_t(size)};
+    currentOffset += chunkHeaderSize + size;
+    index[digest] = location;
+    pending.emplace_back(digest, location);
+
+    if (buffer.size() >= bufferSize)
+    {
+        writeBuffer();
+    }
+    return true;
+}
+
+std::vector<unsigned char> Store::get(const Digest& digest) const
+{
+    auto found = index.find(digest);
+    if (found == index.end())
+    {
+        throw std::runtime_error("Missing chunk " + toHex(digest));
+    }
+    const Location& location = found->second;
+    std::vector<unsigned char> data(location.length);
+
+    // The chunk may still wait in the write buffer
+    uint64_t bufferStart = currentOffset - buffer.size();
+    if (location.pack == currentPack && location.offset >= bufferStart && packFd != -1)
+    {
+        std::memcpy(data.data(), buffer.data() + (location.offset - bufferStart), data.size());
+        return data;
+    }
+
+    int fd = open(packPath(location.pack).c_str(), O_RDONLY | O_CLOEXEC);
+    ssize_t count = fd == -1 ? -1 : pread(fd, data.data(), data.size(), location.offset);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    if (count != ssize_t(data.size()))
+    {
+        throw std::runtime_error("Failed to read chunk " + toHex(digest));
+    }
+    return data;
+}
+
+void Store::flush()
+{
+    if (packFd == -1 || pending.empty())
+    {
+        return;
+    }
+    writeBuffer();
+    if (fdatasync(packFd) != 0)
+    {
+        throw std::system_error(errno, std::generic_category(), "Failed to sync " + packPath(currentPack).string());
+    }
+
+    // The index is appended only after the data it points to is durable
+    std::vector<unsigned char> records;
+    for (const auto& item : pending)
+    {
+        append(records, item.first);
+        append(records, item.second.pack);
+        append(records, item.second.offset);
+        append(records, item.second.length);
+    }
+    std::string indexPath = root / "index";
+    int fd = open(indexPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        throw std::system_error(errno, std::generic_category(), "Failed to open " + indexPath);
+    }
+    writeAll(fd, records.data(), records.size(), indexPath);
+    fdatasync(fd);
+    close(fd);
+    pending.clear();
+}
+
+void Store::writeIndex()
+{
+    std::vector<unsigned char> records;
+    records.reserve(index.size() * indexRecordSize);
+    for (const auto& item : index)
+    {
+        append(records, item.first);
+        append(records, item.second.pack);
+        append(records, item.second.offset);
+        append(records, item.second.length);
+    }
+
+    std::string temporary = root / "index.tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        throw std::system_error(errno, std::generic_category(), "Failed to open " + temporary);
+    }
+    writeAll(fd, records.data(), records.size(), temporary);
+    fdatasync(fd);
+    close(fd);
+    std::filesystem::rename(temporary, root / "index");
+    pending.clear();
+}
+
+std::vector<std::vector<Digest>> Store::chunksByPack() const
+{
+    std::map<uint32_t, std::vector<std::pair<uint64_t, Digest>>> packs;
+    for (const auto& item : index)
+    {
+        packs[item.second.pack].emplace_back(item.second.offset, item.first);
+    }
+    std::vector<std::vector<Digest>> groups;
+    for (auto& pack : packs)
+    {
+        std::sort(pack.second.begin(), pack.second.end());
+        groups.emplace_back();
+        for (const auto& chunk : pack.second)
+        {
+            groups.back().push_back(chunk.second);
+        }
+    }
+    return groups;
+}
+
+std::vector<Digest> Store::verifyChunks(const std::vector<Digest>& chunks,
+    const std::function<void(uint64_t)>& consume) const
+{
+    std::vector<Digest> corrupted;
+    if (chunks.empty())
+    {
+        return corrupted;
+    }
+    std::filesystem::path path = packPath(index.at(chunks.front()).pack);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return errno == ENOENT ? corrupted : chunks;
+    }
+    std::vector<unsigned char> data;
+    for (const Digest& digest : chunks)
+    {
+        const Location& location = index.at(digest);
+        data.resize(location.length);
+        ssize_t count = pread(fd, data.data(), data.size(), location.offset);
+        consume(data.size());
+        if (count != ssize_t(data.size()) || computeDigest(data.data(), data.size()) != digest)
+        {
+            corrupted.push_back(digest);
+        }
+    }
+    close(fd);
+    return corrupted;
+}
+
+std::vector<std::string> Store::listRecipes() const
+{
+    return listSnapshots(root / "snapshots");
+}
+
+Recipe Store::readRecipe(const std::string& name) const
+{
+    Recipe recipe;
+    std::ifstream stream(root / "snapshots" / name);
+    std::string line;
+    while (std::getline(stream, line))
+    {
+        std::istringstream fields(line);
+        RecipeEntry item;
+        std::string chunks;
+        std::string path;
+        fields >> std::oct >> item.entry.mode >> std::dec >> item.entry.size
+               >> item.entry.mtime >> item.entry.inode;
+        fields.ignore(1);
+        std::getline(fields, chunks, '\t');
+        if (fields.fail() || fields.eof())
+        {
+            throw std::runtime_error("Corrupted recipe " + name);
+        }
+        // Empty for the source root
+        std::getline(fields, path);
+        item.entry.path = unescapePath(path);
+        item.entry.origin = name;
+        for (size_t i = 0; i < chunks.size(); i += sizeof(Digest) * 2 + 1)
+        {
+            item.chunks.push_back(fromHex(chunks.substr(i, sizeof(Digest) * 2)));
+        }
+        recipe.push_back(std::move(item));
+    }
+    return recipe;
+}
+
+void Store::writeRecipe(const std::string& name, const Recipe& recipe)
+{
+    // Recipes refer to chunks, so the chunks go first
+    flush();
+
+    std::filesystem::path temporary = root / "snapshots" / (".tmp-" + name);
+    {
+        std::ofstream stream(temporary);
+        for (const RecipeEntry& item : recipe)
+        {
+            const Entry& entry = item.entry;
+            stream << std::oct << entry.mode << std::dec << '\t' << entry.size << '\t'
+                   << entry.mtime << '\t' << entry.inode << '\t';
+            for (size_t i = 0; i < item.chunks.size(); ++i)
+            {
+                stream << (i == 0 ? "" : ",") << toHex(item.chunks[i]);
+            }
+            stream << '\t' << escapePath(entry.path) << '\n';
+        }
+        if (!stream.flush())
+        {
+            throw std::runtime_error("Failed to write recipe " + name);
+        }
+    }
+    std::filesystem::rename(temporary, root / "snapshots" / name);
+
+    std::ofstream(root / "recipes") << listRecipes().size() << '\n';
+}
+
+bool Store::recipesDeleted() const
+{
+    size_t count = 0;
+    std::ifstream(root / "recipes") >> count;
+    return listRecipes().size() < count;
+}
+
+void Store::collectGarbage()
+{
+    flush();
+
+    // Mark
+    std::unordered_set<Digest, DigestHash> live;
+    std::vector<std::string> recipes = listRecipes();
+    for (const std::string& name : recipes)
+    {
+        for (const RecipeEntry& item : readRecipe(name))
+        {
+            live.insert(item.chunks.begin(), item.chunks.end());
+        }
+    }
+
+    // Sweep the index and count live bytes of every pack
+    std::unordered_map<uint32_t, uint64_t> liveBytes;
+    size_t deadChunks = 0;
+    for (auto it = index.begin(); it != index.end();)
+    {
+        if (live.count(it->first) == 0)
+        {
+            it = index.erase(it);
+            ++deadChunks;
+            continue;
+        }
+        liveBytes[it->second.pack] += chunkHeaderSize + it->second.length;
+        ++it;
+    }
+
+    // Packs which are mostly garbage are rewritten into a fresh pack
+    std::vector<std::filesystem::path> victims;
+    std::unordered_set<uint32_t> repacked;
+    uint32_t lastPack = currentPack;
+    for (const auto& item : std::filesystem::directory_iterator(root / "packs"))
+    {
+        uint32_t pack;
+        if (!parsePackName(item.path(), pack))
+        {
+            continue;
+        }
+        lastPack = std::max(lastPack, pack);
+        uint64_t used = liveBytes[pack];
+        if (used == 0)
+        {
+            victims.push_back(item.path());
+        }
+        else if (used * 2 < item.file_size())
+        {
+            victims.push_back(item.path());
+            repacked.insert(pack);
+        }
+    }
+
+    if (!repacked.empty())
+    {
+        openPack(lastPack + 1);
+        std::vector<Digest> moving;
+        for (const auto& item : index)
+        {
+            if (repacked.count(item.second.pack) != 0)
+            {
+                moving.push_back(item.first);
+            }
+        }
+        for (const Digest& digest : moving)
+        {
+            std::vector<unsigned char> data = get(digest);
+            index.erase(digest);
+            put(digest, data.data(), data.size());
+        }
+        writeBuffer();
+        fdatasync(packFd);
+    }
+
+    // The new index must not refer to the packs before they are removed
+    writeIndex();
+    uint64_t freed = 0;
+    for (const auto& path : victims)
+    {
+        freed += std::filesystem::file_size(path);
+        std::filesystem::remove(path);
+    }
+    if (repacked.empty() && liveBytes[currentPack] == 0)
+    {
+        // The pack we were appending to is gone, start a new one
+        if (packFd != -1)
+        {
+            close(packFd);
+            packFd = -1;
+        }
+        currentPack = lastPack + 1;
+        currentOffset = 0;
+    }
+    std::ofstream(root / "recipes") << recipes.size() << '\n';
+
+    syslog(LOG_INFO, "Garbage collection: %zu dead chunks, %zu packs removed, %zu repacked, %llu bytes freed",
+        deadChunks, victims.size(), repacked.size(), static_cast<unsigned long long>(freed));
+}
@@ -0,0 +1,95 @@
+#ifndef BACKUP_STORE_H
+#define BACKUP_STORE_H
+
+#include "digest.h"
+#include "manifest.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A snapshot in the store is a list of entries with the chunks of their data
+struct RecipeEntry
+{
+    Entry entry;
+    std::vector<Digest> chunks;
+};
+
+using Recipe = std::vector<RecipeEntry>;
+
+// Content-addressed chunk store. Every chunk is written once into an
+// append-only pack file and found by its digest through the index:
+//   .store/packs/<number>.pack  - chunk headers followed by chunk data
+//   .store/index                - digest -> pack, offset, length
+//   .store/snapshots/<date>     - recipes
+class Store
+{
+public:
+    explicit Store(const std::filesystem::path& root, uint64_t packSize = 64 << 20);
+    ~Store();
+
+    Store(const Store&) = delete;
+    Store& operator=(const Store&) = delete;
+
+    bool has(const Digest& digest) const;
+
+    // Writes the chunk unless the store already has it, returns true if it was new
+    bool put(const Digest& digest, const unsigned char* data, size_t size);
+
+    std::vector<unsigned char> get(const Digest& digest) const;
+
+    // Makes all chunks written so far durable and visible in the index
+    void flush();
+
+    // Recipe names oldest first
+    std::vector<std::string> listRecipes() const;
+    Recipe readRecipe(const std::string& name) const;
+    void writeRecipe(const std::string& name, const Recipe& recipe);
+
+    // True if recipes were deleted since the last call to writeRecipe()
+    bool recipesDeleted() const;
+
+    // Mark chunks referenced by the recipes, drop packs without live chunks
+    // and repack the ones which are mostly garbage
+    void collectGarbage();
+
+    size_t chunkCount() const { return index.size(); }
+
+    // Digests of the live chunks grouped by pack, every group in the order
+    // the chunks are stored, so a pack is read sequentially by verifyChunks()
+    std::vector<std::vector<Digest>> chunksByPack() const;
+
+    // Reads the chunks of one group of chunksByPack() and returns the ones
+    // whose data does not match their digest or can not be read. `consume`
+    // is told the size of every chunk read. A pack removed by the garbage
+    // collection in the meantime has nothing to check.
+    std::vector<Digest> verifyChunks(const std::vector<Digest>& chunks, const std::function<void(uint64_t)>& consume) const;
+
+private:
+    struct Location
+    {
+        uint32_t pack;
+        uint64_t offset;
+        uint32_t length;
+    };
+
+    std::filesystem::path packPath(uint32_t pack) const;
+    void openPack(uint32_t pack);
+    void writeBuffer();
+    void writeIndex();
+
+    std::filesystem::path root;
+    uint64_t packSize;
+    std::unordered_map<Digest, Location, DigestHash> index;
+    std::vector<std::pair<Digest, Location>> pending;
+
+    uint32_t currentPack = 0;
+    uint64_t currentOffset = 0;
+    int packFd = -1;
+    std::vector<unsigned char> buffer;
+};
+
+#endif
@@ -0,0 +1,170 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+namespace
+{
+    // Index of the queue owned by the current worker, threads outside of the pool have none
+    thread_local const ThreadPool* currentPool = nullptr;
+    thread_local size_t currentQueue = 0;
+}
+
+TaskGroup::~TaskGroup()
+{
+    try
+    {
+        wait();
+    }
+    catch (...)
+    {
+    }
+}
+
+void TaskGroup::run(std::function<void()> task)
+{
+    pending.fetch_add(1);
+    pool.submit(ThreadPool::Task{std::move(task), this});
+}
+
+void TaskGroup::wait()
+{
+    size_t self = currentPool == &pool ? currentQueue : pool.queues.size();
+    while (pending.load() != 0)
+    {
+        // Help instead of blocking, a worker waiting for its own subtasks would deadlock otherwise
+        if (!pool.tryRun(self))
+        {
+            std::unique_lock<std::mutex> lock(pool.sleepMutex);
+            pool.finished.wait_for(lock, std::chrono::milliseconds(10), [this]
+            {
+                return pending.load() == 0 || pool.queued.load() != 0;
+            });
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (error)
+    {
+        std::exception_ptr result = error;
+        error = nullptr;
+        std::rethrow_exception(result);
+    }
+}
+
+ThreadPool::ThreadPool(size_t threads)
+{
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; ++i)
+    {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 0; i < threads; ++i)
+    {
+        workers.emplace_back(&ThreadPool::work, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void ThreadPool::submit(Task task)
+{
+    // Workers keep their subtasks, other threads spread the tasks round-robin
+    size_t index = currentPool == this ? currentQueue : next.fetch_add(1) % queues.size();
+    {
+        std::lock_guard<std::mutex> lock(queues[index]->mutex);
+        queues[index]->tasks.push_back(std::move(task));
+    }
+    queued.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+    }
+    wakeUp.notify_one();
+    finished.notify_all();
+}
+
+bool ThreadPool::tryRun(size_t self)
+{
+    Task task;
+    bool found = false;
+    if (self < queues.size())
+    {
+        std::lock_guard<std::mutex> lock(queues[self]->mutex);
+        if (!queues[self]->tasks.empty())
+        {
+            task = std::move(queues[self]->tasks.back());
+            queues[self]->tasks.pop_back();
+            found = true;
+        }
+    }
+    for (size_t i = 1; !found && i <= queues.size(); ++i)
+    {
+        Queue& victim = *queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            found = true;
+        }
+    }
+    if (!found)
+    {
+        return false;
+    }
+
+    queued.fetch_sub(1);
+    execute(task);
+    return true;
+}
+
+void ThreadPool::execute(Task& task)
+{
+    try
+    {
+        task.function();
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(task.group->mutex);
+        if (!task.group->error)
+        {
+            task.group->error = std::current_exception();
+        }
+    }
+
+    if (task.group->pending.fetch_sub(1) == 1)
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        finished.notify_all();
+    }
+}
+
+void ThreadPool::work(size_t self)
+{
+    currentPool = this;
+    currentQueue = self;
+    while (true)
+    {
+        if (tryRun(self))
+        {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeUp.wait(lock, [this] { return stopping || queued.load() != 0; });
+        if (stopping && queued.load() == 0)
+        {
+            return;
+        }
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef BACKUP_THREAD_POOL_H
+#define BACKUP_THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool;
+
+// Tasks submitted with the same group can be waited for together.
+// The first exception thrown by a task is rethrown from wait().
+class TaskGroup
+{
+public:
+    explicit TaskGroup(ThreadPool& pool): pool(pool) {}
+    ~TaskGroup();
+
+    void run(std::function<void()> task);
+
+    // Runs queued tasks on the calling thread until the group is done
+    void wait();
+
+private:
+    friend class ThreadPool;
+
+    ThreadPool& pool;
+    std::atomic<size_t> pending{0};
+    std::mutex mutex;
+    std::exception_ptr error;
+};
+
+// Fixed pool of workers with one deque each. A worker pushes and pops
+// its own tasks at the back (depth first, the data is still hot) and
+// steals from the front of the other deques when its own one is empty.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(size_t threads = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const { return workers.size(); }
+
+private:
+    friend class TaskGroup;
+
+    struct Task
+    {
+        std::function<void()> function;
+        TaskGroup* group;
+    };
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void submit(Task task);
+    bool tryRun(size_t self);
+    void execute(Task& task);
+    void work(size_t self);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> next{0};
+    std::mutex sleepMutex;
+    std::condition_variable wakeUp;
+    std::condition_variable finished;
+    bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,253 @@
+#include "throttle.h"
+
+#include "filter.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <syslog.h>
+#include <thread>
+#include <unistd.h>
+
+namespace
+{
+    // From linux/ioprio.h, which older headers do not have
+    const int ioprioWhoProcess = 1;
+    const int ioprioClassShift = 13;
+    const int ioprioClassBestEffort = 2;
+    const int ioprioClassIdle = 3;
+
+    // Tokens saved while idle, a cycle may start with this much of a burst
+    const double burstSeconds = 0.1;
+
+    uint64_t parseLimit(const std::string& value)
+    {
+        return value.empty() ? 0 : std::stoull(value);
+    }
+
+    // Writes one value into a cgroup file, false with a warning if it is not writable
+    bool writeControl(const std::filesystem::path& file, const std::string& value)
+    {
+        std::ofstream stream(file);
+        stream << value << std::flush;
+        if (!stream)
+        {
+            syslog(LOG_WARNING, "Failed to write \"%s\" to %s: %s", value.c_str(), file.c_str(), strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    void joinCgroup(const mINI::INIStructure& ini, const std::filesystem::path& cgroup)
+    {
+        std::error_code error;
+        std::filesystem::create_directories(cgroup, error);
+        if (error)
+        {
+            syslog(LOG_WARNING, "Failed to create cgroup %s: %s", cgroup.c_str(), error.message().c_str());
+            return;
+        }
+
+        // The controllers have to be enabled in the parent first, they may already be
+        writeControl(cgroup.parent_path() / "cgroup.subtree_control", "+io +cpu");
+
+        uint64_t bandwidth = parseLimit(ini.get("throttle").get("bandwidth"));
+        uint64_t iops = parseLimit(ini.get("throttle").get("iops"));
+        if (bandwidth != 0 || iops != 0)
+        {
+            std::string limits;
+            if (bandwidth != 0)
+            {
+                limits += " rbps=" + std::to_string(bandwidth) + " wbps=" + std::to_string(bandwidth);
+            }
+            if (iops != 0)
+            {
+                limits += " riops=" + std::to_string(iops) + " wiops=" + std::to_string(iops);
+            }
+            // io.max takes whole disks, the ones of [src], every [dst] path and every job
+            std::set<std::string> disks;
+            for (const auto& section : ini)
+            {
+                if (section.first == "src" || section.first.compare(0, 4, "dst.") == 0)
+                {
+                    disks.insert(diskNumber(section.second.get("path")));
+                }
+                else if (section.first == "dst")
+                {
+                    for (const std::string& dst : splitList(section.second.get("path")))
+                    {
+                        disks.insert(diskNumber(dst));
+                    }
+                }
+                else if (section.first.compare(0, 4, "job.") == 0)
+                {
+                    disks.insert(diskNumber(section.second.get("src")));
+                    for (const std::string& dst : splitList(section.second.get("dst")))
+                    {
+                        disks.insert(diskNumber(dst));
+                    }
+                }
+            }
+            for (const std::string& disk : disks)
+            {
+                if (!disk.empty())
+                {
+                    writeControl(cgroup / "io.max", disk + limits);
+                }
+            }
+        }
+
+        const std::string& cpu = ini.get("throttle").get("cpu_percent");
+        if (!cpu.empty())
+        {
+            const int period = 100000;
+            writeControl(cgroup / "cpu.max", std::to_string(std::stoi(cpu) * period / 100) + " " + std::to_string(period));
+        }
+
+        // Moves all threads of the daemon
+        if (writeControl(cgroup / "cgroup.procs", std::to_string(getpid())))
+        {
+            syslog(LOG_INFO, "Moved to cgroup %s", cgroup.c_str());
+        }
+    }
+}
+
+void Throttle::setLimits(uint64_t bandwidth, uint64_t iops)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->bandwidth = bandwidth;
+    this->iops = iops;
+    byteTokens = bandwidth * burstSeconds;
+    operationTokens = iops * burstSeconds;
+    last = std::chrono::steady_clock::now();
+}
+
+void Throttle::consume(uint64_t bytes, uint64_t operations)
+{
+    if (!enabled())
+    {
+        return;
+    }
+
+    // The buckets may go into debt, the debt is what the caller has to sleep off
+    double wait = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - last).count();
+        last = now;
+        total.bytes += bytes;
+        total.operations += operations;
+        if (bandwidth != 0)
+        {
+            byteTokens = std::min(bandwidth * burstSeconds, byteTokens + elapsed * bandwidth) - bytes;
+            wait = std::max(wait, -byteTokens / bandwidth);
+        }
+        if (iops != 0)
+        {
+            operationTokens = std::min(iops * burstSeconds, operationTokens + elapsed * iops) - operations;
+            wait = std::max(wait, -operationTokens / iops);
+        }
+        total.waited += wait;
+    }
+    if (wait > 0)
+    {
+        std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+    }
+}
+
+size_t Throttle::chunkSize(size_t preferred) const
+{
+    if (bandwidth == 0)
+    {
+        return preferred;
+    }
+    return std::min<size_t>(preferred, std::max<uint64_t>(bandwidth / 10, 64 * 1024));
+}
+
+Throttle::Usage Throttle::usage()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return total;
+}
+
+std::string Throttle::limits() const
+{
+    char text[128];
+    if (bandwidth != 0 && iops != 0)
+    {
+        snprintf(text, sizeof(text), "%.1f MiB/s, %llu IOPS", bandwidth / 1048576.0, static_cast<unsigned long long>(iops));
+    }
+    else if (bandwidth != 0)
+    {
+        snprintf(text, sizeof(text), "%.1f MiB/s", bandwidth / 1048576.0);
+    }
+    else
+    {
+        snprintf(text, sizeof(text), "%llu IOPS", static_cast<unsigned long long>(iops));
+    }
+    return text;
+}
+
+std::string diskNumber(const std::string& path)
+{
+    struct stat status;
+    if (path.empty() || stat(path.c_str(), &status) != 0)
+    {
+        return std::string();
+    }
+    std::string number = std::to_string(major(status.st_dev)) + ":" + std::to_string(minor(status.st_dev));
+    std::filesystem::path device = "/sys/dev/block/" + number;
+    std::error_code error;
+    if (std::filesystem::exists(device / "partition", error))
+    {
+        std::ifstream disk(std::filesystem::canonical(device, error).parent_path() / "dev");
+        std::getline(disk, number);
+    }
+    return std::filesystem::exists(device, error) ? number : std::string();
+}
+
+void applyProcessLimits(const mINI::INIStructure& ini)
+{
+    const std::string& nice = ini.get("throttle").get("nice");
+    if (!nice.empty() && setpriority(PRIO_PROCESS, 0, std::stoi(nice)) != 0)
+    {
+        syslog(LOG_WARNING, "Failed to set nice %s: %s", nice.c_str(), strerror(errno));
+    }
+
+    const std::string& ioClass = ini.get("throttle").get("io_class");
+    if (!ioClass.empty())
+    {
+        int value = 0;
+        if (ioClass == "idle")
+        {
+            value = ioprioClassIdle << ioprioClassShift;
+        }
+        else if (ioClass == "best-effort")
+        {
+            // The lowest priority of the class
+            value = ioprioClassBestEffort << ioprioClassShift | 7;
+        }
+        else
+        {
+            throw std::runtime_error("Unknown I/O class " + ioClass);
+        }
+        if (syscall(SYS_ioprio_set, ioprioWhoProcess, 0, value) != 0)
+        {
+            syslog(LOG_WARNING, "Failed to set I/O class %s: %s", ioClass.c_str(), strerror(errno));
+        }
+    }
+
+    const std::string& cgroup = ini.get("throttle").get("cgroup");
+    if (!cgroup.empty())
+    {
+        joinCgroup(ini, cgroup);
+    }
+}
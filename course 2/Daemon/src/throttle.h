@@ -0,0 +1,59 @@
+#ifndef BACKUP_THROTTLE_H
+#define BACKUP_THROTTLE_H
+
+#include <mini/ini.h>
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Token buckets for the bytes and the I/O operations of the copy. Callers
+// report what they have just done and sleep while the buckets are in debt,
+// so all workers together stay under [throttle] bandwidth and iops.
+class Throttle
+{
+public:
+    struct Usage
+    {
+        uint64_t bytes = 0;
+        uint64_t operations = 0;
+        double waited = 0;  // Seconds slept by all threads
+    };
+
+    // Zero means unlimited
+    void setLimits(uint64_t bandwidth, uint64_t iops);
+
+    bool enabled() const { return bandwidth != 0 || iops != 0; }
+
+    // Accounts the bytes and operations, sleeps if the limit is exceeded
+    void consume(uint64_t bytes, uint64_t operations = 1);
+
+    // A single syscall should not move more than a tenth of a second of data
+    size_t chunkSize(size_t preferred) const;
+
+    Usage usage();
+
+    // "10.0 MiB/s, 100 IOPS"
+    std::string limits() const;
+
+private:
+    std::mutex mutex;
+    uint64_t bandwidth = 0;
+    uint64_t iops = 0;
+    double byteTokens = 0;
+    double operationTokens = 0;
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+    Usage total;
+};
+
+// Nice level, I/O priority class and cgroup v2 limits from [throttle]. They
+// apply to the calling thread and the threads it starts afterwards, so this
+// runs before the workers are created.
+void applyProcessLimits(const mINI::INIStructure& ini);
+
+// "major:minor" of the disk holding the path, a partition is replaced by its
+// disk. Empty if the path does not exist or is not on a block device.
+std::string diskNumber(const std::string& path);
+
+#endif
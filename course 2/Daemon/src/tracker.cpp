@@ -0,0 +1,442 @@
+#include "tracker.h"
+
+#include "walker.h"
+
+#include <algorithm>
+#include <climits>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+namespace
+{
+    const uint32_t inotifyMask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE
+        | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+    const uint64_t fanotifyMask = FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_ATTRIB | FAN_CLOSE_WRITE
+        | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR;
+
+    std::string join(const std::string& directory, const std::string& name)
+    {
+        return directory.empty() ? name : directory + "/" + name;
+    }
+}
+
+ChangeTracker::ChangeTracker(const std::string& src, const std::string& backend, ThreadPool* pool, PathFilter filter):
+src(src),
+backend(backend),
+pool(pool),
+filter(std::move(filter))
+{
+    if (backend == "fanotify")
+    {
+        if (!startFanotify())
+        {
+            syslog(LOG_WARNING, "fanotify is not permitted for %s, using inotify", src.c_str());
+            startInotify();
+        }
+    }
+    else if (backend == "inotify")
+    {
+        startInotify();
+    }
+    else if (!backend.empty())
+    {
+        throw std::runtime_error("Unknown watch backend " + backend);
+    }
+}
+
+ChangeTracker::~ChangeTracker()
+{
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    if (mountFd != -1)
+    {
+        close(mountFd);
+    }
+}
+
+bool ChangeTracker::startFanotify()
+{
+    // One mark covers the whole filesystem, there is no per-directory watch limit
+    fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE);
+    if (fd == -1)
+    {
+        return false;
+    }
+    if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, fanotifyMask, AT_FDCWD, src.c_str()) != 0)
+    {
+        close(fd);
+        fd = -1;
+        return false;
+    }
+
+    // Directories are reported by handles which are resolved relative to this mount
+    std::error_code error;
+    mountFd = open(src.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    root = std::filesystem::canonical(src, error).string();
+    if (mountFd == -1 || error)
+    {
+        // Closing the group removes its mark as well
+        if (mountFd != -1)
+        {
+            close(mountFd);
+            mountFd = -1;
+        }
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    backend = "fanotify";
+    return true;
+}
+
+void ChangeTracker::startInotify()
+{
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1)
+    {
+        throw std::system_error(errno, std::generic_category(), "Failed to start inotify");
+    }
+    backend = "inotify";
+}
+
+void ChangeTracker::stopWatching(const char* reason)
+{
+    syslog(LOG_WARNING, "Stopped watching %s: %s, falling back to full scans", src.c_str(), reason);
+    close(fd);
+    fd = -1;
+    watches.clear();
+    dirty.clear();
+    state.clear();
+    state.shrink_to_fit();
+}
+
+void ChangeTracker::watchTree(const std::string& path)
+{
+    // inotify watches are not recursive, every directory needs its own one.
+    // Adding a watch to an already watched directory returns the same
+    // descriptor, so moved directories get their new path here.
+    std::vector<std::string> directories = {path};
+    std::error_code error;
+    auto options = std::filesystem::directory_options::skip_permission_denied;
+    for (std::filesystem::recursive_directory_iterator it(std::filesystem::path(src) / path, options, error), end;
+        it != end; it.increment(error))
+    {
+        if (it->is_directory(error) && !it->is_symlink(error))
+        {
+            std::string directory = join(path, it->path().lexically_relative(std::filesystem::path(src) / path).string());
+            if (filter.excluded(directory, true))
+            {
+                it.disable_recursion_pending();
+                continue;
+            }
+            directories.push_back(directory);
+        }
+    }
+
+    for (const std::string& directory : directories)
+    {
+        int wd = inotify_add_watch(fd, (std::filesystem::path(src) / directory).c_str(), inotifyMask);
+        if (wd == -1)
+        {
+            if (errno == ENOSPC)
+            {
+                stopWatching("inotify watch limit reached");
+                return;
+            }
+            continue;
+        }
+        watches[wd] = directory;
+    }
+}
+
+void ChangeTracker::addDirty(const std::string& path, bool subtree)
+{
+    bool& value = dirty[path];
+    value = value || subtree;
+}
+
+void ChangeTracker::markDirty(const std::string& path)
+{
+    if (fd != -1)
+    {
+        addDirty(path, false);
+    }
+}
+
+void ChangeTracker::readEvents()
+{
+    if (backend == "fanotify")
+    {
+        readFanotify();
+    }
+    else if (backend == "inotify")
+    {
+        readInotify();
+    }
+}
+
+void ChangeTracker::readInotify()
+{
+    alignas(inotify_event) char buffer[64 * 1024];
+    while (fd != -1)
+    {
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length <= 0)
+        {
+            return;
+        }
+
+        for (char* ptr = buffer; ptr < buffer + length;)
+        {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(ptr);
+            ptr += sizeof(inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                rescan = true;
+                continue;
+            }
+            auto watch = watches.find(event->wd);
+            if (watch == watches.end())
+            {
+                continue;
+            }
+            if (event->mask & IN_IGNORED)
+            {
+                watches.erase(watch);
+                continue;
+            }
+            // Events about the directory itself are reported to its parent too
+            if (event->len == 0)
+            {
+                continue;
+            }
+
+            const std::string directory = watch->second;
+            std::string path = join(directory, event->name);
+            if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && (event->mask & IN_ISDIR))
+            {
+                watchTree(path);
+                addDirty(path, true);
+            }
+            else
+            {
+                addDirty(path, (event->mask & (IN_DELETE | IN_MOVED_FROM)) != 0);
+            }
+            if (!directory.empty() && (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)))
+            {
+                // The directory got a new mtime
+                addDirty(directory, false);
+            }
+        }
+    }
+}
+
+void ChangeTracker::readFanotify()
+{
+    alignas(fanotify_event_metadata) char buffer[64 * 1024];
+    while (fd != -1)
+    {
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length <= 0)
+        {
+            return;
+        }
+
+        const fanotify_event_metadata* event = reinterpret_cast<const fanotify_event_metadata*>(buffer);
+        for (; FAN_EVENT_OK(event, length); event = FAN_EVENT_NEXT(event, length))
+        {
+            if (event->vers != FANOTIFY_METADATA_VERSION)
+            {
+                stopWatching("unsupported fanotify version");
+                return;
+            }
+            if (event->mask & FAN_Q_OVERFLOW)
+            {
+                rescan = true;
+                continue;
+            }
+            if (event->event_len <= event->metadata_len)
+            {
+                continue;
+            }
+
+            const fanotify_event_info_fid* info = reinterpret_cast<const fanotify_event_info_fid*>(event + 1);
+            if (info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+            {
+                continue;
+            }
+            file_handle* handle = reinterpret_cast<file_handle*>(const_cast<unsigned char*>(info->handle));
+            std::string name = reinterpret_cast<const char*>(handle->f_handle + handle->handle_bytes);
+
+            // The whole filesystem is marked, keep only the events under src
+            int directoryFd = open_by_handle_at(mountFd, handle, O_PATH | O_CLOEXEC);
+            if (directoryFd == -1)
+            {
+                continue;
+            }
+            char target[PATH_MAX];
+            std::string link = "/proc/self/fd/" + std::to_string(directoryFd);
+            ssize_t size = readlink(link.c_str(), target, sizeof(target));
+            close(directoryFd);
+            if (size <= 0)
+            {
+                continue;
+            }
+            std::string absolute(target, size);
+            std::string directory;
+            if (absolute.compare(0, root.size(), root) != 0)
+            {
+                continue;
+            }
+            if (absolute.size() > root.size())
+            {
+                if (absolute[root.size()] != '/')
+                {
+                    continue;
+                }
+                directory = absolute.substr(root.size() + 1);
+            }
+
+            if (name == ".")
+            {
+                addDirty(directory, false);
+                continue;
+            }
+            std::string path = join(directory, name);
+            bool created = (event->mask & (FAN_CREATE | FAN_MOVED_TO)) && (event->mask & FAN_ONDIR);
+            addDirty(path, created || (event->mask & (FAN_DELETE | FAN_MOVED_FROM)));
+            if (!directory.empty() && (event->mask & (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO)))
+            {
+                addDirty(directory, false);
+            }
+        }
+    }
+}
+
+bool ChangeTracker::hasChanges()
+{
+    if (fd == -1)
+    {
+        return true;
+    }
+    readEvents();
+    return fd == -1 || !scanned || rescan || !dirty.empty();
+}
+
+bool ChangeTracker::watching() const
+{
+    return fd != -1;
+}
+
+Manifest ChangeTracker::scan()
+{
+    if (fd == -1)
+    {
+        return walkTree(src, pool, &filter);
+    }
+
+    readEvents();
+    if (!scanned || rescan)
+    {
+        // Watches go first, so nothing changed during the walk is missed
+        dirty.clear();
+        rescan = false;
+        if (backend == "inotify")
+        {
+            watchTree("");
+        }
+        if (fd == -1)
+        {
+            return walkTree(src, pool, &filter);
+        }
+        state = walkTree(src, pool, &filter);
+        scanned = true;
+        return state;
+    }
+
+    std::map<std::string, bool> paths;
+    paths.swap(dirty);
+
+    // True if a parent directory is rescanned as a whole
+    auto covered = [&paths](const std::string& path)
+    {
+        for (size_t slash = path.rfind('/'); slash != std::string::npos && slash > 0; slash = path.rfind('/', slash - 1))
+        {
+            auto it = paths.find(path.substr(0, slash));
+            if (it != paths.end() && it->second)
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    Manifest next;
+    next.reserve(state.size());
+    for (Entry& entry : state)
+    {
+        if (paths.count(entry.path) == 0 && !covered(entry.path))
+        {
+            next.push_back(std::move(entry));
+        }
+    }
+
+    // Only the dirty paths are looked at on disk
+    for (const auto& item : paths)
+    {
+        Entry entry;
+        if (covered(item.first) || !statEntry(std::filesystem::path(src) / item.first, item.first, entry)
+            || filter.excluded(item.first, S_ISDIR(entry.mode)))
+        {
+            continue;
+        }
+        next.push_back(entry);
+        if (item.second && S_ISDIR(entry.mode))
+        {
+            try
+            {
+                for (Entry& child : walkTree((std::filesystem::path(src) / item.first).string(), pool, &filter, item.first))
+                {
+                    child.path = item.first + "/" + child.path;
+                    next.push_back(std::move(child));
+                }
+            }
+            catch (const std::filesystem::filesystem_error& error)
+            {
+                // Removed again, the watcher reports it in the next cycle
+            }
+        }
+    }
+
+    std::sort(next.begin(), next.end(), [](const Entry& a, const Entry& b)
+    {
+        return a.path < b.path;
+    });
+    state = std::move(next);
+    return state;
+}
+
+void ChangeTracker::scan(const std::function<bool(Entry&)>& visit)
+{
+    if (fd == -1)
+    {
+        streamTree(src, &filter, visit);
+        return;
+    }
+    for (Entry& entry : scan())
+    {
+        if (!visit(entry))
+        {
+            return;
+        }
+    }
+}
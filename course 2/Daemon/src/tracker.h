@@ -0,0 +1,77 @@
+#ifndef BACKUP_TRACKER_H
+#define BACKUP_TRACKER_H
+
+#include "filter.h"
+#include "manifest.h"
+#include "thread_pool.h"
+
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+// Keeps the state of the source tree between cycles. Without a watcher
+// every scan() walks the whole tree. With inotify or fanotify only the
+// paths reported as dirty are looked at again, and a queue overflow
+// falls back to a full rescan. Entries skipped by the filter are left out
+// and skipped directories are neither read nor watched.
+class ChangeTracker
+{
+public:
+    // backend is "inotify", "fanotify" or empty for periodic full scans.
+    // Full scans walk the subdirectories in parallel on the pool.
+    ChangeTracker(const std::string& src, const std::string& backend, ThreadPool* pool = nullptr,
+        PathFilter filter = PathFilter());
+    ~ChangeTracker();
+
+    ChangeTracker(const ChangeTracker&) = delete;
+    ChangeTracker& operator=(const ChangeTracker&) = delete;
+
+    // False only if the watcher is sure nothing changed since the last scan()
+    bool hasChanges();
+
+    // Current state of the source tree sorted by path
+    Manifest scan();
+
+    // The same entries handed to `visit` in path order until it returns false.
+    // Without a watcher they come from streamTree() and are never all in
+    // memory at once, a watcher keeps the whole state anyway.
+    void scan(const std::function<bool(Entry&)>& visit);
+
+    // Paths to look at again in the next scan(), e.g. the ones which failed to copy
+    void markDirty(const std::string& path);
+
+    // True if the changes are tracked by inotify or fanotify
+    bool watching() const;
+
+    const std::string& source() const { return src; }
+
+private:
+    void readEvents();
+    void readInotify();
+    void readFanotify();
+    bool startFanotify();
+    void startInotify();
+    void watchTree(const std::string& path);
+    void addDirty(const std::string& path, bool subtree);
+    void stopWatching(const char* reason);
+
+    std::string src;
+    std::string backend;
+    ThreadPool* pool;
+    PathFilter filter;
+    // Canonical src, fanotify reports resolved paths
+    std::string root;
+    int fd = -1;
+    int mountFd = -1;
+    bool scanned = false;
+    bool rescan = true;
+    Manifest state;
+
+    // Dirty path -> the whole subtree has to be scanned again
+    std::map<std::string, bool> dirty;
+    // inotify watch descriptor -> directory relative to src
+    std::unordered_map<int, std::string> watches;
+};
+
+#endif
@@ -0,0 +1,403 @@
+#include "uring.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace
+{
+    // Requests of one file chain, the step is kept in the low bits of user_data
+    enum Step
+    {
+        OpenSource,
+        OpenTarget,
+        Read,
+        Write,
+        CloseSource,
+        CloseTarget,
+        StepCount
+    };
+
+    int uringSetup(unsigned entries, io_uring_params* params)
+    {
+        return syscall(__NR_io_uring_setup, entries, params);
+    }
+
+    int uringEnter(int fd, unsigned submit, unsigned complete, unsigned flags)
+    {
+        return syscall(__NR_io_uring_enter, fd, submit, complete, flags, nullptr, 0);
+    }
+
+    int uringRegister(int fd, unsigned opcode, const void* arg, unsigned count)
+    {
+        return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+    }
+
+    // The umask can not be read without changing it except through /proc
+    mode_t currentUmask()
+    {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line))
+        {
+            if (line.compare(0, 6, "Umask:") == 0)
+            {
+                return std::stoul(line.substr(6), nullptr, 8);
+            }
+        }
+        return 022;
+    }
+}
+
+struct UringCopier::Ring
+{
+    void* sqMemory = MAP_FAILED;
+    size_t sqSize = 0;
+    void* cqMemory = MAP_FAILED;
+    size_t cqSize = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqesSize = 0;
+
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned sqMask = 0;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    unsigned tail = 0;
+    unsigned pending = 0;
+
+    ~Ring()
+    {
+        if (sqes != MAP_FAILED)
+        {
+            munmap(sqes, sqesSize);
+        }
+        if (cqMemory != MAP_FAILED && cqMemory != sqMemory)
+        {
+            munmap(cqMemory, cqSize);
+        }
+        if (sqMemory != MAP_FAILED)
+        {
+            munmap(sqMemory, sqSize);
+        }
+    }
+
+    // The caller never queues more requests than the ring has entries
+    io_uring_sqe* next(uint64_t userData)
+    {
+        unsigned index = tail & sqMask;
+        io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = userData;
+        sqArray[index] = index;
+        ++tail;
+        ++pending;
+        return sqe;
+    }
+};
+
+struct UringCopier::Slot
+{
+    UringFile* file = nullptr;
+    unsigned remaining = 0;
+    int64_t error = 0;
+    int64_t written = 0;
+};
+
+UringCopier::UringCopier(unsigned slots, size_t bufferSize):
+slots(slots),
+bufferSize(bufferSize),
+mask(currentUmask()),
+rings(std::make_unique<Ring>()),
+state(slots),
+buffers(slots * bufferSize)
+{
+    unsigned entries = 1;
+    while (entries < slots * StepCount)
+    {
+        entries *= 2;
+    }
+    if (!setup(entries) || !probe())
+    {
+        if (ring != -1)
+        {
+            close(ring);
+            ring = -1;
+        }
+    }
+}
+
+UringCopier::~UringCopier()
+{
+    if (ring != -1)
+    {
+        close(ring);
+    }
+}
+
+bool UringCopier::setup(unsigned entries)
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring = uringSetup(entries, &params);
+    if (ring == -1)
+    {
+        return false;
+    }
+
+    Ring& r = *rings;
+    r.sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r.cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+    {
+        r.sqSize = r.cqSize = std::max(r.sqSize, r.cqSize);
+    }
+    r.sqMemory = mmap(nullptr, r.sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    if (r.sqMemory == MAP_FAILED)
+    {
+        return false;
+    }
+    r.cqMemory = single ? r.sqMemory
+        : mmap(nullptr, r.cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+    r.sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    r.sqes = static_cast<io_uring_sqe*>(mmap(nullptr, r.sqesSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES));
+    if (r.cqMemory == MAP_FAILED || r.sqes == MAP_FAILED)
+    {
+        return false;
+    }
+
+    char* sq = static_cast<char*>(r.sqMemory);
+    r.sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    r.sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    r.sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    r.sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    r.tail = *r.sqTail;
+    char* cq = static_cast<char*>(r.cqMemory);
+    r.cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    r.cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    r.cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    r.cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    // One registered buffer per slot and two direct descriptors per slot
+    std::vector<iovec> vectors(slots);
+    for (unsigned i = 0; i < slots; ++i)
+    {
+        vectors[i].iov_base = buffers.data() + i * bufferSize;
+        vectors[i].iov_len = bufferSize;
+    }
+    if (uringRegister(ring, IORING_REGISTER_BUFFERS, vectors.data(), slots) != 0)
+    {
+        return false;
+    }
+    std::vector<int> files(slots * 2, -1);
+    return uringRegister(ring, IORING_REGISTER_FILES, files.data(), files.size()) == 0;
+}
+
+bool UringCopier::probe()
+{
+    // Direct descriptors for openat appeared in 5.15, older kernels reject file_index
+    Ring& r = *rings;
+    io_uring_sqe* sqe = r.next(0);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = reinterpret_cast<uint64_t>("/");
+    sqe->open_flags = O_RDONLY | O_DIRECTORY;
+    sqe->file_index = 1;
+    if (submitAndWait(1) == 0)
+    {
+        return false;
+    }
+
+    unsigned head = *r.cqHead;
+    bool opened = head != __atomic_load_n(r.cqTail, __ATOMIC_ACQUIRE) && r.cqes[head & r.cqMask].res == 0;
+    __atomic_store_n(r.cqHead, head + 1, __ATOMIC_RELEASE);
+    return opened;
+}
+
+unsigned UringCopier::submitAndWait(unsigned wait)
+{
+    Ring& r = *rings;
+    __atomic_store_n(r.sqTail, r.tail, __ATOMIC_RELEASE);
+    while (true)
+    {
+        int submitted = uringEnter(ring, r.pending, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+        if (submitted >= 0)
+        {
+            r.pending -= submitted;
+            return r.pending == 0 ? 1 : 0;
+        }
+        if (errno != EINTR)
+        {
+            return 0;
+        }
+    }
+}
+
+void UringCopier::queue(unsigned slot, UringFile& file)
+{
+    Ring& r = *rings;
+    Slot& current = state[slot];
+    current.file = &file;
+    current.remaining = StepCount;
+    current.error = 0;
+    current.written = 0;
+
+    unsigned source = slot * 2;
+    unsigned target = slot * 2 + 1;
+    uint64_t id = uint64_t(slot) * 8;
+    char* buffer = buffers.data() + slot * bufferSize;
+
+    io_uring_sqe* sqe = r.next(id + OpenSource);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = reinterpret_cast<uint64_t>(file.from.c_str());
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = source + 1;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = r.next(id + OpenTarget);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = reinterpret_cast<uint64_t>(file.to.c_str());
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->len = file.mode & 07777;
+    sqe->file_index = target + 1;
+    sqe->flags = IOSQE_IO_LINK;
+
+    // A short read breaks the chain, the file changed and is copied another way
+    sqe = r.next(id + Read);
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = source;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = file.size;
+    sqe->buf_index = slot;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+    sqe = r.next(id + Write);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = target;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = file.size;
+    sqe->buf_index = slot;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+
+    // Cancelled closes do not leak: the next open into the slot replaces the file
+    sqe = r.next(id + CloseSource);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = source + 1;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = r.next(id + CloseTarget);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = target + 1;
+}
+
+void UringCopier::reap(std::vector<UringFile*>& active, std::vector<unsigned>& free)
+{
+    Ring& r = *rings;
+    unsigned head = *r.cqHead;
+    unsigned tail = __atomic_load_n(r.cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head)
+    {
+        const io_uring_cqe& cqe = r.cqes[head & r.cqMask];
+        unsigned slot = cqe.user_data / 8;
+        unsigned step = cqe.user_data % 8;
+        Slot& current = state[slot];
+
+        if (step <= Write && cqe.res < 0 && (current.error == 0 || current.error == -ECANCELED))
+        {
+            current.error = cqe.res;
+        }
+        if (step == Read && cqe.res >= 0 && uint64_t(cqe.res) != current.file->size)
+        {
+            current.error = -EAGAIN;
+        }
+        if (step == Write && cqe.res >= 0)
+        {
+            current.written = cqe.res;
+        }
+
+        if (--current.remaining == 0)
+        {
+            UringFile& file = *current.file;
+            file.result = current.error != 0 ? current.error : current.written;
+            if (current.error == 0 && checksums)
+            {
+                file.checksum = computeDigest(reinterpret_cast<const unsigned char*>(buffers.data() + slot * bufferSize),
+                    current.written);
+            }
+            if (current.error == 0 && ((file.mode & 07777) & mask) != 0)
+            {
+                // openat() applied the umask
+                chmod(file.to.c_str(), file.mode & 07777);
+            }
+            active[slot] = nullptr;
+            free.push_back(slot);
+        }
+    }
+    __atomic_store_n(r.cqHead, head, __ATOMIC_RELEASE);
+}
+
+void UringCopier::copy(std::vector<UringFile>& files)
+{
+    std::vector<UringFile*> active(slots, nullptr);
+    std::vector<unsigned> free;
+    for (unsigned i = slots; i > 0; --i)
+    {
+        free.push_back(i - 1);
+    }
+
+    size_t next = 0;
+    while (next < files.size() || free.size() != slots)
+    {
+        while (next < files.size() && !free.empty())
+        {
+            UringFile& file = files[next++];
+            if (file.size > bufferSize)
+            {
+                file.result = -EFBIG;
+                continue;
+            }
+            unsigned slot = free.back();
+            free.pop_back();
+            active[slot] = &file;
+            queue(slot, file);
+        }
+        if (free.size() == slots)
+        {
+            break;
+        }
+        if (submitAndWait(1) == 0)
+        {
+            // The ring is broken, the remaining files are copied another way
+            for (UringFile* file : active)
+            {
+                if (file != nullptr)
+                {
+                    file->result = -EIO;
+                }
+            }
+            for (; next < files.size(); ++next)
+            {
+                files[next].result = -EIO;
+            }
+            close(ring);
+            ring = -1;
+            return;
+        }
+        reap(active, free);
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef BACKUP_URING_H
+#define BACKUP_URING_H
+
+#include "digest.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+struct UringFile
+{
+    std::filesystem::path from;
+    std::filesystem::path to;
+    uint64_t size = 0;
+    uint32_t mode = 0;
+    // Bytes written or -errno, files with an error have to be copied another way
+    int64_t result = 0;
+    // Of the data in the registered buffer, see setChecksums()
+    Digest checksum{};
+};
+
+// Copies small files through io_uring without liburing. Every file is one
+// chain of linked requests: openat(src) -> openat(dst) -> read -> write ->
+// close -> close, with direct (fixed) descriptors and registered buffers,
+// so a single io_uring_enter() keeps hundreds of operations in flight.
+class UringCopier
+{
+public:
+    // Files up to maximumSize() bytes, `slots` files in flight
+    explicit UringCopier(unsigned slots = 64, size_t bufferSize = 64 * 1024);
+    ~UringCopier();
+
+    UringCopier(const UringCopier&) = delete;
+    UringCopier& operator=(const UringCopier&) = delete;
+
+    // False if the kernel has no io_uring or no direct descriptors for openat
+    bool available() const { return ring != -1; }
+
+    size_t maximumSize() const { return bufferSize; }
+
+    // The data of every copied file is hashed while it is still in its buffer
+    void setChecksums(bool enabled) { checksums = enabled; }
+
+    // Copies the files of at most maximumSize() bytes and fills their results
+    void copy(std::vector<UringFile>& files);
+
+private:
+    struct Ring;
+    struct Slot;
+
+    bool setup(unsigned entries);
+    bool probe();
+    void queue(unsigned slot, UringFile& file);
+    unsigned submitAndWait(unsigned wait);
+    void reap(std::vector<UringFile*>& active, std::vector<unsigned>& free);
+
+    int ring = -1;
+    unsigned slots;
+    size_t bufferSize;
+    mode_t mask;
+    bool checksums = false;
+    std::unique_ptr<Ring> rings;
+    std::vector<Slot> state;
+    std::vector<char> buffers;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#include "copier.h"
+
+#include <chrono>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+namespace
+{
+    const size_t filesPerDirectory = 1000;
+
+    // 1000 files per directory, the tree is reused by the next runs
+    void generateTree(const std::filesystem::path& root, size_t files, size_t size)
+    {
+        std::filesystem::path done = root.string() + ".done";
+        if (std::filesystem::exists(done))
+        {
+            return;
+        }
+        std::string data(size, 'x');
+        for (size_t i = 0; i < files; ++i)
+        {
+            std::filesystem::path directory = root / std::to_string(i / filesPerDirectory);
+            if (i % filesPerDirectory == 0)
+            {
+                std::filesystem::create_directories(directory);
+            }
+            // Different content, so the copies can not be shared
+            std::string name = std::to_string(i);
+            data.replace(0, name.size(), name);
+            int fd = open((directory / name).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1 || write(fd, data.data(), data.size()) != static_cast<ssize_t>(data.size()))
+            {
+                throw std::filesystem::filesystem_error("Failed to create", directory / name,
+                    std::error_code(errno, std::generic_category()));
+            }
+            close(fd);
+        }
+        std::ofstream{done};
+    }
+
+    // Cold cache for every run, silently does nothing without root
+    void dropCaches()
+    {
+        sync();
+        std::ofstream("/proc/sys/vm/drop_caches") << "3\n";
+    }
+
+    template <typename Copy>
+    void measure(const char* name, const std::filesystem::path& to, size_t files, Copy copy)
+    {
+        std::filesystem::remove_all(to);
+        dropCaches();
+        auto t0 = std::chrono::steady_clock::now();
+        copy();
+        auto t1 = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(t1 - t0).count();
+        std::cout << name << ": " << seconds << " s, " << static_cast<size_t>(files / seconds) << " files/s\n";
+        std::filesystem::remove_all(to);
+    }
+}
+
+// Usage: UringBenchmark <directory> [files=1000000] [size=4096]
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <directory> [files] [size]\n";
+        return EXIT_FAILURE;
+    }
+    std::filesystem::path root = argv[1];
+    size_t files = argc > 2 ? std::stoul(argv[2]) : 1000000;
+    size_t size = argc > 3 ? std::stoul(argv[3]) : 4096;
+    std::filesystem::path from = root / "src";
+    std::filesystem::path to = root / "dst";
+
+    generateTree(from, files, size);
+
+    measure("std::filesystem::copy", to, files, [&]
+    {
+        std::filesystem::copy(from, to, std::filesystem::copy_options::recursive);
+    });
+    for (bool uring : {false, true})
+    {
+        CopyEngine engine(std::thread::hardware_concurrency(), CopyMethod::Reflink, uring);
+        measure(uring ? "CopyEngine, io_uring" : "CopyEngine", to, files, [&]
+        {
+            engine.copyTree(from, to);
+        });
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,446 @@
+#include "walker.h"
+
+#include "file_copy.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+    const size_t bufferSize = 256 * 1024;
+
+    // Queued directories keep their descriptors up to this many, the other
+    // ones are opened again relative to the root when their task runs
+    const size_t maxOpenDirectories = 1024;
+
+    // Only what an Entry holds, the filesystem may skip the rest
+    const unsigned int statxMask = STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME;
+
+    // Record of getdents64, glibc does not declare it
+    struct LinuxDirent64
+    {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+
+    struct Directory
+    {
+        std::string path;  // Relative to the root, empty for the root itself
+        int fd;            // -1 if it has to be opened again
+        PathFilter::State state;
+    };
+
+    [[noreturn]] void fail(const std::string& message, const std::string& path)
+    {
+        throw std::filesystem::filesystem_error(message, path, std::error_code(errno, std::generic_category()));
+    }
+
+    void fillEntry(Entry& entry, const struct statx& status)
+    {
+        entry.size = S_ISDIR(status.stx_mode) ? 0 : status.stx_size;
+        entry.mtime = status.stx_mtime.tv_sec * 1000000000LL + status.stx_mtime.tv_nsec;
+        entry.inode = status.stx_ino;
+        entry.mode = status.stx_mode;
+    }
+
+    // Gone or not readable, the entry is skipped like with skip_permission_denied
+    bool skippable(int error)
+    {
+        return error == ENOENT || error == EACCES || error == EPERM || error == ENOTDIR || error == ELOOP;
+    }
+
+    // Reads the whole listing of a directory, `fail` is not called for directories which are gone
+    template <typename Visit>
+    void listDirectory(int fd, const std::string& path, Visit visit)
+    {
+        thread_local std::vector<char> buffer(bufferSize);
+        while (true)
+        {
+            long count = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (skippable(errno))
+                {
+                    return;
+                }
+                fail("Failed to list", path);
+            }
+            if (count == 0)
+            {
+                return;
+            }
+            for (long offset = 0; offset < count;)
+            {
+                const LinuxDirent64* record = reinterpret_cast<const LinuxDirent64*>(buffer.data() + offset);
+                offset += record->d_reclen;
+                if (std::strcmp(record->d_name, ".") != 0 && std::strcmp(record->d_name, "..") != 0)
+                {
+                    visit(record);
+                }
+            }
+        }
+    }
+
+    // Depth-first walk in the order of the sorted manifest
+    class SortedWalker
+    {
+    public:
+        SortedWalker(const std::string& root, const PathFilter* filter, const std::function<bool(Entry&)>& visit):
+        root(root),
+        filter(filter != nullptr && !filter->empty() ? filter : nullptr),
+        visit(visit)
+        {
+        }
+
+        void walk()
+        {
+            FileDescriptor fd(open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+            if (fd == -1)
+            {
+                fail("Failed to open", root);
+            }
+            rootFd = fd;
+            read(std::string(), filter != nullptr ? filter->below(std::string()) : 0);
+        }
+
+    private:
+        struct Child
+        {
+            std::string name;
+            Entry entry;
+        };
+
+        // False if the walk was stopped. The directory is opened relative to
+        // the root and closed before its subdirectories are read, so a deep
+        // tree keeps only the root open. A directory which is gone or not
+        // readable is skipped, any other error fails the walk: a subtree left
+        // out would be recorded as deleted.
+        bool read(const std::string& prefix, PathFilter::State state)
+        {
+            std::vector<Child> children;
+            {
+                std::string path = prefix.empty() ? std::string(".") : prefix.substr(0, prefix.size() - 1);
+                FileDescriptor fd(openat(rootFd, path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+                if (fd == -1)
+                {
+                    if (skippable(errno))
+                    {
+                        return true;
+                    }
+                    fail("Failed to open", root + "/" + prefix);
+                }
+                listDirectory(fd, root + "/" + prefix, [&](const LinuxDirent64* record)
+                {
+                    const char* name = record->d_name;
+                    if (filter != nullptr && record->d_type != DT_UNKNOWN
+                        && filter->excluded(state, name, record->d_type == DT_DIR))
+                    {
+                        return;
+                    }
+                    struct statx status;
+                    if (statx(fd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, statxMask, &status) != 0)
+                    {
+                        // Removed since getdents64
+                        if (skippable(errno))
+                        {
+                            return;
+                        }
+                        fail("Failed to stat", root + "/" + prefix + name);
+                    }
+                    if (filter != nullptr && record->d_type == DT_UNKNOWN
+                        && filter->excluded(state, name, S_ISDIR(status.stx_mode)))
+                    {
+                        return;
+                    }
+                    children.push_back({name, Entry()});
+                    fillEntry(children.back().entry, status);
+                });
+            }
+
+            // "d" < "d.txt" < "d/x": a directory and its subtree are apart when a
+            // sibling starts with its name, so the subtree is sorted as "d/"
+            std::vector<std::pair<std::string, size_t>> order;
+            order.reserve(children.size() * 2);
+            for (size_t i = 0; i < children.size(); ++i)
+            {
+                order.emplace_back(children[i].name, i);
+                if (S_ISDIR(children[i].entry.mode))
+                {
+                    order.emplace_back(children[i].name + "/", i);
+                }
+            }
+            std::sort(order.begin(), order.end());
+
+            for (const auto& item : order)
+            {
+                Child& child = children[item.second];
+                if (item.first.back() != '/')
+                {
+                    Entry entry = child.entry;
+                    entry.path = prefix + child.name;
+                    if (!visit(entry))
+                    {
+                        return false;
+                    }
+                    continue;
+                }
+                PathFilter::State childState = filter != nullptr ? filter->enter(state, child.name.c_str()) : 0;
+                if (!read(prefix + child.name + "/", childState))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        std::string root;
+        int rootFd = -1;
+        const PathFilter* filter;
+        const std::function<bool(Entry&)>& visit;
+    };
+
+    class Walker
+    {
+    public:
+        Walker(const std::string& root, ThreadPool* pool, const PathFilter* filter):
+        root(root),
+        rootFd(open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)),
+        filter(filter != nullptr && !filter->empty() ? filter : nullptr)
+        {
+            if (rootFd == -1)
+            {
+                fail("Failed to open", root);
+            }
+            if (pool != nullptr)
+            {
+                group = std::make_unique<TaskGroup>(*pool);
+            }
+        }
+
+        ~Walker()
+        {
+            // Left over by an exception
+            for (const Directory& directory : stack)
+            {
+                if (directory.fd != -1)
+                {
+                    close(directory.fd);
+                }
+            }
+            group.reset();
+            close(rootFd);
+        }
+
+        Manifest walk(PathFilter::State state)
+        {
+            int fd = openat(rootFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd == -1)
+            {
+                fail("Failed to open", root);
+            }
+            ++openDirectories;
+            spawn({std::string(), fd, state});
+            if (group)
+            {
+                group->wait();
+            }
+            // Depth first, the stack holds the unread siblings along one path
+            while (!stack.empty())
+            {
+                Directory directory = std::move(stack.back());
+                stack.pop_back();
+                read(directory);
+            }
+
+            Manifest manifest;
+            size_t total = 0;
+            for (const Manifest& part : parts)
+            {
+                total += part.size();
+            }
+            manifest.reserve(total);
+            for (Manifest& part : parts)
+            {
+                std::move(part.begin(), part.end(), std::back_inserter(manifest));
+            }
+            std::sort(manifest.begin(), manifest.end(), [](const Entry& a, const Entry& b)
+            {
+                return a.path < b.path;
+            });
+            return manifest;
+        }
+
+    private:
+        void spawn(Directory directory)
+        {
+            if (group)
+            {
+                group->run([this, directory]
+                {
+                    read(directory);
+                });
+            }
+            else
+            {
+                stack.push_back(std::move(directory));
+            }
+        }
+
+        // Opens the subdirectory for its own task, the descriptor is given up
+        // when too many directories wait in the queues. A directory which is
+        // gone or not readable is not entered. One which can not be opened for
+        // another reason, e.g. EMFILE, is queued without a descriptor; its task
+        // opens it again and fails the walk if it still can not.
+        void enter(int parent, const char* name, Entry& entry, bool stated, PathFilter::State state)
+        {
+            int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd == -1 && skippable(errno))
+            {
+                return;
+            }
+            if (!stated)
+            {
+                struct statx status;
+                int result = fd != -1 ? statx(fd, "", AT_EMPTY_PATH, statxMask, &status)
+                    : statx(parent, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, statxMask, &status);
+                if (result != 0)
+                {
+                    int error = errno;
+                    if (fd != -1)
+                    {
+                        close(fd);
+                    }
+                    if (skippable(error))
+                    {
+                        return;
+                    }
+                    errno = error;
+                    fail("Failed to stat", root + "/" + entry.path);
+                }
+                fillEntry(entry, status);
+            }
+            if (fd != -1 && openDirectories.fetch_add(1) >= maxOpenDirectories)
+            {
+                --openDirectories;
+                close(fd);
+                fd = -1;
+            }
+            spawn({entry.path, fd, filter != nullptr ? filter->enter(state, name) : 0});
+        }
+
+        void read(const Directory& directory)
+        {
+            int fd = directory.fd;
+            if (fd == -1)
+            {
+                fd = openat(rootFd, directory.path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (fd == -1)
+                {
+                    if (skippable(errno))
+                    {
+                        return;
+                    }
+                    fail("Failed to open", root + "/" + directory.path);
+                }
+            }
+            else
+            {
+                --openDirectories;
+            }
+            FileDescriptor guard(fd);
+
+            std::string prefix = directory.path.empty() ? std::string() : directory.path + "/";
+            Manifest entries;
+            listDirectory(fd, root + "/" + directory.path, [&](const LinuxDirent64* record)
+            {
+                const char* name = record->d_name;
+                // Known types are skipped before any syscall, a skipped directory is never opened
+                if (filter != nullptr && record->d_type != DT_UNKNOWN
+                    && filter->excluded(directory.state, name, record->d_type == DT_DIR))
+                {
+                    return;
+                }
+
+                Entry entry;
+                entry.path = prefix + name;
+                if (record->d_type == DT_DIR)
+                {
+                    // The descriptor of the directory is needed anyway, it is stated through it
+                    enter(fd, name, entry, false, directory.state);
+                    if (entry.mode != 0)
+                    {
+                        entries.push_back(std::move(entry));
+                        return;
+                    }
+                }
+
+                // Everything else, d_type DT_UNKNOWN, and directories which can not be entered
+                struct statx status;
+                if (statx(fd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, statxMask, &status) != 0)
+                {
+                    // Removed since getdents64
+                    if (skippable(errno))
+                    {
+                        return;
+                    }
+                    fail("Failed to stat", root + "/" + entry.path);
+                }
+                fillEntry(entry, status);
+                if (filter != nullptr && record->d_type == DT_UNKNOWN
+                    && filter->excluded(directory.state, name, S_ISDIR(status.stx_mode)))
+                {
+                    return;
+                }
+                if (S_ISDIR(status.stx_mode) && record->d_type != DT_DIR)
+                {
+                    enter(fd, name, entry, true, directory.state);
+                }
+                entries.push_back(std::move(entry));
+            });
+
+            std::lock_guard<std::mutex> lock(mutex);
+            parts.push_back(std::move(entries));
+        }
+
+        std::string root;
+        int rootFd;
+        const PathFilter* filter;
+        std::unique_ptr<TaskGroup> group;
+        // Directories to read when there is no pool
+        std::vector<Directory> stack;
+        std::atomic<size_t> openDirectories{0};
+        std::mutex mutex;
+        std::vector<Manifest> parts;
+    };
+}
+
+Manifest walkTree(const std::string& root, ThreadPool* pool, const PathFilter* filter, const std::string& base)
+{
+    Walker walker(root, pool, filter);
+    return walker.walk(filter != nullptr ? filter->below(base) : 0);
+}
+
+void streamTree(const std::string& root, const PathFilter* filter, const std::function<bool(Entry&)>& visit)
+{
+    SortedWalker walker(root, filter, visit);
+    walker.walk();
+}
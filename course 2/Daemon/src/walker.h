@@ -0,0 +1,30 @@
+#ifndef BACKUP_WALKER_H
+#define BACKUP_WALKER_H
+
+#include "filter.h"
+#include "manifest.h"
+#include "thread_pool.h"
+
+#include <functional>
+#include <string>
+
+// Entries of the tree below root sorted by path, without root itself.
+// Directories are read with getdents64 into 256 KiB buffers and every entry
+// is looked up with statx() relative to the descriptor of its directory, so
+// no path is resolved from the root. A directory found by d_type is opened
+// first and stated through its descriptor instead of by name. With a pool
+// every directory is a task, so subtrees are walked in parallel. Entries the
+// filter skips are neither stated nor listed, nor are the entries below them;
+// `base` is the path of root relative to the root of the filter.
+Manifest walkTree(const std::string& root, ThreadPool* pool = nullptr, const PathFilter* filter = nullptr,
+    const std::string& base = std::string());
+
+// The same entries handed to `visit` in path order while the tree is walked
+// depth first on the calling thread. Only the listings of the directories
+// on the current path are kept, so the memory does not grow with the tree.
+// Each directory is opened by its path relative to the root and closed
+// before its subdirectories, so the depth of the tree does not hold
+// descriptors open. The walk stops when `visit` returns false.
+void streamTree(const std::string& root, const PathFilter* filter, const std::function<bool(Entry&)>& visit);
+
+#endif